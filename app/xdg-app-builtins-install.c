@@ -36,12 +36,19 @@
 
 static char *opt_arch;
 static char **opt_gpg_file;
+static gboolean opt_no_deps;
 
 static GOptionEntry options[] = {
   { "arch", 0, 0, G_OPTION_ARG_STRING, &opt_arch, "Arch to install for", "ARCH" },
   { NULL }
 };
 
+static GOptionEntry options_app[] = {
+  { "arch", 0, 0, G_OPTION_ARG_STRING, &opt_arch, "Arch to install for", "ARCH" },
+  { "no-deps", 0, 0, G_OPTION_ARG_NONE, &opt_no_deps, "Don't install the runtime the app needs", NULL },
+  { NULL }
+};
+
 static GOptionEntry options_bundle[] = {
   { "gpg-file", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_gpg_file, "Check signatures with GPG key from FILE (- for stdin)", "FILE" },
   { NULL }
@@ -94,6 +101,42 @@ read_gpg_data (GCancellable *cancellable,
   return g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (mem_stream));
 }
 
+/* Deploys a ref that has been pulled but isn't installed yet */
+static gboolean
+deploy_new_ref (XdgAppDir    *dir,
+                const char   *repository,
+                const char   *ref,
+                GCancellable *cancellable,
+                GError      **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GFile) deploy_base = NULL;
+  g_autoptr(GFile) origin = NULL;
+  gboolean created_deploy_base = FALSE;
+
+  deploy_base = xdg_app_dir_get_deploy_dir (dir, ref);
+
+  if (!g_file_make_directory_with_parents (deploy_base, cancellable, error))
+    goto out;
+  created_deploy_base = TRUE;
+
+  origin = g_file_get_child (deploy_base, "origin");
+  if (!g_file_replace_contents (origin, repository, strlen (repository), NULL, FALSE,
+                                G_FILE_CREATE_NONE, NULL, cancellable, error))
+    goto out;
+
+  if (!xdg_app_dir_deploy (dir, ref, NULL, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+
+ out:
+  if (created_deploy_base && !ret)
+    gs_shutil_rm_rf (deploy_base, cancellable, NULL);
+
+  return ret;
+}
+
 gboolean
 xdg_app_builtin_install_runtime (int argc, char **argv, GCancellable *cancellable, GError **error)
 {
@@ -101,12 +144,10 @@ xdg_app_builtin_install_runtime (int argc, char **argv, GCancellable *cancellabl
   g_autoptr(GOptionContext) context = NULL;
   g_autoptr(XdgAppDir) dir = NULL;
   g_autoptr(GFile) deploy_base = NULL;
-  g_autoptr(GFile) origin = NULL;
   const char *repository;
   const char *runtime;
   const char *branch = "master";
   g_autofree char *ref = NULL;
-  gboolean created_deploy_base = FALSE;
 
   context = g_option_context_new ("REPOSITORY RUNTIME [BRANCH] - Install a runtime");
 
@@ -145,20 +186,11 @@ xdg_app_builtin_install_runtime (int argc, char **argv, GCancellable *cancellabl
       goto out;
     }
 
-  if (!xdg_app_dir_pull (dir, repository, ref,
+  if (!xdg_app_dir_pull (dir, repository, ref, NULL,
                          cancellable, error))
     goto out;
 
-  if (!g_file_make_directory_with_parents (deploy_base, cancellable, error))
-    goto out;
-  created_deploy_base = TRUE;
-
-  origin = g_file_get_child (deploy_base, "origin");
-  if (!g_file_replace_contents (origin, repository, strlen (repository), NULL, FALSE,
-                                G_FILE_CREATE_NONE, NULL, cancellable, error))
-    goto out;
-
-  if (!xdg_app_dir_deploy (dir, ref, NULL, cancellable, error))
+  if (!deploy_new_ref (dir, repository, ref, cancellable, error))
     goto out;
 
   xdg_app_dir_cleanup_removed (dir, cancellable, NULL);
@@ -166,12 +198,158 @@ xdg_app_builtin_install_runtime (int argc, char **argv, GCancellable *cancellabl
   ret = TRUE;
 
  out:
-  if (created_deploy_base && !ret)
-    gs_shutil_rm_rf (deploy_base, cancellable, NULL);
-
   return ret;
 }
 
+/* Reads the metadata of the commit that was pulled for ref */
+static GKeyFile *
+load_pulled_metadata (XdgAppDir    *dir,
+                      const char   *repository,
+                      const char   *ref,
+                      GCancellable *cancellable,
+                      GError      **error)
+{
+  OstreeRepo *repo = xdg_app_dir_get_repo (dir);
+  g_autofree char *origin_and_ref = NULL;
+  g_autofree char *checksum = NULL;
+  g_autoptr(GFile) root = NULL;
+  g_autoptr(GFile) metadata_file = NULL;
+  g_autofree char *metadata = NULL;
+  gsize metadata_size;
+  g_autoptr(GKeyFile) metakey = NULL;
+
+  origin_and_ref = g_strdup_printf ("%s:%s", repository, ref);
+  if (!ostree_repo_resolve_rev (repo, origin_and_ref, FALSE, &checksum, error))
+    return NULL;
+
+  if (!ostree_repo_read_commit (repo, checksum, &root, NULL, cancellable, error))
+    return NULL;
+
+  metadata_file = g_file_get_child (root, "metadata");
+  if (!g_file_load_contents (metadata_file, cancellable, &metadata, &metadata_size, NULL, error))
+    return NULL;
+
+  metakey = g_key_file_new ();
+  if (!g_key_file_load_from_data (metakey, metadata, metadata_size, 0, error))
+    return NULL;
+
+  return g_steal_pointer (&metakey);
+}
+
+/* Returns the ref of the runtime the app needs, if it isn't
+   installed in either the user or the system installation */
+static char *
+get_missing_runtime (GKeyFile *metakey)
+{
+  g_autofree char *runtime = NULL;
+  g_autofree char *runtime_ref = NULL;
+  g_autoptr(GFile) deploy = NULL;
+
+  runtime = g_key_file_get_string (metakey, "Application", "runtime", NULL);
+  if (runtime == NULL)
+    return NULL;
+
+  runtime_ref = g_build_filename ("runtime", runtime, NULL);
+  deploy = xdg_app_find_deploy_dir_for_ref (runtime_ref, NULL, NULL);
+  if (deploy != NULL)
+    return NULL;
+
+  return g_steal_pointer (&runtime_ref);
+}
+
+/* Pulls the app, and unless --no-deps was given its runtime if that is
+ * missing, which is returned in runtime_ref_out. When ostree can pull
+ * just the metadata file of a commit, that is fetched first, so that
+ * the app and the runtime can then be pulled together. The runtime is
+ * optional here: if it can't be pulled the app is still installed. */
+static gboolean
+pull_app_and_runtime (XdgAppDir    *dir,
+                      const char   *repository,
+                      const char   *ref,
+                      char        **runtime_ref_out,
+                      GCancellable *cancellable,
+                      GError      **error)
+{
+  g_autoptr(GKeyFile) metakey = NULL;
+  g_autofree char *runtime_ref = NULL;
+  g_autoptr(GError) my_error = NULL;
+
+  *runtime_ref_out = NULL;
+
+  if (opt_no_deps)
+    return xdg_app_dir_pull (dir, repository, ref, NULL, cancellable, error);
+
+#ifdef HAVE_OSTREE_REPO_PULL_ONE_DIR
+  {
+    const char *refs[2] = { ref, NULL };
+
+    /* ostree marks commits pulled this way as partial, so the
+       full pull below still fetches everything */
+    if (!ostree_repo_pull_one_dir (xdg_app_dir_get_repo (dir), repository, "/metadata",
+                                   (char **)refs, OSTREE_REPO_PULL_FLAGS_NONE, NULL,
+                                   cancellable, error))
+      {
+        g_prefix_error (error, "While pulling metadata of %s from remote %s: ", ref, repository);
+        return FALSE;
+      }
+
+    metakey = load_pulled_metadata (dir, repository, ref, cancellable, error);
+    if (metakey == NULL)
+      return FALSE;
+
+    runtime_ref = get_missing_runtime (metakey);
+    if (runtime_ref != NULL)
+      {
+        const char *both_refs[3] = { ref, runtime_ref, NULL };
+
+        if (xdg_app_dir_pull_refs (dir, repository, both_refs, NULL, cancellable, &my_error))
+          {
+            *runtime_ref_out = g_steal_pointer (&runtime_ref);
+            return TRUE;
+          }
+
+        if (g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+          {
+            g_propagate_error (error, g_steal_pointer (&my_error));
+            return FALSE;
+          }
+
+        g_printerr ("Not installing runtime %s: %s\n", runtime_ref, my_error->message);
+        g_clear_pointer (&runtime_ref, g_free);
+      }
+
+    if (!xdg_app_dir_pull (dir, repository, ref, NULL, cancellable, error))
+      return FALSE;
+  }
+#else
+  if (!xdg_app_dir_pull (dir, repository, ref, NULL, cancellable, error))
+    return FALSE;
+
+  metakey = load_pulled_metadata (dir, repository, ref, cancellable, error);
+  if (metakey == NULL)
+    return FALSE;
+
+  runtime_ref = get_missing_runtime (metakey);
+  if (runtime_ref != NULL)
+    {
+      if (!xdg_app_dir_pull (dir, repository, runtime_ref, NULL, cancellable, &my_error))
+        {
+          if (g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            {
+              g_propagate_error (error, g_steal_pointer (&my_error));
+              return FALSE;
+            }
+
+          g_printerr ("Not installing runtime %s: %s\n", runtime_ref, my_error->message);
+          g_clear_pointer (&runtime_ref, g_free);
+        }
+    }
+#endif
+
+  *runtime_ref_out = g_steal_pointer (&runtime_ref);
+  return TRUE;
+}
+
 gboolean
 xdg_app_builtin_install_app (int argc, char **argv, GCancellable *cancellable, GError **error)
 {
@@ -184,11 +362,12 @@ xdg_app_builtin_install_app (int argc, char **argv, GCancellable *cancellable, G
   const char *app;
   const char *branch = "master";
   g_autofree char *ref = NULL;
+  g_autofree char *runtime_ref = NULL;
   gboolean created_deploy_base = FALSE;
 
   context = g_option_context_new ("REPOSITORY APP [BRANCH] - Install an application");
 
-  if (!xdg_app_option_context_parse (context, options, &argc, &argv, 0, &dir, cancellable, error))
+  if (!xdg_app_option_context_parse (context, options_app, &argc, &argv, 0, &dir, cancellable, error))
     goto out;
 
   if (argc < 3)
@@ -223,10 +402,18 @@ xdg_app_builtin_install_app (int argc, char **argv, GCancellable *cancellable, G
       goto out;
     }
 
-  if (!xdg_app_dir_pull (dir, repository, ref,
-                         cancellable, error))
+  if (!pull_app_and_runtime (dir, repository, ref, &runtime_ref,
+                             cancellable, error))
     goto out;
 
+  /* The runtime goes first, so the app is never installed without it */
+  if (runtime_ref != NULL)
+    {
+      g_print ("Installing runtime %s\n", runtime_ref);
+      if (!deploy_new_ref (dir, repository, runtime_ref, cancellable, error))
+        goto out;
+    }
+
   if (!g_file_make_directory_with_parents (deploy_base, cancellable, error))
     goto out;
   created_deploy_base = TRUE;
@@ -260,6 +447,167 @@ xdg_app_builtin_install_app (int argc, char **argv, GCancellable *cancellable, G
 #define OSTREE_STATIC_DELTA_FALLBACK_FORMAT "(yaytt)"
 #define OSTREE_STATIC_DELTA_SUPERBLOCK_FORMAT "(a{sv}tayay" OSTREE_COMMIT_GVARIANT_STRING "aya" OSTREE_STATIC_DELTA_META_ENTRY_FORMAT "a" OSTREE_STATIC_DELTA_FALLBACK_FORMAT ")"
 
+/* Each object in a delta part header is a type byte and a checksum */
+#define DELTA_OBJECT_SIZE (1 + 32)
+
+/* ostree writes the objects of each part of the delta straight into
+ * the repo and skips the parts whose objects are all there already,
+ * so an interrupted bundle install picks up where it stopped. We
+ * look at the same thing to report progress.
+ *
+ * This polls the repo from another thread while the delta is being
+ * applied to it. That is safe because ostree_repo_has_object only
+ * stats the object paths under the repo's directories, which don't
+ * change once the repo is open. ostree's own pull code does the same,
+ * calling it on the main thread while its object writes run in worker
+ * threads. */
+typedef struct {
+  OstreeRepo *repo;
+  GVariant *delta_parts;
+  gboolean byteswap;
+  guint n_done_parts;
+  guint64 done_bytes;
+  guint done_objects;
+  guint64 total_bytes;
+  guint total_objects;
+  volatile gint finished;
+} BundleProgress;
+
+static gboolean
+delta_part_is_complete (OstreeRepo *repo,
+                        GVariant   *part)
+{
+  g_autoptr(GVariant) objects = NULL;
+  const guchar *data;
+  gsize n_bytes, i;
+
+  objects = g_variant_get_child_value (part, 4);
+  data = g_variant_get_fixed_array (objects, &n_bytes, 1);
+
+  for (i = 0; i + DELTA_OBJECT_SIZE <= n_bytes; i += DELTA_OBJECT_SIZE)
+    {
+      g_autofree char *checksum = ostree_checksum_from_bytes (data + i + 1);
+      gboolean have_object;
+
+      if (!ostree_repo_has_object (repo, (OstreeObjectType)data[i], checksum,
+                                   &have_object, NULL, NULL) ||
+          !have_object)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* The header fields of a delta are in the byte order of the machine
+   that generated it, which is recorded in its metadata. Like ostree,
+   assume the host order if it isn't. */
+static gboolean
+delta_needs_byteswap (GVariant *metadata)
+{
+  guint8 endianness;
+
+  if (!g_variant_lookup (metadata, "ostree.endianness", "y", &endianness))
+    return FALSE;
+
+  switch (endianness)
+    {
+    case 'l':
+      return G_BYTE_ORDER != G_LITTLE_ENDIAN;
+    case 'B':
+      return G_BYTE_ORDER != G_BIG_ENDIAN;
+    default:
+      return FALSE;
+    }
+}
+
+static guint64
+delta_part_get_size (GVariant *part,
+                     gboolean  byteswap)
+{
+  guint64 size;
+
+  g_variant_get_child (part, 2, "t", &size);
+  return byteswap ? GUINT64_SWAP_LE_BE (size) : size;
+}
+
+/* Moves past the parts that are now in the repo. ostree applies
+   them in order, so we only ever need to look at the next one. */
+static void
+bundle_progress_update (BundleProgress *progress)
+{
+  guint n_parts = g_variant_n_children (progress->delta_parts);
+
+  while (progress->n_done_parts < n_parts)
+    {
+      g_autoptr(GVariant) part = g_variant_get_child_value (progress->delta_parts,
+                                                             progress->n_done_parts);
+      g_autoptr(GVariant) objects = NULL;
+
+      if (!delta_part_is_complete (progress->repo, part))
+        break;
+
+      objects = g_variant_get_child_value (part, 4);
+
+      progress->done_bytes += delta_part_get_size (part, progress->byteswap);
+      progress->done_objects += g_variant_get_size (objects) / DELTA_OBJECT_SIZE;
+      progress->n_done_parts++;
+    }
+}
+
+static gpointer
+bundle_progress_thread (gpointer user_data)
+{
+  BundleProgress *progress = user_data;
+  GSConsole *console = gs_console_get ();
+
+  while (!g_atomic_int_get (&progress->finished))
+    {
+      g_autofree char *done_size = NULL;
+      g_autofree char *total_size = NULL;
+      g_autofree char *status = NULL;
+
+      bundle_progress_update (progress);
+
+      done_size = g_format_size (progress->done_bytes);
+      total_size = g_format_size (progress->total_bytes);
+      status = g_strdup_printf ("Installing bundle: %u/%u objects, %s/%s",
+                                progress->done_objects, progress->total_objects,
+                                done_size, total_size);
+      gs_console_begin_status_line (console, status, NULL, NULL);
+
+      g_usleep (G_USEC_PER_SEC / 5);
+    }
+
+  return NULL;
+}
+
+static void
+bundle_progress_init (BundleProgress *progress,
+                      OstreeRepo     *repo,
+                      GVariant       *delta_parts,
+                      gboolean        byteswap)
+{
+  GVariantIter iter;
+  GVariant *part;
+
+  memset (progress, 0, sizeof (*progress));
+  progress->repo = repo;
+  progress->delta_parts = delta_parts;
+  progress->byteswap = byteswap;
+
+  g_variant_iter_init (&iter, delta_parts);
+  while ((part = g_variant_iter_next_value (&iter)))
+    {
+      g_autoptr(GVariant) objects = g_variant_get_child_value (part, 4);
+
+      progress->total_bytes += delta_part_get_size (part, byteswap);
+      progress->total_objects += g_variant_get_size (objects) / DELTA_OBJECT_SIZE;
+      g_variant_unref (part);
+    }
+
+  bundle_progress_update (progress);
+}
+
 gboolean
 xdg_app_builtin_install_bundle (int argc, char **argv, GCancellable *cancellable, GError **error)
 {
@@ -283,6 +631,13 @@ xdg_app_builtin_install_bundle (int argc, char **argv, GCancellable *cancellable
   OstreeRepo *repo;
   g_autoptr(OstreeGpgVerifyResult) gpg_result = NULL;
   g_autoptr(GError) my_error = NULL;
+  g_autoptr(GVariant) delta_parts = NULL;
+  BundleProgress progress;
+  GThread *progress_thread = NULL;
+  GSConsole *console;
+  gboolean transaction_resume = FALSE;
+  gboolean delta_byteswap;
+  gboolean res;
 
   context = g_option_context_new ("BUNDLE - Install a application or runtime from a bundle");
 
@@ -325,7 +680,10 @@ xdg_app_builtin_install_bundle (int argc, char **argv, GCancellable *cancellable
 
     to_checksum = ostree_checksum_from_bytes_v (to_csum_v);
 
+    delta_parts = g_variant_get_child_value (delta, 6);
+
     metadata = g_variant_get_child_value (delta, 0);
+    delta_byteswap = delta_needs_byteswap (metadata);
 
     if (!g_variant_lookup (metadata, "ref", "s", &ref))
       return xdg_app_fail (error, "Invalid bundle, no ref in metadata");
@@ -349,7 +707,17 @@ xdg_app_builtin_install_bundle (int argc, char **argv, GCancellable *cancellable
 
   deploy_base = xdg_app_dir_get_deploy_dir (dir, ref);
   if (g_file_query_exists (deploy_base, cancellable))
-    return xdg_app_fail (error, "%s branch %s already installed", parts[1], parts[3]);
+    {
+      g_autofree char *active = xdg_app_dir_read_active (dir, ref, cancellable);
+
+      if (active != NULL)
+        return xdg_app_fail (error, "%s branch %s already installed", parts[1], parts[3]);
+
+      /* Left behind by an install that was interrupted before it
+         deployed anything */
+      if (!gs_shutil_rm_rf (deploy_base, cancellable, error))
+        return FALSE;
+    }
 
   if (opt_gpg_file != NULL)
     {
@@ -381,16 +749,36 @@ xdg_app_builtin_install_bundle (int argc, char **argv, GCancellable *cancellable
       while (remote == NULL);
     }
 
-  if (!ostree_repo_prepare_transaction (repo, NULL, cancellable, error))
+  if (!ostree_repo_prepare_transaction (repo, &transaction_resume, cancellable, error))
     return FALSE;
 
   ostree_repo_transaction_set_ref (repo, remote, ref, to_checksum);
 
-  if (!ostree_repo_static_delta_execute_offline (repo,
-                                                 file,
-                                                 FALSE,
-                                                 cancellable,
-                                                 error))
+  bundle_progress_init (&progress, repo, delta_parts, delta_byteswap);
+  if (progress.n_done_parts > 0)
+    g_print ("Resuming install, %u of %u parts already done\n",
+             progress.n_done_parts, (guint)g_variant_n_children (delta_parts));
+  else if (transaction_resume)
+    g_debug ("Resuming interrupted transaction");
+
+  console = gs_console_get ();
+  if (console)
+    progress_thread = g_thread_new ("bundle-progress", bundle_progress_thread, &progress);
+
+  res = ostree_repo_static_delta_execute_offline (repo,
+                                                  file,
+                                                  FALSE,
+                                                  cancellable,
+                                                  error);
+
+  if (progress_thread)
+    {
+      g_atomic_int_set (&progress.finished, TRUE);
+      g_thread_join (progress_thread);
+      gs_console_end_status_line (console, NULL, NULL);
+    }
+
+  if (!res)
     return FALSE;
 
   if (gpg_data)
@@ -32,7 +32,6 @@
 
 #include "xdg-app-builtins.h"
 #include "xdg-app-utils.h"
-#include "xdg-app-dbus.h"
 #include "xdg-app-run.h"
 
 static char *opt_arch;
@@ -40,6 +39,7 @@ static char *opt_branch;
 static char *opt_command;
 static gboolean opt_devel;
 static char *opt_runtime;
+static gboolean opt_zygote;
 
 static GOptionEntry options[] = {
   { "arch", 0, 0, G_OPTION_ARG_STRING, &opt_arch, "Arch to use", "ARCH" },
@@ -47,9 +47,29 @@ static GOptionEntry options[] = {
   { "branch", 0, 0, G_OPTION_ARG_STRING, &opt_branch, "Branch to use", "BRANCH" },
   { "devel", 'd', 0, G_OPTION_ARG_NONE, &opt_devel, "Use development runtime", NULL },
   { "runtime", 0, 0, G_OPTION_ARG_STRING, &opt_runtime, "Runtime to use", "RUNTIME" },
+  { "zygote", 0, 0, G_OPTION_ARG_NONE, &opt_zygote, "Reuse the sandbox of a running instance, if possible", NULL },
   { NULL }
 };
 
+/* When profiling launches (see tests/bench-launch.sh) the front end
+   phases are written here, before the helper appends its own trace */
+static int trace_fd = -1;
+
+static void
+trace_phase (const char *name,
+             gint64      start)
+{
+  g_autofree char *line = NULL;
+
+  if (trace_fd == -1)
+    return;
+
+  line = g_strdup_printf ("%" G_GINT64_FORMAT " %" G_GINT64_FORMAT " run:%s\n",
+                          start, g_get_monotonic_time (), name);
+  if (write (trace_fd, line, strlen (line)) < 0)
+    trace_fd = -1;
+}
+
 static void
 dbus_spawn_child_setup (gpointer user_data)
 {
@@ -57,12 +77,253 @@ dbus_spawn_child_setup (gpointer user_data)
   fcntl (fd, F_SETFD, 0);
 }
 
+/* The D-Bus calls needed before starting the sandbox are made
+   concurrently and share this deadline, so that a missing or stuck
+   service can only delay the launch this long */
+#define DBUS_SETUP_TIMEOUT_MSEC 5000
+
+typedef struct {
+  int pending;
+  GCancellable *cancellable;
+  GDBusConnection *session_bus;
+  char *monitor_path;
+  char *doc_mount_path;
+} DBusSetup;
+
+static void
+dbus_setup_warn (const char *what,
+                 GError     *error)
+{
+  if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    g_warning ("%s: %s", what, error->message);
+}
+
+static void
+request_monitor_cb (GObject      *source_object,
+                    GAsyncResult *res,
+                    gpointer      user_data)
+{
+  DBusSetup *setup = user_data;
+  g_autoptr(GVariant) reply = NULL;
+
+  reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, NULL);
+  if (reply)
+    g_variant_get (reply, "(^ay)", &setup->monitor_path);
+
+  setup->pending--;
+}
+
+static void
+get_mount_point_cb (GObject      *source_object,
+                    GAsyncResult *res,
+                    gpointer      user_data)
+{
+  DBusSetup *setup = user_data;
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &local_error);
+  if (reply)
+    g_variant_get (reply, "(^ay)", &setup->doc_mount_path);
+  else
+    dbus_setup_warn ("Can't get document portal", local_error);
+
+  setup->pending--;
+}
+
+static void
+session_bus_ready_cb (GObject      *source_object,
+                      GAsyncResult *res,
+                      gpointer      user_data)
+{
+  DBusSetup *setup = user_data;
+
+  setup->session_bus = g_bus_get_finish (res, NULL);
+  if (setup->session_bus)
+    {
+      setup->pending += 2;
+
+      g_dbus_connection_call (setup->session_bus,
+                              "org.freedesktop.XdgApp",
+                              "/org/freedesktop/XdgApp/SessionHelper",
+                              "org.freedesktop.XdgApp.SessionHelper",
+                              "RequestMonitor",
+                              NULL, G_VARIANT_TYPE ("(ay)"),
+                              G_DBUS_CALL_FLAGS_NONE, -1,
+                              setup->cancellable,
+                              request_monitor_cb, setup);
+
+      g_dbus_connection_call (setup->session_bus,
+                              "org.freedesktop.portal.Documents",
+                              "/org/freedesktop/portal/documents",
+                              "org.freedesktop.portal.Documents",
+                              "GetMountPoint",
+                              NULL, G_VARIANT_TYPE ("(ay)"),
+                              G_DBUS_CALL_FLAGS_NONE, -1,
+                              setup->cancellable,
+                              get_mount_point_cb, setup);
+    }
+
+  setup->pending--;
+}
+
+static void
+transient_unit_cb (GObject      *source_object,
+                   GAsyncResult *res,
+                   gpointer      user_data)
+{
+  DBusSetup *setup = user_data;
+  g_autoptr(GError) local_error = NULL;
+
+  if (!xdg_app_run_in_transient_unit_finish (res, &local_error))
+    dbus_setup_warn ("Can't move to transient unit", local_error);
+
+  setup->pending--;
+}
+
+static gboolean
+dbus_setup_timeout_cb (gpointer user_data)
+{
+  DBusSetup *setup = user_data;
+
+  g_cancellable_cancel (setup->cancellable);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Gets the session helper monitor and the document portal mount, and
+   moves us into a transient systemd unit for the app. This must run
+   before spawning a dbus proxy of our own, to ensure it ends up in the
+   app cgroup. The shared session proxy lives in the cgroup of the
+   session helper instead, so traffic it proxies is not accounted to
+   the app. */
+static void
+run_dbus_setup (const char  *app,
+                char       **monitor_path,
+                char       **doc_mount_path)
+{
+  GMainContext *main_context;
+  GSource *timeout;
+  DBusSetup setup = { 0 };
+
+  main_context = g_main_context_new ();
+  g_main_context_push_thread_default (main_context);
+
+  setup.cancellable = g_cancellable_new ();
+
+  timeout = g_timeout_source_new (DBUS_SETUP_TIMEOUT_MSEC);
+  g_source_set_callback (timeout, dbus_setup_timeout_cb, &setup, NULL);
+  g_source_attach (timeout, main_context);
+
+  setup.pending = 2;
+  g_bus_get (G_BUS_TYPE_SESSION, setup.cancellable, session_bus_ready_cb, &setup);
+  xdg_app_run_in_transient_unit_async (app, setup.cancellable, transient_unit_cb, &setup);
+
+  /* On timeout everything is cancelled, so this still terminates */
+  while (setup.pending > 0)
+    g_main_context_iteration (main_context, TRUE);
+
+  g_source_destroy (timeout);
+  g_source_unref (timeout);
+  g_object_unref (setup.cancellable);
+  g_clear_object (&setup.session_bus);
+
+  g_main_context_pop_thread_default (main_context);
+  g_main_context_unref (main_context);
+
+  *monitor_path = setup.monitor_path;
+  *doc_mount_path = setup.doc_mount_path;
+}
+
+/* Resolves everything about the launch that only depends on what is
+   installed: the runtime, the extensions and the merged permissions */
+static GKeyFile *
+build_launch_plan (const char   *app_ref,
+                   GCancellable *cancellable,
+                   GError      **error)
+{
+  g_autoptr(XdgAppDeploy) app_deploy = NULL;
+  g_autoptr(XdgAppDeploy) runtime_deploy = NULL;
+  g_autoptr(GKeyFile) metakey = NULL;
+  g_autoptr(GKeyFile) runtime_metakey = NULL;
+  g_autoptr(GKeyFile) plan = NULL;
+  g_autoptr(GFile) app_files = NULL;
+  g_autoptr(GFile) runtime_files = NULL;
+  g_autoptr(GPtrArray) extension_args = NULL;
+  g_autoptr(XdgAppContext) app_context = NULL;
+  g_autoptr(XdgAppContext) overrides = NULL;
+  g_autofree char *runtime = NULL;
+  g_autofree char *runtime_ref = NULL;
+  g_autofree char *default_command = NULL;
+
+  app_deploy = xdg_app_find_deploy_for_ref (app_ref, cancellable, error);
+  if (app_deploy == NULL)
+    return NULL;
+
+  metakey = xdg_app_deploy_get_metadata (app_deploy);
+
+  extension_args = g_ptr_array_new_with_free_func (g_free);
+
+  if (!xdg_app_run_add_extension_args (extension_args, metakey, app_ref, cancellable, error))
+    return NULL;
+
+  if (opt_runtime)
+    runtime = g_strdup (opt_runtime);
+  else
+    {
+      runtime = g_key_file_get_string (metakey, "Application", opt_devel ? "sdk" : "runtime", error);
+      if (runtime == NULL)
+        return NULL;
+    }
+
+  runtime_ref = g_build_filename ("runtime", runtime, NULL);
+
+  runtime_deploy = xdg_app_find_deploy_for_ref (runtime_ref, cancellable, error);
+  if (runtime_deploy == NULL)
+    return NULL;
+
+  runtime_metakey = xdg_app_deploy_get_metadata (runtime_deploy);
+
+  app_context = xdg_app_context_new ();
+  xdg_app_context_set_session_bus_policy (app_context, "org.freedesktop.portal.Documents", XDG_APP_POLICY_TALK);
+
+  if (!xdg_app_context_load_metadata (app_context, runtime_metakey, error))
+    return NULL;
+  if (!xdg_app_context_load_metadata (app_context, metakey, error))
+    return NULL;
+
+  overrides = xdg_app_deploy_get_overrides (app_deploy);
+  xdg_app_context_merge (app_context, overrides);
+
+  if (!xdg_app_run_add_extension_args (extension_args, runtime_metakey, runtime_ref, cancellable, error))
+    return NULL;
+
+  app_files = xdg_app_deploy_get_files (app_deploy);
+  runtime_files = xdg_app_deploy_get_files (runtime_deploy);
+
+  default_command = g_key_file_get_string (metakey, "Application", "command", error);
+  if (default_command == NULL)
+    return NULL;
+
+  plan = g_key_file_new ();
+  xdg_app_context_save_metadata (app_context, plan);
+  g_key_file_set_string (plan, XDG_APP_LAUNCH_PLAN_GROUP, XDG_APP_LAUNCH_PLAN_KEY_RUNTIME, runtime_ref);
+  g_key_file_set_string (plan, XDG_APP_LAUNCH_PLAN_GROUP, XDG_APP_LAUNCH_PLAN_KEY_APP_FILES,
+                         gs_file_get_path_cached (app_files));
+  g_key_file_set_string (plan, XDG_APP_LAUNCH_PLAN_GROUP, XDG_APP_LAUNCH_PLAN_KEY_RUNTIME_FILES,
+                         gs_file_get_path_cached (runtime_files));
+  g_key_file_set_string (plan, XDG_APP_LAUNCH_PLAN_GROUP, XDG_APP_LAUNCH_PLAN_KEY_COMMAND, default_command);
+  g_key_file_set_string_list (plan, XDG_APP_LAUNCH_PLAN_GROUP, XDG_APP_LAUNCH_PLAN_KEY_EXTENSION_ARGS,
+                              (const char * const *)extension_args->pdata, extension_args->len);
+
+  return g_steal_pointer (&plan);
+}
+
 gboolean
 xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **error)
 {
   g_autoptr(GOptionContext) context = NULL;
-  g_autoptr(XdgAppDeploy) app_deploy = NULL;
-  g_autoptr(XdgAppDeploy) runtime_deploy = NULL;
+  g_autoptr(GKeyFile) launch_plan = NULL;
   g_autoptr(GFile) app_files = NULL;
   g_autoptr(GFile) runtime_files = NULL;
   g_autoptr(GFile) app_id_dir = NULL;
@@ -72,28 +333,36 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
   g_autoptr(GFile) home = NULL;
   g_autoptr(GFile) user_font1 = NULL;
   g_autoptr(GFile) user_font2 = NULL;
-  g_autoptr(XdgAppSessionHelper) session_helper = NULL;
-  g_autofree char *runtime = NULL;
   g_autofree char *default_command = NULL;
-  g_autofree char *runtime_ref = NULL;
+  g_autofree char *app_files_path = NULL;
+  g_autofree char *runtime_files_path = NULL;
   g_autofree char *app_ref = NULL;
   g_autofree char *doc_mount_path = NULL;
-  g_autoptr(GKeyFile) metakey = NULL;
-  g_autoptr(GKeyFile) runtime_metakey = NULL;
+  g_auto(GStrv) extension_args = NULL;
   g_autoptr(GPtrArray) argv_array = NULL;
   g_auto(GStrv) envp = NULL;
   g_autoptr(GPtrArray) dbus_proxy_argv = NULL;
   g_autofree char *monitor_path = NULL;
+  g_autofree char *zygote_path = NULL;
   const char *app;
   const char *branch = "master";
   const char *command = "/bin/sh";
+  const char *trace_fd_env;
+  gboolean save_launch_plan = FALSE;
+  gint64 start_time, phase_start;
   int i;
   int rest_argv_start, rest_argc;
   int sync_proxy_pipes[2];
+  int shared_proxy_fd;
   g_autoptr(XdgAppContext) arg_context = NULL;
   g_autoptr(XdgAppContext) app_context = NULL;
-  g_autoptr(XdgAppContext) overrides = NULL;
-  g_autoptr(GDBusConnection) session_bus = NULL;
+
+  start_time = g_get_monotonic_time ();
+
+  /* For profiling launches, the helper writes a trace of its setup here */
+  trace_fd_env = g_getenv ("XDG_APP_TRACE_FD");
+  if (trace_fd_env != NULL)
+    trace_fd = atoi (trace_fd_env);
 
   context = g_option_context_new ("APP [args...] - Run an app");
 
@@ -132,56 +401,48 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
 
   app_ref = xdg_app_build_app_ref (app, branch, opt_arch);
 
-  app_deploy = xdg_app_find_deploy_for_ref (app_ref, cancellable, error);
-  if (app_deploy == NULL)
-    return FALSE;
-
-  metakey = xdg_app_deploy_get_metadata (app_deploy);
+  /* Resolving the runtime, extensions and permissions gives the same
+     result every time unless something was installed or overridden,
+     so reuse what the last launch of this app came up with */
+  phase_start = g_get_monotonic_time ();
+  launch_plan = xdg_app_run_load_launch_plan (app_ref, opt_runtime, opt_devel);
+  if (launch_plan == NULL)
+    {
+      launch_plan = build_launch_plan (app_ref, cancellable, error);
+      if (launch_plan == NULL)
+        return FALSE;
+      save_launch_plan = TRUE;
+    }
+  trace_phase (save_launch_plan ? "launch-plan" : "launch-plan-cached", phase_start);
 
   argv_array = g_ptr_array_new_with_free_func (g_free);
   dbus_proxy_argv = g_ptr_array_new_with_free_func (g_free);
   g_ptr_array_add (argv_array, g_strdup (HELPER));
   g_ptr_array_add (argv_array, g_strdup ("-l"));
 
-  if (!xdg_app_run_add_extension_args (argv_array, metakey, app_ref, cancellable, error))
-    return FALSE;
-
-  if (opt_runtime)
-    runtime = opt_runtime;
-  else
+  if (trace_fd_env != NULL)
     {
-      runtime = g_key_file_get_string (metakey, "Application", opt_devel ? "sdk" : "runtime", error);
-      if (*error)
-        return FALSE;
+      g_ptr_array_add (argv_array, g_strdup ("-t"));
+      g_ptr_array_add (argv_array, g_strdup (trace_fd_env));
     }
 
-  runtime_ref = g_build_filename ("runtime", runtime, NULL);
-
-  runtime_deploy = xdg_app_find_deploy_for_ref (runtime_ref, cancellable, error);
-  if (runtime_deploy == NULL)
-    return FALSE;
-
-  runtime_metakey = xdg_app_deploy_get_metadata (runtime_deploy);
+  extension_args = g_key_file_get_string_list (launch_plan, XDG_APP_LAUNCH_PLAN_GROUP,
+                                               XDG_APP_LAUNCH_PLAN_KEY_EXTENSION_ARGS, NULL, NULL);
+  for (i = 0; extension_args != NULL && extension_args[i] != NULL; i++)
+    g_ptr_array_add (argv_array, g_strdup (extension_args[i]));
 
   app_context = xdg_app_context_new ();
-  xdg_app_context_set_session_bus_policy (app_context, "org.freedesktop.portal.Documents", XDG_APP_POLICY_TALK);
-
-  if (!xdg_app_context_load_metadata (app_context, runtime_metakey, error))
+  if (!xdg_app_context_load_metadata (app_context, launch_plan, error))
     return FALSE;
-  if (!xdg_app_context_load_metadata (app_context, metakey, error))
-    return FALSE;
-
-  overrides = xdg_app_deploy_get_overrides (app_deploy);
-  xdg_app_context_merge (app_context, overrides);
 
   xdg_app_context_merge (app_context, arg_context);
 
-  if (!xdg_app_run_add_extension_args (argv_array, runtime_metakey, runtime_ref, cancellable, error))
-    return FALSE;
-
   if ((app_id_dir = xdg_app_ensure_data_dir (app, cancellable, error)) == NULL)
       return FALSE;
 
+  if (save_launch_plan)
+    xdg_app_run_save_launch_plan (launch_plan, app_ref, opt_runtime, opt_devel);
+
   app_cache_dir = g_file_get_child (app_id_dir, "cache");
   g_ptr_array_add (argv_array, g_strdup ("-B"));
   g_ptr_array_add (argv_array, g_strdup_printf ("/var/cache=%s", gs_file_get_path_cached (app_cache_dir)));
@@ -194,60 +455,71 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
   g_ptr_array_add (argv_array, g_strdup ("-B"));
   g_ptr_array_add (argv_array, g_strdup_printf ("/var/config=%s", gs_file_get_path_cached (app_config_dir)));
 
-  app_files = xdg_app_deploy_get_files (app_deploy);
-  runtime_files = xdg_app_deploy_get_files (runtime_deploy);
+  app_files_path = g_key_file_get_string (launch_plan, XDG_APP_LAUNCH_PLAN_GROUP,
+                                          XDG_APP_LAUNCH_PLAN_KEY_APP_FILES, error);
+  if (app_files_path == NULL)
+    return FALSE;
+  app_files = g_file_new_for_path (app_files_path);
 
-  default_command = g_key_file_get_string (metakey, "Application", "command", error);
-  if (*error)
+  runtime_files_path = g_key_file_get_string (launch_plan, XDG_APP_LAUNCH_PLAN_GROUP,
+                                              XDG_APP_LAUNCH_PLAN_KEY_RUNTIME_FILES, error);
+  if (runtime_files_path == NULL)
+    return FALSE;
+  runtime_files = g_file_new_for_path (runtime_files_path);
+
+  default_command = g_key_file_get_string (launch_plan, XDG_APP_LAUNCH_PLAN_GROUP,
+                                           XDG_APP_LAUNCH_PLAN_KEY_COMMAND, error);
+  if (default_command == NULL)
     return FALSE;
   if (opt_command)
     command = opt_command;
   else
     command = default_command;
 
-  session_helper = xdg_app_session_helper_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
-								  G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
-								  "org.freedesktop.XdgApp",
-								  "/org/freedesktop/XdgApp/SessionHelper",
-								  NULL, NULL);
-  if (session_helper &&
-      xdg_app_session_helper_call_request_monitor_sync (session_helper,
-                                                        &monitor_path,
-                                                        NULL, NULL))
+  envp = g_get_environ ();
+  envp = xdg_app_run_apply_env_default (envp);
+
+  envp = xdg_app_run_apply_env_vars (envp, app_context);
+
+  envp = xdg_app_run_apply_env_appid (envp, app_id_dir);
+
+  /* The trace fd is passed to the helper as -t, don't leak it to the app */
+  envp = g_environ_unsetenv (envp, "XDG_APP_TRACE_FD");
+
+  if (opt_zygote)
     {
-      g_ptr_array_add (argv_array, g_strdup ("-m"));
-      g_ptr_array_add (argv_array, monitor_path);
+      g_autoptr(GPtrArray) zygote_argv = g_ptr_array_new ();
+      g_autofree char *zygote_dir = NULL;
+      int exit_status;
+
+      zygote_path = xdg_app_run_get_zygote_path (app_ref, app_files, runtime_files,
+                                                 extension_args, app_context, opt_devel);
+
+      g_ptr_array_add (zygote_argv, (char *)command);
+      for (i = 1; i < rest_argc; i++)
+        g_ptr_array_add (zygote_argv, argv[rest_argv_start + i]);
+      g_ptr_array_add (zygote_argv, NULL);
+
+      if (xdg_app_run_in_zygote (zygote_path, (char **)zygote_argv->pdata, envp, &exit_status))
+        exit (exit_status);
+
+      /* Otherwise this launch becomes the zygote */
+      zygote_dir = g_path_get_dirname (zygote_path);
+      if (g_mkdir_with_parents (zygote_dir, 0700) != 0)
+        g_clear_pointer (&zygote_path, g_free);
     }
-  else
-    g_ptr_array_add (argv_array, g_strdup ("-r"));
 
-  session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, NULL);
-  if (session_bus)
+  phase_start = g_get_monotonic_time ();
+  run_dbus_setup (app, &monitor_path, &doc_mount_path);
+  trace_phase ("dbus-setup", phase_start);
+
+  if (monitor_path)
     {
-      g_autoptr (GError) local_error = NULL;
-      g_autoptr (GDBusMessage) reply = NULL;
-      g_autoptr (GDBusMessage) msg = g_dbus_message_new_method_call ("org.freedesktop.portal.Documents",
-                                                                     "/org/freedesktop/portal/documents",
-                                                                     "org.freedesktop.portal.Documents",
-                                                                     "GetMountPoint");
-      g_dbus_message_set_body (msg, g_variant_new ("()"));
-      reply = g_dbus_connection_send_message_with_reply_sync (session_bus, msg,
-                                                              G_DBUS_SEND_MESSAGE_FLAGS_NONE,
-                                                              30000,
-                                                              NULL,
-                                                              NULL,
-                                                              NULL);
-      if (reply)
-        {
-          if (g_dbus_message_to_gerror (reply, &local_error))
-            {
-              g_warning ("Can't get document portal: %s\n", local_error->message);
-            }
-          else
-            g_variant_get (g_dbus_message_get_body (reply),
-                           "(^ay)", &doc_mount_path);
-        }
+      g_ptr_array_add (argv_array, g_strdup ("-m"));
+      g_ptr_array_add (argv_array, g_strdup (monitor_path));
     }
+  else
+    g_ptr_array_add (argv_array, g_strdup ("-r"));
 
   xdg_app_run_add_environment_args (argv_array, dbus_proxy_argv, doc_mount_path,
                                     app, app_context, app_id_dir);
@@ -275,11 +547,17 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
       g_ptr_array_add (argv_array, g_strdup_printf ("/run/host/user-fonts=%s", path));
     }
 
-  /* Must run this before spawning the dbus proxy, to ensure it
-     ends up in the app cgroup */
-  xdg_app_run_in_transient_unit (app);
+  phase_start = g_get_monotonic_time ();
 
-  if (dbus_proxy_argv->len > 0)
+  /* Prefer handing the proxies to the shared session proxy, if one
+     is running, to avoid spawning a new one for every app */
+  if (dbus_proxy_argv->len > 0 &&
+      (shared_proxy_fd = xdg_app_run_connect_dbus_proxy (dbus_proxy_argv)) != -1)
+    {
+      g_ptr_array_add (argv_array, g_strdup ("-S"));
+      g_ptr_array_add (argv_array, g_strdup_printf ("%d", shared_proxy_fd));
+    }
+  else if (dbus_proxy_argv->len > 0)
     {
       char x;
 
@@ -316,6 +594,15 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
       g_ptr_array_add (argv_array, g_strdup_printf ("%d", sync_proxy_pipes[0]));
     }
 
+  if (dbus_proxy_argv->len > 0)
+    trace_phase ("dbus-proxy", phase_start);
+
+  if (zygote_path)
+    {
+      g_ptr_array_add (argv_array, g_strdup ("-z"));
+      g_ptr_array_add (argv_array, g_strdup (zygote_path));
+    }
+
   g_ptr_array_add (argv_array, g_strdup ("-a"));
   g_ptr_array_add (argv_array, g_file_get_path (app_files));
   g_ptr_array_add (argv_array, g_strdup ("-I"));
@@ -328,12 +615,7 @@ xdg_app_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
 
   g_ptr_array_add (argv_array, NULL);
 
-  envp = g_get_environ ();
-  envp = xdg_app_run_apply_env_default (envp);
-
-  envp = xdg_app_run_apply_env_vars (envp, app_context);
-
-  envp = xdg_app_run_apply_env_appid (envp, app_id_dir);
+  trace_phase ("total", start_time);
 
   if (execvpe (HELPER, (char **)argv_array->pdata, envp) == -1)
     {
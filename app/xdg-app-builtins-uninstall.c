@@ -139,14 +139,35 @@ xdg_app_builtin_uninstall_runtime (int argc, char **argv, GCancellable *cancella
       g_clear_error (&temp_error);
     }
 
+  /* The ref is gone now, not just inactive */
+  if (!xdg_app_dir_mark_changed (dir, error))
+    return FALSE;
+
   if (!opt_keep_ref)
     {
+      g_autoptr(GPtrArray) dropped = NULL;
+      g_autofree char *origin_and_ref = NULL;
+      char *tip = NULL;
+
       repo = xdg_app_dir_get_repo (dir);
 
+      /* Only the objects of these commits can become unused */
+      dropped = g_ptr_array_new_with_free_func (g_free);
+      for (i = 0; deployed[i] != NULL; i++)
+        g_ptr_array_add (dropped, g_strdup (deployed[i]));
+
+      if (repository)
+        origin_and_ref = g_strdup_printf ("%s:%s", repository, ref);
+      else
+        origin_and_ref = g_strdup (ref);
+      if (ostree_repo_resolve_rev (repo, origin_and_ref, TRUE, &tip, NULL) && tip != NULL)
+        g_ptr_array_add (dropped, tip);
+      g_ptr_array_add (dropped, NULL);
+
       if (!ostree_repo_set_ref_immediate (repo, repository, ref, NULL, cancellable, error))
         return FALSE;
 
-      if (!xdg_app_dir_prune (dir, cancellable, error))
+      if (!xdg_app_dir_prune_commits (dir, (const char * const *)dropped->pdata, cancellable, error))
         return FALSE;
     }
 
@@ -265,14 +286,35 @@ xdg_app_builtin_uninstall_app (int argc, char **argv, GCancellable *cancellable,
       g_clear_error (&temp_error);
     }
 
+  /* The ref is gone now, not just inactive */
+  if (!xdg_app_dir_mark_changed (dir, error))
+    return FALSE;
+
   if (!opt_keep_ref)
     {
+      g_autoptr(GPtrArray) dropped = NULL;
+      g_autofree char *origin_and_ref = NULL;
+      char *tip = NULL;
+
       repo = xdg_app_dir_get_repo (dir);
 
+      /* Only the objects of these commits can become unused */
+      dropped = g_ptr_array_new_with_free_func (g_free);
+      for (i = 0; deployed[i] != NULL; i++)
+        g_ptr_array_add (dropped, g_strdup (deployed[i]));
+
+      if (repository)
+        origin_and_ref = g_strdup_printf ("%s:%s", repository, ref);
+      else
+        origin_and_ref = g_strdup (ref);
+      if (ostree_repo_resolve_rev (repo, origin_and_ref, TRUE, &tip, NULL) && tip != NULL)
+        g_ptr_array_add (dropped, tip);
+      g_ptr_array_add (dropped, NULL);
+
       if (!ostree_repo_set_ref_immediate (repo, repository, ref, NULL, cancellable, error))
         return FALSE;
 
-      if (!xdg_app_dir_prune (dir, cancellable, error))
+      if (!xdg_app_dir_prune_commits (dir, (const char * const *)dropped->pdata, cancellable, error))
         return FALSE;
     }
 
@@ -34,6 +34,7 @@
 static char *opt_arch;
 static char *opt_commit;
 static gboolean opt_force_remove;
+static int opt_jobs;
 
 static GOptionEntry options[] = {
   { "arch", 0, 0, G_OPTION_ARG_STRING, &opt_arch, "Arch to update for", "ARCH" },
@@ -42,6 +43,24 @@ static GOptionEntry options[] = {
   { NULL }
 };
 
+static void
+print_pull_stats (const char      *repository,
+                  XdgAppPullStats *stats)
+{
+  g_autofree char *size = NULL;
+
+  if (stats->fetched_objects == 0 && stats->fetched_delta_parts == 0)
+    return;
+
+  size = g_format_size (stats->bytes);
+  if (stats->fetched_delta_parts > 0)
+    g_print ("Fetched %u static delta parts, %u objects (%s) from %s\n",
+             stats->fetched_delta_parts, stats->fetched_objects, size, repository);
+  else
+    g_print ("Fetched %u objects one by one (%s) from %s\n",
+             stats->fetched_objects, size, repository);
+}
+
 gboolean
 xdg_app_builtin_update_runtime (int argc, char **argv, GCancellable *cancellable, GError **error)
 {
@@ -52,6 +71,8 @@ xdg_app_builtin_update_runtime (int argc, char **argv, GCancellable *cancellable
   g_autofree char *previous_deployment = NULL;
   g_autofree char *ref = NULL;
   g_autofree char *repository = NULL;
+  const char *commits[2];
+  XdgAppPullStats pull_stats = { 0 };
   GError *my_error;
 
   context = g_option_context_new ("RUNTIME [BRANCH] - Update a runtime");
@@ -78,10 +99,12 @@ xdg_app_builtin_update_runtime (int argc, char **argv, GCancellable *cancellable
   if (repository == NULL)
     return FALSE;
 
-  if (!xdg_app_dir_pull (dir, repository, ref,
+  if (!xdg_app_dir_pull (dir, repository, ref, &pull_stats,
                          cancellable, error))
     return FALSE;
 
+  print_pull_stats (repository, &pull_stats);
+
   previous_deployment = xdg_app_dir_read_active (dir, ref, cancellable);
 
   my_error = NULL;
@@ -104,7 +127,9 @@ xdg_app_builtin_update_runtime (int argc, char **argv, GCancellable *cancellable
                                      cancellable, error))
             return FALSE;
 
-          if (!xdg_app_dir_prune (dir, cancellable, error))
+          commits[0] = previous_deployment;
+          commits[1] = NULL;
+          if (!xdg_app_dir_prune_commits (dir, commits, cancellable, error))
             return FALSE;
         }
     }
@@ -122,6 +147,8 @@ xdg_app_builtin_update_app (int argc, char **argv, GCancellable *cancellable, GE
   g_autofree char *ref = NULL;
   g_autofree char *repository = NULL;
   g_autofree char *previous_deployment = NULL;
+  const char *commits[2];
+  XdgAppPullStats pull_stats = { 0 };
   GError *my_error;
 
   context = g_option_context_new ("APP [BRANCH] - Update an application");
@@ -148,10 +175,12 @@ xdg_app_builtin_update_app (int argc, char **argv, GCancellable *cancellable, GE
   if (repository == NULL)
     return FALSE;
 
-  if (!xdg_app_dir_pull (dir, repository, ref,
+  if (!xdg_app_dir_pull (dir, repository, ref, &pull_stats,
                          cancellable, error))
     return FALSE;
 
+  print_pull_stats (repository, &pull_stats);
+
   previous_deployment = xdg_app_dir_read_active (dir, ref, cancellable);
 
   my_error = NULL;
@@ -174,7 +203,9 @@ xdg_app_builtin_update_app (int argc, char **argv, GCancellable *cancellable, GE
                                      cancellable, error))
             return FALSE;
 
-          if (!xdg_app_dir_prune (dir, cancellable, error))
+          commits[0] = previous_deployment;
+          commits[1] = NULL;
+          if (!xdg_app_dir_prune_commits (dir, commits, cancellable, error))
             return FALSE;
         }
 
@@ -184,3 +215,272 @@ xdg_app_builtin_update_app (int argc, char **argv, GCancellable *cancellable, GE
 
   return  TRUE;
 }
+
+static GOptionEntry all_options[] = {
+  { "arch", 0, 0, G_OPTION_ARG_STRING, &opt_arch, "Only update refs for this arch", "ARCH" },
+  { "force-remove", 0, 0, G_OPTION_ARG_NONE, &opt_force_remove, "Remove old files even if running", NULL },
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &opt_jobs, "Number of checkouts to run at once", "JOBS" },
+  { NULL }
+};
+
+static gboolean
+ref_matches_arch (const char *ref, const char *arch)
+{
+  g_auto(GStrv) parts = NULL;
+
+  if (arch == NULL)
+    return TRUE;
+
+  parts = g_strsplit (ref, "/", 0);
+  return g_strv_length (parts) == 4 && strcmp (parts[2], arch) == 0;
+}
+
+/* Updates everything in one go: one pull per remote, concurrent
+   deploys, and then a single prune and exports/triggers pass */
+gboolean
+xdg_app_builtin_update_all (int argc, char **argv, GCancellable *cancellable, GError **error)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(XdgAppDir) dir = NULL;
+  g_auto(GStrv) runtime_refs = NULL;
+  g_auto(GStrv) app_refs = NULL;
+  g_autoptr(GHashTable) remotes = NULL;
+  g_autoptr(GPtrArray) refs = NULL;
+  g_autoptr(GPtrArray) previous = NULL;
+  g_autoptr(GPtrArray) changed_apps = NULL;
+  g_autoptr(GPtrArray) dropped = NULL;
+  g_autofree gboolean *deployed = NULL;
+  g_autofree XdgAppDeployStats *stats = NULL;
+  g_autofree GError **deploy_errors = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+  int n_failed = 0;
+  int n_changed = 0;
+  int i, j;
+
+  context = g_option_context_new (" - Update all applications and runtimes");
+
+  if (!xdg_app_option_context_parse (context, all_options, &argc, &argv, 0, &dir, cancellable, error))
+    return FALSE;
+
+  if (argc > 1)
+    return usage_error (context, "Too many arguments", error);
+
+  if (opt_jobs < 0)
+    return usage_error (context, "JOBS must not be negative", error);
+
+  if (!xdg_app_dir_list_refs (dir, "runtime", &runtime_refs, cancellable, error))
+    return FALSE;
+
+  if (!xdg_app_dir_list_refs (dir, "app", &app_refs, cancellable, error))
+    return FALSE;
+
+  /* Group the refs by the remote they came from */
+  remotes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_ptr_array_unref);
+  for (j = 0; j < 2; j++)
+    {
+      char **kind_refs = j == 0 ? runtime_refs : app_refs;
+
+      for (i = 0; kind_refs[i] != NULL; i++)
+        {
+          const char *ref = kind_refs[i];
+          g_autofree char *repository = NULL;
+          GPtrArray *remote_refs;
+
+          if (!ref_matches_arch (ref, opt_arch))
+            continue;
+
+          repository = xdg_app_dir_get_origin (dir, ref, cancellable, NULL);
+          if (repository == NULL)
+            {
+              g_printerr ("Not updating %s, it has no origin\n", ref);
+              continue;
+            }
+
+          remote_refs = g_hash_table_lookup (remotes, repository);
+          if (remote_refs == NULL)
+            {
+              remote_refs = g_ptr_array_new_with_free_func (g_free);
+              g_hash_table_insert (remotes, g_steal_pointer (&repository), remote_refs);
+            }
+
+          g_ptr_array_add (remote_refs, g_strdup (ref));
+        }
+    }
+
+  refs = g_ptr_array_new_with_free_func (g_free);
+  g_hash_table_iter_init (&iter, remotes);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const char *repository = key;
+      GPtrArray *remote_refs = value;
+      g_autoptr(GError) my_error = NULL;
+      XdgAppPullStats pull_stats = { 0 };
+
+      g_ptr_array_add (remote_refs, NULL);
+      if (xdg_app_dir_pull_refs (dir, repository, (const char * const *)remote_refs->pdata,
+                                 &pull_stats, cancellable, &my_error))
+        {
+          print_pull_stats (repository, &pull_stats);
+
+          for (i = 0; i < remote_refs->len - 1; i++)
+            g_ptr_array_add (refs, g_strdup (g_ptr_array_index (remote_refs, i)));
+          continue;
+        }
+
+      if (g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          g_propagate_error (error, g_steal_pointer (&my_error));
+          return FALSE;
+        }
+
+      if (remote_refs->len == 2)
+        {
+          g_printerr ("Failed to pull %s from remote %s: %s\n",
+                      (char *)g_ptr_array_index (remote_refs, 0), repository, my_error->message);
+          n_failed++;
+          continue;
+        }
+
+      /* A single bad ref, e.g. one that was removed from the remote,
+         fails the whole pull, so try them one by one */
+      g_printerr ("Failed to pull from remote %s, pulling refs one at a time: %s\n",
+                  repository, my_error->message);
+      for (i = 0; i < remote_refs->len - 1; i++)
+        {
+          const char *ref = g_ptr_array_index (remote_refs, i);
+          g_autoptr(GError) ref_error = NULL;
+
+          memset (&pull_stats, 0, sizeof (pull_stats));
+          if (!xdg_app_dir_pull (dir, repository, ref, &pull_stats,
+                                 cancellable, &ref_error))
+            {
+              if (g_error_matches (ref_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                {
+                  g_propagate_error (error, g_steal_pointer (&ref_error));
+                  return FALSE;
+                }
+
+              g_printerr ("%s\n", ref_error->message);
+              n_failed++;
+              continue;
+            }
+
+          print_pull_stats (repository, &pull_stats);
+          g_ptr_array_add (refs, g_strdup (ref));
+        }
+    }
+
+  previous = g_ptr_array_new_with_free_func (g_free);
+  for (i = 0; i < refs->len; i++)
+    g_ptr_array_add (previous, xdg_app_dir_read_active (dir, g_ptr_array_index (refs, i), cancellable));
+  g_ptr_array_add (refs, NULL);
+
+  deployed = g_new0 (gboolean, refs->len);
+  stats = g_new0 (XdgAppDeployStats, refs->len);
+  deploy_errors = g_new0 (GError *, refs->len);
+  {
+    g_autoptr(GError) my_error = NULL;
+
+    /* Every ref gets tried, so carry on with the ones that deployed */
+    if (!xdg_app_dir_deploy_refs (dir, (const char * const *)refs->pdata, opt_jobs,
+                                  deployed, stats, deploy_errors, cancellable, &my_error))
+      {
+        gboolean cancelled = g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+        int n_deploy_failed = 0;
+
+        for (i = 0; i < refs->len - 1; i++)
+          {
+            if (deploy_errors[i] == NULL)
+              continue;
+
+            if (!cancelled)
+              g_printerr ("%s\n", deploy_errors[i]->message);
+            g_error_free (deploy_errors[i]);
+            n_deploy_failed++;
+          }
+
+        if (cancelled)
+          {
+            g_propagate_error (error, g_steal_pointer (&my_error));
+            return FALSE;
+          }
+
+        /* Failing before any ref was tried, e.g. to open the repo */
+        if (n_deploy_failed == 0)
+          {
+            g_printerr ("%s\n", my_error->message);
+            n_deploy_failed++;
+          }
+
+        n_failed += n_deploy_failed;
+      }
+  }
+
+  changed_apps = g_ptr_array_new_with_free_func (g_free);
+  dropped = g_ptr_array_new ();
+  for (i = 0; i < refs->len - 1; i++)
+    {
+      const char *ref = g_ptr_array_index (refs, i);
+      const char *previous_deployment = g_ptr_array_index (previous, i);
+      g_autofree char *size = NULL;
+      g_autofree char *rate = NULL;
+      double secs;
+
+      if (!deployed[i])
+        continue;
+
+      secs = MAX (stats[i].elapsed_usec, 1) / (double) G_USEC_PER_SEC;
+      size = g_format_size (stats[i].bytes);
+      rate = g_format_size ((guint64) (stats[i].bytes / secs));
+      g_print ("Updated %s (checked out %s in %.1fs, %s/s)\n", ref, size, secs, rate);
+      n_changed++;
+
+      if (previous_deployment != NULL)
+        {
+          g_autoptr(GError) my_error = NULL;
+
+          /* The new version is in place either way, so its exports
+             still need updating below */
+          if (xdg_app_dir_undeploy (dir, ref, previous_deployment,
+                                    opt_force_remove,
+                                    cancellable, &my_error))
+            g_ptr_array_add (dropped, (char *)previous_deployment);
+          else if (g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            {
+              g_propagate_error (error, g_steal_pointer (&my_error));
+              return FALSE;
+            }
+          else
+            {
+              g_printerr ("Failed to remove old version of %s: %s\n", ref, my_error->message);
+              n_failed++;
+            }
+        }
+
+      if (g_str_has_prefix (ref, "app/"))
+        {
+          g_auto(GStrv) parts = g_strsplit (ref, "/", 0);
+          g_ptr_array_add (changed_apps, g_strdup (parts[1]));
+        }
+    }
+  g_ptr_array_add (changed_apps, NULL);
+  g_ptr_array_add (dropped, NULL);
+
+  if (n_changed > 0)
+    {
+      if (!xdg_app_dir_prune_commits (dir, (const char * const *)dropped->pdata,
+                                      cancellable, error))
+        return FALSE;
+
+      if (changed_apps->len > 1 &&
+          !xdg_app_dir_update_exports_for_apps (dir, (const char * const *)changed_apps->pdata,
+                                                cancellable, error))
+        return FALSE;
+    }
+
+  if (n_failed > 0)
+    return xdg_app_fail (error, "Some refs could not be updated");
+
+  return TRUE;
+}
@@ -60,6 +60,7 @@ BUILTINPROTO(list_runtimes);
 BUILTINPROTO(install_app);
 BUILTINPROTO(make_current_app);
 BUILTINPROTO(update_app);
+BUILTINPROTO(update_all);
 BUILTINPROTO(uninstall_app);
 BUILTINPROTO(install_bundle);
 BUILTINPROTO(list_apps);
@@ -25,13 +25,39 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <glib-unix.h>
+#include <gio/gunixsocketaddress.h>
 
 #include "libglnx/libglnx.h"
 
 #include "xdg-app-proxy.h"
 
+/* In control mode (--control=SOCKETPATH) the proxy is a long-lived
+ * service shared by all sandboxes of the session. Instead of getting
+ * the proxies to start on the command line, a client connects to the
+ * control socket and sends the same arguments that would be given on
+ * the command line for one or more proxies, each terminated by a nul
+ * byte, and ends the request with an empty argument. When all the
+ * requested proxies are listening a single 'x' byte is written back.
+ * The proxies then stay alive until the client closes the connection,
+ * which makes the connection a drop-in replacement for the --fd sync
+ * pipe.
+ */
+
+typedef struct {
+  GSocketConnection *connection;
+  GDataInputStream *data_in;
+  GPtrArray *args;
+  GList *proxies;
+} ControlClient;
+
 GList *proxies;
 int sync_fd = -1;
+char *control_path = NULL;
 
 int
 parse_generic_args (int n_args, const char *args[])
@@ -50,6 +76,20 @@ parse_generic_args (int n_args, const char *args[])
         }
       sync_fd = fd;
 
+      return 1;
+    }
+  else if (g_str_has_prefix (args[0], "--control="))
+    {
+      const char *path = args[0] + strlen("--control=");
+
+      if (*path == 0)
+        {
+          g_printerr ("No control socket path given\n");
+          return -1;
+        }
+      g_free (control_path);
+      control_path = g_strdup (path);
+
       return 1;
     }
   else
@@ -60,7 +100,7 @@ parse_generic_args (int n_args, const char *args[])
 }
 
 int
-start_proxy (int n_args, const char *args[])
+start_proxy (int n_args, const char *args[], gboolean allow_generic, GList **out_proxies)
 {
   g_autoptr(XdgAppProxy) proxy = NULL;
   g_autoptr (GError) error = NULL;
@@ -128,6 +168,11 @@ start_proxy (int n_args, const char *args[])
         {
           xdg_app_proxy_set_filter (proxy, TRUE);
         }
+      else if (!allow_generic)
+        {
+          g_printerr ("Unknown argument %s\n", args[n]);
+          return -1;
+        }
       else
         {
           int res = parse_generic_args (n_args - n, &args[n]);
@@ -146,11 +191,223 @@ start_proxy (int n_args, const char *args[])
       return -1;
     }
 
-  proxies = g_list_prepend (proxies, g_object_ref (proxy));
+  *out_proxies = g_list_prepend (*out_proxies, g_object_ref (proxy));
 
   return n;
 }
 
+static void
+control_client_free (ControlClient *client)
+{
+  GList *l;
+
+  for (l = client->proxies; l != NULL; l = l->next)
+    {
+      XdgAppProxy *proxy = l->data;
+
+      xdg_app_proxy_stop (proxy);
+      proxies = g_list_remove (proxies, proxy);
+      g_object_unref (proxy);
+    }
+  g_list_free (client->proxies);
+
+  g_io_stream_close (G_IO_STREAM (client->connection), NULL, NULL);
+  g_object_unref (client->connection);
+  g_object_unref (client->data_in);
+  g_ptr_array_free (client->args, TRUE);
+  g_free (client);
+}
+
+static gboolean
+control_client_start_proxies (ControlClient *client)
+{
+  const char **args = (const char **)client->args->pdata;
+  int n_args = client->args->len;
+  GList *l;
+  int res;
+
+  if (n_args == 0)
+    {
+      g_printerr ("No proxies specified\n");
+      return FALSE;
+    }
+
+  while (n_args > 0)
+    {
+      res = start_proxy (n_args, args, FALSE, &client->proxies);
+      if (res == -1)
+        return FALSE;
+
+      g_assert (res > 0);
+      n_args -= res;
+      args += res;
+    }
+
+  for (l = client->proxies; l != NULL; l = l->next)
+    proxies = g_list_prepend (proxies, l->data);
+
+  return TRUE;
+}
+
+static void control_client_read_arg (ControlClient *client);
+
+static void
+control_client_closed_cb (GObject      *source_object,
+                          GAsyncResult *res,
+                          gpointer      user_data)
+{
+  ControlClient *client = user_data;
+  g_autoptr(GBytes) bytes = NULL;
+
+  /* The client is not supposed to send anything after the request, so
+     this is either eof or an error. Either way the sandbox is gone. */
+  bytes = g_input_stream_read_bytes_finish (G_INPUT_STREAM (source_object), res, NULL);
+
+  control_client_free (client);
+}
+
+static void
+control_client_arg_cb (GObject      *source_object,
+                       GAsyncResult *res,
+                       gpointer      user_data)
+{
+  ControlClient *client = user_data;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *arg = NULL;
+  GOutputStream *output;
+  gsize len;
+
+  arg = g_data_input_stream_read_upto_finish (client->data_in, res, &len, &error);
+  if (arg == NULL)
+    goto out;
+
+  /* Skip the nul terminator, its already in the buffer */
+  g_data_input_stream_read_byte (client->data_in, NULL, &error);
+  if (error)
+    goto out;
+
+  if (len > 0)
+    {
+      g_ptr_array_add (client->args, g_steal_pointer (&arg));
+      control_client_read_arg (client);
+      return;
+    }
+
+  if (!control_client_start_proxies (client))
+    goto out;
+
+  output = g_io_stream_get_output_stream (G_IO_STREAM (client->connection));
+  if (!g_output_stream_write_all (output, "x", 1, NULL, NULL, &error))
+    goto out;
+
+  g_input_stream_read_bytes_async (G_INPUT_STREAM (client->data_in), 1, G_PRIORITY_DEFAULT, NULL,
+                                   control_client_closed_cb, client);
+  return;
+
+ out:
+  if (error)
+    g_printerr ("Control request failed: %s\n", error->message);
+  control_client_free (client);
+}
+
+static void
+control_client_read_arg (ControlClient *client)
+{
+  g_data_input_stream_read_upto_async (client->data_in, "", 1, G_PRIORITY_DEFAULT, NULL,
+                                       control_client_arg_cb, client);
+}
+
+static gboolean
+control_incoming (GSocketService    *service,
+                  GSocketConnection *connection,
+                  GObject           *source_object)
+{
+  g_autoptr(GCredentials) credentials = NULL;
+  ControlClient *client;
+
+  /* Only serve the user that we're running as */
+  credentials = g_socket_get_credentials (g_socket_connection_get_socket (connection), NULL);
+  if (credentials == NULL ||
+      g_credentials_get_unix_user (credentials, NULL) != getuid ())
+    {
+      g_printerr ("Rejecting control connection from other user\n");
+      return TRUE;
+    }
+
+  client = g_new0 (ControlClient, 1);
+  client->connection = g_object_ref (connection);
+  client->data_in = g_data_input_stream_new (g_io_stream_get_input_stream (G_IO_STREAM (connection)));
+  client->args = g_ptr_array_new_with_free_func (g_free);
+
+  control_client_read_arg (client);
+
+  return TRUE;
+}
+
+static gboolean
+control_socket_in_use (const char *path)
+{
+  struct sockaddr_un addr = { 0 };
+  gboolean in_use;
+  int fd;
+
+  if (strlen (path) >= sizeof (addr.sun_path))
+    return FALSE;
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return FALSE;
+
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+  in_use = connect (fd, (struct sockaddr *)&addr, sizeof (addr)) == 0;
+  close (fd);
+
+  return in_use;
+}
+
+static gboolean
+start_control (GError **error)
+{
+  GSocketService *service;
+  g_autoptr(GSocketAddress) address = NULL;
+  g_autofree char *dir = NULL;
+
+  dir = g_path_get_dirname (control_path);
+  if (g_mkdir_with_parents (dir, 0700) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return FALSE;
+    }
+
+  if (control_socket_in_use (control_path))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                   "Another proxy is already listening on %s", control_path);
+      return FALSE;
+    }
+
+  unlink (control_path);
+
+  service = g_socket_service_new ();
+  address = g_unix_socket_address_new (control_path);
+  if (!g_socket_listener_add_address (G_SOCKET_LISTENER (service), address,
+                                      G_SOCKET_TYPE_STREAM,
+                                      G_SOCKET_PROTOCOL_DEFAULT,
+                                      NULL, NULL, error))
+    {
+      g_object_unref (service);
+      return FALSE;
+    }
+
+  g_signal_connect (service, "incoming", G_CALLBACK (control_incoming), NULL);
+  g_socket_service_start (service);
+
+  /* The service is kept around for the lifetime of the process */
+
+  return TRUE;
+}
+
 static gboolean
 sync_closed_cb (GIOChannel   *source,
                 GIOCondition  condition,
@@ -161,10 +418,28 @@ sync_closed_cb (GIOChannel   *source,
   for (l = proxies; l != NULL; l = l->next)
     xdg_app_proxy_stop (XDG_APP_PROXY (l->data));
 
+  if (control_path)
+    unlink (control_path);
+
   exit (0);
   return TRUE;
 }
 
+/* SIGUSR1 dumps the traffic statistics of all clients to stderr */
+static gboolean
+dump_stats_cb (gpointer data)
+{
+  g_autoptr(GString) stats = g_string_new ("");
+  GList *l;
+
+  for (l = proxies; l != NULL; l = l->next)
+    xdg_app_proxy_dump_stats (XDG_APP_PROXY (l->data), stats);
+
+  g_printerr ("%s", stats->str);
+
+  return G_SOURCE_CONTINUE;
+}
+
 int
 main (int argc, const char *argv[])
 {
@@ -185,7 +460,7 @@ main (int argc, const char *argv[])
         }
       else
         {
-          res = start_proxy (n_args, args);
+          res = start_proxy (n_args, args, TRUE, &proxies);
           if (res == -1)
             return 1;
         }
@@ -195,7 +470,17 @@ main (int argc, const char *argv[])
       args += res;
     }
 
-  if (proxies == NULL)
+  if (control_path)
+    {
+      g_autoptr(GError) error = NULL;
+
+      if (!start_control (&error))
+        {
+          g_printerr ("Failed to start control socket %s: %s\n", control_path, error->message);
+          return 1;
+        }
+    }
+  else if (proxies == NULL)
     {
       g_printerr ("No proxies specied\n");
       return 1;
@@ -214,6 +499,8 @@ main (int argc, const char *argv[])
                       sync_closed_cb, NULL);
     }
 
+  g_unix_signal_add (SIGUSR1, dump_stats_cb, NULL);
+
   service_loop = g_main_loop_new (NULL, FALSE);
   g_main_loop_run (service_loop);
 
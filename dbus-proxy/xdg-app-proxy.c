@@ -148,6 +148,10 @@
  *    synthetic ListNames request and use the results of that to do further
  *    GetNameOwner for the existing names matching the wildcards. When we get
  *    replies for the GetNameOwner requests the unique id policy is updated.
+ *    If the proxy has a complete snapshot of the current owners (which it
+ *    tracks on its own bus connection) these requests are skipped and
+ *    the client is seeded from the snapshot instead.
+ *  * When the snapshot sees a name change owner all clients are updated.
  *  * When we get a method call from a unique id, it gets SEE
  *  * When we get a reply to the initial Hello request we give
  *    our own assigned unique id policy TALK.
@@ -188,6 +192,59 @@ typedef enum {
   EXPECTED_REPLY_REWRITE,
 } ExpectedReplyType;
 
+/* Reasons for dropping a message, for the statistics */
+typedef enum {
+  FILTERED_HIDDEN,
+  FILTERED_DENIED,
+  FILTERED_UNEXPECTED_REPLY,
+  FILTERED_INVALID_REPLY,
+  FILTERED_NAME_OWNER_CHANGED,
+  FILTERED_BROADCAST,
+  N_FILTERED_REASONS
+} FilteredReason;
+
+/* Same order as enum */
+static const char *filtered_reason_names[] = {
+  "hidden",
+  "denied",
+  "unexpected-reply",
+  "invalid-reply",
+  "name-owner-changed",
+  "broadcast",
+};
+
+/* Outstanding method calls are forgotten after the same time and
+   count limits as the default session bus configuration
+   (reply_timeout and max_replies_per_connection). The bus sends an
+   error reply when a call times out, but calls from the bus side
+   that the client never answers would otherwise stay around for the
+   lifetime of the client. */
+#define EXPECTED_REPLY_TIMEOUT (5 * 60 * G_USEC_PER_SEC)
+#define MAX_EXPECTED_REPLIES 50000
+#define MIN_EXPECTED_REPLIES_SIZE 64
+/* The smallest power of two that fits MAX_EXPECTED_REPLIES */
+#define MAX_EXPECTED_REPLIES_SIZE 65536
+
+typedef struct {
+  guint32 serial;
+  ExpectedReplyType type;
+  gint64 expires;
+} ExpectedReply;
+
+/* A ring of the outstanding calls in the order they were sent, which
+   is also the order they expire in, indexed by serial. Entries are
+   addressed by a sequence number, and live at seq % size in the ring.
+   Replies that arrive out of order leave holes (type NONE) that are
+   skipped when the head moves, and squeezed out when the ring is
+   full. Only the entries in by_serial count towards the limit. */
+typedef struct {
+  ExpectedReply *ring;
+  guint32 size; /* Always a power of two */
+  guint32 head_seq;
+  guint32 tail_seq;
+  GHashTable *by_serial; /* serial -> seq */
+} ExpectedReplies;
+
 typedef struct {
   gsize size;
   gsize pos;
@@ -232,13 +289,20 @@ typedef struct {
   GList *buffers; /* to be sent */
   GList *control_messages;
 
-  GHashTable *expected_replies;
+  ExpectedReplies expected_replies;
+
+  /* Statistics, messages and bytes are the ones received on this side */
+  guint64 n_messages;
+  guint64 n_bytes;
+  guint n_buffers;
+  guint max_buffers;
 } ProxySide;
 
 struct XdgAppProxyClient {
   GObject parent;
 
   XdgAppProxy *proxy;
+  guint id;
 
   gboolean authenticated;
   int auth_end_offset;
@@ -254,6 +318,9 @@ struct XdgAppProxyClient {
   GHashTable *get_owner_reply;
 
   GHashTable *unique_id_policy;
+
+  guint64 n_filtered[N_FILTERED_REASONS];
+  guint64 n_expired_replies;
 };
 
 typedef struct {
@@ -266,6 +333,7 @@ struct XdgAppProxy {
   gboolean log_messages;
 
   GList *clients;
+  guint next_client_id;
   char *socket_path;
   char *dbus_address;
 
@@ -273,6 +341,15 @@ struct XdgAppProxy {
 
   GHashTable *wildcard_policy;
   GHashTable *policy;
+
+  /* Snapshot of the owners of the names in the policy, shared by all
+     clients. Tracked on a separate bus connection. */
+  GDBusConnection *names_connection;
+  GCancellable *names_cancellable;
+  GArray *names_subscriptions;
+  GHashTable *name_owners;
+  int names_pending;
+  gboolean names_valid;
 };
 
 typedef struct {
@@ -303,6 +380,7 @@ G_DEFINE_TYPE (XdgAppProxyClient, xdg_app_proxy_client, G_TYPE_OBJECT)
 
 static void start_reading (ProxySide *side);
 static void stop_reading (ProxySide *side);
+static void proxy_stop_name_tracking (XdgAppProxy *proxy);
 
 static void
 buffer_free (Buffer *buffer)
@@ -325,7 +403,8 @@ free_side (ProxySide *side)
   if (side->out_source)
     g_source_destroy (side->out_source);
 
-  g_hash_table_destroy (side->expected_replies);
+  g_free (side->expected_replies.ring);
+  g_hash_table_destroy (side->expected_replies.by_serial);
 }
 
 static void
@@ -362,7 +441,7 @@ init_side (XdgAppProxyClient *client, ProxySide *side)
   side->header_buffer.size = 16;
   side->header_buffer.pos = 0;
   side->current_read_buffer = &side->header_buffer;
-  side->expected_replies = g_hash_table_new (g_direct_hash, g_direct_equal);
+  side->expected_replies.by_serial = g_hash_table_new (g_direct_hash, g_direct_equal);
 }
 
 static void
@@ -386,6 +465,7 @@ xdg_app_proxy_client_new (XdgAppProxy *proxy, GSocketConnection *connection)
 
   client = g_object_new (XDG_APP_TYPE_PROXY_CLIENT, NULL);
   client->proxy = g_object_ref (proxy);
+  client->id = proxy->next_client_id++;
   client->client_side.connection = g_object_ref (connection);
 
   proxy->clients = g_list_prepend (proxy->clients, client);
@@ -466,8 +546,14 @@ xdg_app_proxy_finalize (GObject *object)
   g_clear_pointer (&proxy->dbus_address, g_free);
   g_assert (proxy->clients == NULL);
 
+  /* The name tracking callbacks point to us, so they must all be
+     gone, even if we were never stopped */
+  proxy_stop_name_tracking (proxy);
+
   g_hash_table_destroy (proxy->policy);
   g_hash_table_destroy (proxy->wildcard_policy);
+  g_hash_table_destroy (proxy->name_owners);
+  g_array_free (proxy->names_subscriptions, TRUE);
 
   g_free (proxy->socket_path);
   g_free (proxy->dbus_address);
@@ -747,6 +833,7 @@ side_out_cb (GSocket *socket, GIOCondition condition, gpointer user_data)
           if (buffer->pos == buffer->size)
             {
               side->buffers = g_list_delete_link (side->buffers, side->buffers);
+              side->n_buffers--;
               buffer_free (buffer);
             }
         }
@@ -770,24 +857,164 @@ side_out_cb (GSocket *socket, GIOCondition condition, gpointer user_data)
   return retval;
 }
 
+static ExpectedReply *
+expected_reply_for_seq (ExpectedReplies *replies, guint32 seq)
+{
+  return &replies->ring[seq & (replies->size - 1)];
+}
+
+/* Called when we give up on a reply, clean up any state that was
+   waiting for it */
+static void
+expected_reply_expired (ProxySide *side, ExpectedReply *reply)
+{
+  XdgAppProxyClient *client = side->client;
+
+  client->n_expired_replies++;
+
+  if (client->proxy->log_messages)
+    g_print ("*EXPIRED* %c%d\n", side == &client->client_side ? 'C' : 'B', reply->serial);
+
+  switch (reply->type)
+    {
+    case EXPECTED_REPLY_REWRITE:
+      g_hash_table_remove (client->rewrite_reply, GUINT_TO_POINTER (reply->serial));
+      break;
+
+    case EXPECTED_REPLY_FAKE_GET_NAME_OWNER:
+      g_hash_table_remove (client->get_owner_reply, GUINT_TO_POINTER (reply->serial));
+      break;
+
+    case EXPECTED_REPLY_FAKE_LIST_NAMES:
+      /* We stopped reading from the client while waiting for this */
+      if (side->in_source == NULL && !side->closed)
+        start_reading (side);
+      break;
+
+    default:
+      break;
+    }
+
+  g_hash_table_remove (side->expected_replies.by_serial, GUINT_TO_POINTER (reply->serial));
+  reply->type = EXPECTED_REPLY_NONE;
+}
+
+/* Drop holes and expired entries from the head of the ring */
+static void
+expire_expected_replies (ProxySide *side, gint64 now)
+{
+  ExpectedReplies *replies = &side->expected_replies;
+
+  while (replies->head_seq != replies->tail_seq)
+    {
+      ExpectedReply *reply = expected_reply_for_seq (replies, replies->head_seq);
+
+      if (reply->type != EXPECTED_REPLY_NONE)
+        {
+          if (reply->expires > now)
+            break;
+          expected_reply_expired (side, reply);
+        }
+
+      replies->head_seq++;
+    }
+}
+
+/* Moves the outstanding calls into a ring of new_size, dropping the
+   holes between them */
+static void
+resize_expected_replies (ExpectedReplies *replies, guint32 new_size)
+{
+  ExpectedReply *new_ring = g_new (ExpectedReply, new_size);
+  guint32 seq, new_tail_seq;
+
+  new_tail_seq = replies->head_seq;
+  for (seq = replies->head_seq; seq != replies->tail_seq; seq++)
+    {
+      ExpectedReply *reply = expected_reply_for_seq (replies, seq);
+
+      if (reply->type == EXPECTED_REPLY_NONE)
+        continue;
+
+      new_ring[new_tail_seq & (new_size - 1)] = *reply;
+      g_hash_table_replace (replies->by_serial,
+                            GUINT_TO_POINTER (reply->serial),
+                            GUINT_TO_POINTER (new_tail_seq));
+      new_tail_seq++;
+    }
+
+  g_free (replies->ring);
+  replies->ring = new_ring;
+  replies->size = new_size;
+  replies->tail_seq = new_tail_seq;
+}
+
 static void
 queue_expected_reply (ProxySide *side, guint32 serial, ExpectedReplyType type)
 {
-  g_hash_table_replace (side->expected_replies,
-			GUINT_TO_POINTER (serial),
-			GUINT_TO_POINTER (type));
+  ExpectedReplies *replies = &side->expected_replies;
+  gint64 now = g_get_monotonic_time ();
+  ExpectedReply *reply;
+  gpointer old_seq;
+
+  expire_expected_replies (side, now);
+
+  if (g_hash_table_size (replies->by_serial) >= MAX_EXPECTED_REPLIES)
+    {
+      /* Too many outstanding calls, forget about the oldest one. After
+         expiring, the head is never a hole. */
+      expected_reply_expired (side, expected_reply_for_seq (replies, replies->head_seq));
+      expire_expected_replies (side, now);
+    }
+
+  if (replies->tail_seq - replies->head_seq == replies->size)
+    {
+      /* Grow if at least half of the ring is outstanding calls, or
+         just squeeze out the holes, so this doesn't happen too often */
+      if (replies->size < MAX_EXPECTED_REPLIES_SIZE &&
+          g_hash_table_size (replies->by_serial) >= replies->size / 2)
+        resize_expected_replies (replies, MAX (replies->size * 2, MIN_EXPECTED_REPLIES_SIZE));
+      else
+        resize_expected_replies (replies, replies->size);
+    }
+
+  /* A new call with the same serial replaces the old one */
+  if (g_hash_table_lookup_extended (replies->by_serial, GUINT_TO_POINTER (serial), NULL, &old_seq))
+    expected_reply_for_seq (replies, GPOINTER_TO_UINT (old_seq))->type = EXPECTED_REPLY_NONE;
+
+  reply = expected_reply_for_seq (replies, replies->tail_seq);
+  reply->serial = serial;
+  reply->type = type;
+  reply->expires = now + EXPECTED_REPLY_TIMEOUT;
+
+  g_hash_table_replace (replies->by_serial,
+                        GUINT_TO_POINTER (serial),
+                        GUINT_TO_POINTER (replies->tail_seq));
+  replies->tail_seq++;
 }
 
 static ExpectedReplyType
 steal_expected_reply (ProxySide *side, guint32 serial)
 {
+  ExpectedReplies *replies = &side->expected_replies;
+  ExpectedReply *reply;
   ExpectedReplyType type;
+  gpointer seq;
+
+  if (!g_hash_table_lookup_extended (replies->by_serial, GUINT_TO_POINTER (serial), NULL, &seq))
+    return EXPECTED_REPLY_NONE;
+
+  g_hash_table_remove (replies->by_serial, GUINT_TO_POINTER (serial));
+
+  reply = expected_reply_for_seq (replies, GPOINTER_TO_UINT (seq));
+  type = reply->type;
+  reply->type = EXPECTED_REPLY_NONE;
+
+  /* Keep the ring compact when replies arrive in order */
+  while (replies->head_seq != replies->tail_seq &&
+         expected_reply_for_seq (replies, replies->head_seq)->type == EXPECTED_REPLY_NONE)
+    replies->head_seq++;
 
-  type = GPOINTER_TO_UINT (g_hash_table_lookup (side->expected_replies,
-						GUINT_TO_POINTER (serial)));
-  if (type)
-    g_hash_table_remove (side->expected_replies,
-			 GUINT_TO_POINTER (serial));
   return type;
 }
 
@@ -808,6 +1035,8 @@ queue_outgoing_buffer (ProxySide *side, Buffer *buffer)
 
   buffer->pos = 0;
   side->buffers = g_list_append (side->buffers, buffer);
+  side->n_buffers++;
+  side->max_buffers = MAX (side->max_buffers, side->n_buffers);
 }
 
 static guint32
@@ -1619,6 +1848,265 @@ queue_fake_message (XdgAppProxyClient *client, GDBusMessage *message, ExpectedRe
   queue_expected_reply (&client->client_side, client->last_serial, reply_type);
 }
 
+/* Each client needs to know the owners of the names in the policy
+ * when it connects. Rather than having every client ask the bus for
+ * all of them, the proxy keeps a snapshot of the owners up to date on
+ * a connection of its own, which new clients are seeded from. Clients
+ * still add their own match rules, so that any later changes arrive
+ * in order with the rest of their messages, and all changes seen by
+ * the snapshot are also applied to all the current clients to cover
+ * the window before those match rules are active.
+ *
+ * So this only saves the GetNameOwner and ListNames round trips. Each
+ * client still sends one AddMatch per policy name, and the snapshot
+ * costs every proxy one extra bus connection with its own matches.
+ * Sharing the snapshot's matches instead would let a message from a
+ * new owner reach a client before the client learns about the owner.
+ */
+
+static void
+proxy_set_name_owner (XdgAppProxy *proxy,
+                      const char  *name,
+                      const char  *owner)
+{
+  GList *l;
+
+  if (owner == NULL || *owner == 0)
+    {
+      g_hash_table_remove (proxy->name_owners, name);
+      return;
+    }
+
+  g_hash_table_replace (proxy->name_owners, g_strdup (name), g_strdup (owner));
+
+  for (l = proxy->clients; l != NULL; l = l->next)
+    xdg_app_proxy_client_update_unique_id_policy_from_name (l->data, owner, name);
+}
+
+static void
+proxy_names_call_done (XdgAppProxy *proxy)
+{
+  if (--proxy->names_pending == 0)
+    proxy->names_valid = TRUE;
+}
+
+static void
+name_owner_changed_cb (GDBusConnection *connection,
+                       const gchar     *sender_name,
+                       const gchar     *object_path,
+                       const gchar     *interface_name,
+                       const gchar     *signal_name,
+                       GVariant        *parameters,
+                       gpointer         user_data)
+{
+  XdgAppProxy *proxy = user_data;
+  const char *name, *old, *new;
+
+  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(sss)")))
+    return;
+
+  g_variant_get (parameters, "(&s&s&s)", &name, &old, &new);
+
+  if (name[0] != ':' && xdg_app_proxy_get_policy (proxy, name) != XDG_APP_POLICY_NONE)
+    proxy_set_name_owner (proxy, name, new);
+}
+
+static void
+get_name_owner_cb (GObject      *source_object,
+                   GAsyncResult *res,
+                   gpointer      user_data)
+{
+  g_autofree char *name = user_data;
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GError) error = NULL;
+  XdgAppProxy *proxy;
+  const char *owner;
+
+  reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &error);
+
+  /* Name tracking was stopped, and the proxy may be gone */
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    return;
+
+  proxy = g_object_get_data (source_object, "xdg-app-proxy");
+  if (proxy == NULL)
+    return;
+
+  /* NameHasNoOwner errors just mean there is no owner */
+  if (reply != NULL)
+    {
+      g_variant_get (reply, "(&s)", &owner);
+      proxy_set_name_owner (proxy, name, owner);
+    }
+
+  proxy_names_call_done (proxy);
+}
+
+static void
+proxy_get_name_owner (XdgAppProxy *proxy,
+                      const char  *name)
+{
+  proxy->names_pending++;
+  g_dbus_connection_call (proxy->names_connection,
+                          "org.freedesktop.DBus", "/", "org.freedesktop.DBus", "GetNameOwner",
+                          g_variant_new ("(s)", name), G_VARIANT_TYPE ("(s)"),
+                          G_DBUS_CALL_FLAGS_NONE, -1, proxy->names_cancellable,
+                          get_name_owner_cb, g_strdup (name));
+}
+
+static void
+list_names_cb (GObject      *source_object,
+               GAsyncResult *res,
+               gpointer      user_data)
+{
+  g_autoptr(GVariant) reply = NULL;
+  g_autofree const char **names = NULL;
+  g_autoptr(GError) error = NULL;
+  XdgAppProxy *proxy;
+  int i;
+
+  reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &error);
+
+  /* Name tracking was stopped, and the proxy may be gone */
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    return;
+
+  proxy = g_object_get_data (source_object, "xdg-app-proxy");
+  if (proxy == NULL)
+    return;
+
+  /* If we can't list the names the snapshot is never valid, and
+     clients fall back to asking the bus themselves */
+  if (reply == NULL)
+    return;
+
+  g_variant_get (reply, "(^a&s)", &names);
+  for (i = 0; names[i] != NULL; i++)
+    {
+      if (names[i][0] != ':' &&
+          xdg_app_proxy_get_wildcard_policy (proxy, names[i]) != XDG_APP_POLICY_NONE &&
+          !g_hash_table_contains (proxy->policy, names[i]))
+        proxy_get_name_owner (proxy, names[i]);
+    }
+
+  proxy_names_call_done (proxy);
+}
+
+static void
+proxy_subscribe_name_owner_changed (XdgAppProxy *proxy,
+                                    const char  *name,
+                                    gboolean     wildcard)
+{
+  guint id;
+
+  id = g_dbus_connection_signal_subscribe (proxy->names_connection,
+                                           "org.freedesktop.DBus", "org.freedesktop.DBus",
+                                           "NameOwnerChanged", "/org/freedesktop/DBus", name,
+                                           wildcard ? G_DBUS_SIGNAL_FLAGS_MATCH_ARG0_NAMESPACE : G_DBUS_SIGNAL_FLAGS_NONE,
+                                           name_owner_changed_cb, proxy, NULL);
+  g_array_append_val (proxy->names_subscriptions, id);
+}
+
+static void
+names_connection_ready_cb (GObject      *source_object,
+                           GAsyncResult *res,
+                           gpointer      user_data)
+{
+  g_autoptr(XdgAppProxy) proxy = user_data;
+  g_autoptr(GError) error = NULL;
+  GDBusConnection *connection;
+  GHashTableIter iter;
+  gpointer key;
+
+  connection = g_dbus_connection_new_for_address_finish (res, &error);
+  if (connection == NULL)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_debug ("Failed to connect to bus for name tracking: %s", error->message);
+      return;
+    }
+
+  /* Stopped while connecting */
+  if (!g_socket_service_is_active (G_SOCKET_SERVICE (proxy)))
+    {
+      g_dbus_connection_close (connection, NULL, NULL, NULL);
+      g_object_unref (connection);
+      return;
+    }
+
+  proxy->names_connection = connection;
+  /* Pending calls check this to see if the proxy is still around */
+  g_object_set_data (G_OBJECT (connection), "xdg-app-proxy", proxy);
+
+  /* Subscribe before asking for the owners, to avoid races. The
+     pending count starts at one for the ListNames or the final
+     decrement below */
+  proxy->names_pending = 1;
+
+  g_hash_table_iter_init (&iter, proxy->policy);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      const char *name = key;
+
+      if (strcmp (name, "org.freedesktop.DBus") == 0)
+        continue;
+
+      proxy_subscribe_name_owner_changed (proxy, name, FALSE);
+      proxy_get_name_owner (proxy, name);
+    }
+
+  g_hash_table_iter_init (&iter, proxy->wildcard_policy);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    proxy_subscribe_name_owner_changed (proxy, key, TRUE);
+
+  if (g_hash_table_size (proxy->wildcard_policy) > 0)
+    g_dbus_connection_call (connection,
+                            "org.freedesktop.DBus", "/", "org.freedesktop.DBus", "ListNames",
+                            NULL, G_VARIANT_TYPE ("(as)"),
+                            G_DBUS_CALL_FLAGS_NONE, -1, proxy->names_cancellable,
+                            list_names_cb, NULL);
+  else
+    proxy_names_call_done (proxy);
+}
+
+static void
+proxy_start_name_tracking (XdgAppProxy *proxy)
+{
+  proxy->names_cancellable = g_cancellable_new ();
+  g_dbus_connection_new_for_address (proxy->dbus_address,
+                                     G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                     G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                     NULL, proxy->names_cancellable,
+                                     names_connection_ready_cb,
+                                     g_object_ref (proxy));
+}
+
+static void
+proxy_stop_name_tracking (XdgAppProxy *proxy)
+{
+  guint i;
+
+  /* Makes the pending calls return without touching the proxy */
+  if (proxy->names_cancellable)
+    {
+      g_cancellable_cancel (proxy->names_cancellable);
+      g_clear_object (&proxy->names_cancellable);
+    }
+
+  if (proxy->names_connection == NULL)
+    return;
+
+  for (i = 0; i < proxy->names_subscriptions->len; i++)
+    g_dbus_connection_signal_unsubscribe (proxy->names_connection,
+                                          g_array_index (proxy->names_subscriptions, guint, i));
+  g_array_set_size (proxy->names_subscriptions, 0);
+
+  g_object_set_data (G_OBJECT (proxy->names_connection), "xdg-app-proxy", NULL);
+  g_dbus_connection_close (proxy->names_connection, NULL, NULL, NULL);
+  g_clear_object (&proxy->names_connection);
+  proxy->names_valid = FALSE;
+}
+
 /* After the first Hello message we need to synthesize a bunch of messages to synchronize the
    ownership state for the names in the policy */
 static void
@@ -1627,6 +2115,7 @@ queue_initial_name_ops (XdgAppProxyClient *client)
   GHashTableIter iter;
   gpointer key, value;
   gboolean has_wildcards = FALSE;
+  gboolean use_snapshot = client->proxy->names_valid;
 
   g_hash_table_iter_init (&iter, client->proxy->policy);
   while (g_hash_table_iter_next (&iter, &key, &value))
@@ -1648,6 +2137,9 @@ queue_initial_name_ops (XdgAppProxyClient *client)
       if (client->proxy->log_messages)
         g_print ("C%d: -> org.freedesktop.DBus fake AddMatch for %s\n", client->last_serial, name);
 
+      if (use_snapshot)
+        continue;
+
       /* Get the current owner of the name (if any) so we can apply policy to it */
       message = g_dbus_message_new_method_call ("org.freedesktop.DBus", "/", "org.freedesktop.DBus", "GetNameOwner");
       g_dbus_message_set_body (message, g_variant_new ("(s)", name));
@@ -1680,7 +2172,18 @@ queue_initial_name_ops (XdgAppProxyClient *client)
         g_print ("C%d: -> org.freedesktop.DBus fake AddMatch for %s.*\n", client->last_serial, name);
     }
 
-  if (has_wildcards)
+  if (use_snapshot)
+    {
+      /* The proxy already knows all the current owners, no need for any
+         roundtrips */
+      g_hash_table_iter_init (&iter, client->proxy->name_owners);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        xdg_app_proxy_client_update_unique_id_policy_from_name (client, value, key);
+
+      if (client->proxy->log_messages)
+        g_print ("*SNAPSHOT* %u name owners\n", g_hash_table_size (client->proxy->name_owners));
+    }
+  else if (has_wildcards)
     {
       GDBusMessage *message;
 
@@ -1843,6 +2346,7 @@ got_buffer_from_client (XdgAppProxyClient *client, ProxySide *side, Buffer *buff
             {
 	      const char *error;
 
+              client->n_filtered[FILTERED_HIDDEN]++;
               if (client->proxy->log_messages)
                 g_print ("*HIDDEN* (ping)\n");
 
@@ -1857,6 +2361,7 @@ got_buffer_from_client (XdgAppProxyClient *client, ProxySide *side, Buffer *buff
             }
           else
             {
+              client->n_filtered[FILTERED_HIDDEN]++;
               if (client->proxy->log_messages)
                 g_print ("*HIDDEN*\n");
             }
@@ -1869,6 +2374,7 @@ got_buffer_from_client (XdgAppProxyClient *client, ProxySide *side, Buffer *buff
 
           if (client_message_generates_reply (&header))
             {
+              client->n_filtered[FILTERED_DENIED]++;
               if (client->proxy->log_messages)
                 g_print ("*DENIED* (ping)\n");
 
@@ -1878,6 +2384,7 @@ got_buffer_from_client (XdgAppProxyClient *client, ProxySide *side, Buffer *buff
             }
           else
             {
+              client->n_filtered[FILTERED_DENIED]++;
               if (client->proxy->log_messages)
                 g_print ("*DENIED*\n");
             }
@@ -1928,6 +2435,7 @@ got_buffer_from_bus (XdgAppProxyClient *client, ProxySide *side, Buffer *buffer)
 	  /* We only allow replies we expect */
 	  if (expected_reply == EXPECTED_REPLY_NONE)
 	    {
+	      client->n_filtered[FILTERED_UNEXPECTED_REPLY]++;
 	      if (client->proxy->log_messages)
 		g_print ("*Unexpected reply*\n");
 	      buffer_free (buffer);
@@ -2036,6 +2544,7 @@ got_buffer_from_bus (XdgAppProxyClient *client, ProxySide *side, Buffer *buffer)
           if (header.type == G_DBUS_MESSAGE_TYPE_METHOD_RETURN ||
               header.type == G_DBUS_MESSAGE_TYPE_ERROR)
             {
+	      client->n_filtered[FILTERED_INVALID_REPLY]++;
 	      if (client->proxy->log_messages)
 		g_print ("*Invalid reply*\n");
               g_clear_pointer (&buffer, buffer_free);
@@ -2045,7 +2554,10 @@ got_buffer_from_bus (XdgAppProxyClient *client, ProxySide *side, Buffer *buffer)
 	  if (message_is_name_owner_changed (client, &header))
 	    {
 	      if (should_filter_name_owner_changed (client, buffer))
-		g_clear_pointer (&buffer, buffer_free);
+		{
+		  client->n_filtered[FILTERED_NAME_OWNER_CHANGED]++;
+		  g_clear_pointer (&buffer, buffer_free);
+		}
 	    }
 	}
 
@@ -2055,6 +2567,7 @@ got_buffer_from_bus (XdgAppProxyClient *client, ProxySide *side, Buffer *buffer)
 	  policy = xdg_app_proxy_client_get_policy (client, header.sender);
 	  if (policy < XDG_APP_POLICY_TALK)
 	    {
+	      client->n_filtered[FILTERED_BROADCAST]++;
 	      if (client->proxy->log_messages)
 		g_print ("*FILTERED IN*\n");
 	      g_clear_pointer (&buffer, buffer_free);
@@ -2079,6 +2592,12 @@ got_buffer_from_side (ProxySide *side, Buffer *buffer)
 {
   XdgAppProxyClient *client = side->client;
 
+  if (client->authenticated)
+    {
+      side->n_messages++;
+      side->n_bytes += buffer->size;
+    }
+
   if (side == &client->client_side)
     got_buffer_from_client (client, side, buffer);
   else
@@ -2299,6 +2818,8 @@ xdg_app_proxy_init (XdgAppProxy *proxy)
 {
   proxy->policy = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   proxy->wildcard_policy = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  proxy->name_owners = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  proxy->names_subscriptions = g_array_new (FALSE, FALSE, sizeof (guint));
   xdg_app_proxy_add_policy (proxy, "org.freedesktop.DBus", XDG_APP_POLICY_TALK);
 }
 
@@ -2366,13 +2887,53 @@ xdg_app_proxy_start (XdgAppProxy *proxy, GError **error)
 
 
   g_socket_service_start (G_SOCKET_SERVICE (proxy));
+
+  if (proxy->filter)
+    proxy_start_name_tracking (proxy);
+
   return TRUE;
 }
 
+/* Appends one line per client, with space separated key=value pairs.
+   Directions are seen from the client, i.e. "out" is client to bus. */
+void
+xdg_app_proxy_dump_stats (XdgAppProxy *proxy,
+                          GString     *out)
+{
+  GList *l;
+  int i;
+
+  for (l = proxy->clients; l != NULL; l = l->next)
+    {
+      XdgAppProxyClient *client = l->data;
+
+      g_string_append_printf (out, "socket=%s client=%u filter=%d"
+                              " out-messages=%" G_GUINT64_FORMAT " out-bytes=%" G_GUINT64_FORMAT
+                              " in-messages=%" G_GUINT64_FORMAT " in-bytes=%" G_GUINT64_FORMAT,
+                              proxy->socket_path, client->id, proxy->filter,
+                              client->client_side.n_messages, client->client_side.n_bytes,
+                              client->bus_side.n_messages, client->bus_side.n_bytes);
+
+      for (i = 0; i < N_FILTERED_REASONS; i++)
+        g_string_append_printf (out, " filtered-%s=%" G_GUINT64_FORMAT,
+                                filtered_reason_names[i], client->n_filtered[i]);
+
+      g_string_append_printf (out, " out-queue=%u out-queue-max=%u in-queue=%u in-queue-max=%u"
+                              " expected-replies=%u expected-replies-bus=%u expired-replies=%" G_GUINT64_FORMAT "\n",
+                              client->bus_side.n_buffers, client->bus_side.max_buffers,
+                              client->client_side.n_buffers, client->client_side.max_buffers,
+                              g_hash_table_size (client->client_side.expected_replies.by_serial),
+                              g_hash_table_size (client->bus_side.expected_replies.by_serial),
+                              client->n_expired_replies);
+    }
+}
+
 void
 xdg_app_proxy_stop (XdgAppProxy *proxy)
 {
   unlink (proxy->socket_path);
 
   g_socket_service_stop (G_SOCKET_SERVICE (proxy));
+
+  proxy_stop_name_tracking (proxy);
 }
@@ -56,5 +56,7 @@ void         xdg_app_proxy_add_wildcarded_policy (XdgAppProxy   *proxy,
 gboolean     xdg_app_proxy_start                 (XdgAppProxy   *proxy,
                                                   GError       **error);
 void         xdg_app_proxy_stop                  (XdgAppProxy   *proxy);
+void         xdg_app_proxy_dump_stats            (XdgAppProxy   *proxy,
+                                                  GString       *out);
 
 #endif /* __XDG_APP_PROXY_H__ */
@@ -23,6 +23,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <sys/wait.h>
 
 #include <gio/gio.h>
 #include "libgsystem.h"
@@ -30,6 +31,8 @@
 
 #include "xdg-app-dir.h"
 #include "xdg-app-utils.h"
+#include "gvdb/gvdb-reader.h"
+#include "gvdb/gvdb-builder.h"
 
 #include "errno.h"
 
@@ -39,6 +42,10 @@ struct XdgAppDir {
   gboolean user;
   GFile *basedir;
   OstreeRepo *repo;
+
+  /* Serializes bumping .changed and rebuilding the refs index, which
+     can happen from several threads */
+  GRecMutex refs_index_lock;
 };
 
 typedef struct {
@@ -165,6 +172,7 @@ xdg_app_dir_finalize (GObject *object)
 
   g_clear_object (&self->repo);
   g_clear_object (&self->basedir);
+  g_rec_mutex_clear (&self->refs_index_lock);
 
   G_OBJECT_CLASS (xdg_app_dir_parent_class)->finalize (object);
 }
@@ -242,6 +250,7 @@ xdg_app_dir_class_init (XdgAppDirClass *klass)
 static void
 xdg_app_dir_init (XdgAppDir *self)
 {
+  g_rec_mutex_init (&self->refs_index_lock);
 }
 
 gboolean
@@ -408,6 +417,63 @@ xdg_app_dir_get_removed_dir (XdgAppDir     *self)
   return g_file_get_child (self->basedir, ".removed");
 }
 
+/* The mtime of this file changes whenever the set of active
+   deployments in the installation changes, so that caches of
+   lookups in it can be validated with a single stat. It also holds
+   a generation number that is bumped on every change, for caches
+   that can't rely on the mtime having a fine enough resolution. */
+GFile *
+xdg_app_dir_get_changed_path (XdgAppDir     *self)
+{
+  return g_file_get_child (self->basedir, ".changed");
+}
+
+static GvdbTable *get_refs_index (XdgAppDir     *self,
+                                  GCancellable  *cancellable,
+                                  GError       **error);
+
+static guint64
+get_changed_generation (XdgAppDir *self)
+{
+  g_autoptr(GFile) changed_file = xdg_app_dir_get_changed_path (self);
+  g_autofree char *contents = NULL;
+
+  if (!g_file_load_contents (changed_file, NULL, &contents, NULL, NULL, NULL))
+    return 0;
+
+  return g_ascii_strtoull (contents, NULL, 10);
+}
+
+gboolean
+xdg_app_dir_mark_changed (XdgAppDir     *self,
+                          GError       **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GFile) changed_file = NULL;
+  g_autofree char *generation = NULL;
+  GvdbTable *index;
+
+  g_rec_mutex_lock (&self->refs_index_lock);
+
+  changed_file = xdg_app_dir_get_changed_path (self);
+  generation = g_strdup_printf ("%" G_GUINT64_FORMAT "\n", get_changed_generation (self) + 1);
+  if (!g_file_replace_contents (changed_file, generation, strlen (generation), NULL, FALSE,
+                                G_FILE_CREATE_REPLACE_DESTINATION, NULL,
+                                NULL, error))
+    goto out;
+
+  /* Refresh the refs index while we can write it, as the users of a
+     system installation can't */
+  index = get_refs_index (self, NULL, NULL);
+  if (index)
+    gvdb_table_free (index);
+
+  ret = TRUE;
+ out:
+  g_rec_mutex_unlock (&self->refs_index_lock);
+  return ret;
+}
+
 OstreeRepo *
 xdg_app_dir_get_repo (XdgAppDir *self)
 {
@@ -493,17 +559,22 @@ xdg_app_dir_ensure_repo (XdgAppDir *self,
   return ret;
 }
 
+/* Pulls several refs from the same remote at once, so that objects
+   they share are only fetched once. ostree uses a static delta from
+   the commit last pulled for a ref when the remote summary has one,
+   and fetches the objects one by one otherwise. If stats is not NULL,
+   it is filled with what was actually fetched. */
 gboolean
-xdg_app_dir_pull (XdgAppDir *self,
-                  const char *repository,
-                  const char *ref,
-                  GCancellable *cancellable,
-                  GError **error)
+xdg_app_dir_pull_refs (XdgAppDir *self,
+                       const char *repository,
+                       const char * const *refs,
+                       XdgAppPullStats *stats,
+                       GCancellable *cancellable,
+                       GError **error)
 {
   gboolean ret = FALSE;
   GSConsole *console = NULL;
   g_autoptr(OstreeAsyncProgress) progress = NULL;
-  const char *refs[2];
 
   if (!xdg_app_dir_ensure_repo (self, cancellable, error))
     goto out;
@@ -514,26 +585,51 @@ xdg_app_dir_pull (XdgAppDir *self,
       gs_console_begin_status_line (console, "", NULL, NULL);
       progress = ostree_async_progress_new_and_connect (ostree_repo_pull_default_console_progress_changed, console);
     }
+  else if (stats)
+    progress = ostree_async_progress_new ();
 
-  refs[0] = ref;
-  refs[1] = NULL;
   if (!ostree_repo_pull (self->repo, repository,
                          (char **)refs, OSTREE_REPO_PULL_FLAGS_NONE,
                          progress,
                          cancellable, error))
-    {
-      g_prefix_error (error, "While pulling %s from remote %s: ", ref, repository);
-      goto out;
-    }
+    goto out;
 
   if (console)
     gs_console_end_status_line (console, NULL, NULL);
 
+  if (stats)
+    {
+      stats->fetched_objects = ostree_async_progress_get_uint (progress, "fetched");
+      stats->bytes = ostree_async_progress_get_uint64 (progress, "bytes-transferred");
+      stats->fetched_delta_parts = ostree_async_progress_get_uint (progress, "fetched-delta-parts");
+    }
+
   ret = TRUE;
  out:
   return ret;
 }
 
+gboolean
+xdg_app_dir_pull (XdgAppDir *self,
+                  const char *repository,
+                  const char *ref,
+                  XdgAppPullStats *stats,
+                  GCancellable *cancellable,
+                  GError **error)
+{
+  const char *refs[2];
+
+  refs[0] = ref;
+  refs[1] = NULL;
+  if (!xdg_app_dir_pull_refs (self, repository, refs, stats, cancellable, error))
+    {
+      g_prefix_error (error, "While pulling %s from remote %s: ", ref, repository);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 char *
 xdg_app_dir_current_ref (XdgAppDir *self,
                          const char *name,
@@ -620,13 +716,13 @@ strvcmp(char **a, char **b)
   return strcmp (*a, *b);
 }
 
-gboolean
-xdg_app_dir_list_refs_for_name (XdgAppDir      *self,
-                                const char     *kind,
-                                const char     *name,
-                                char         ***refs_out,
-                                GCancellable   *cancellable,
-                                GError        **error)
+static gboolean
+scan_refs_for_name (XdgAppDir      *self,
+                    const char     *kind,
+                    const char     *name,
+                    char         ***refs_out,
+                    GCancellable   *cancellable,
+                    GError        **error)
 {
   gboolean ret = FALSE;
   g_autoptr(GFile) base = NULL;
@@ -719,12 +815,12 @@ out:
   return ret;
 }
 
-gboolean
-xdg_app_dir_list_refs (XdgAppDir      *self,
-                       const char     *kind,
-                       char         ***refs_out,
-                       GCancellable   *cancellable,
-                       GError        **error)
+static gboolean
+scan_refs (XdgAppDir      *self,
+           const char     *kind,
+           char         ***refs_out,
+           GCancellable   *cancellable,
+           GError        **error)
 {
   gboolean ret = FALSE;
   g_autoptr(GFile) base;
@@ -763,7 +859,7 @@ xdg_app_dir_list_refs (XdgAppDir      *self,
 
       name = g_file_info_get_name (child_info);
 
-      if (!xdg_app_dir_list_refs_for_name (self, kind, name, &sub_refs, cancellable, error))
+      if (!scan_refs_for_name (self, kind, name, &sub_refs, cancellable, error))
         goto out;
 
       for (i = 0; sub_refs[i] != NULL; i++)
@@ -815,6 +911,222 @@ xdg_app_dir_read_active (XdgAppDir *self,
   return g_strdup (g_file_info_get_symlink_target (file_info));
 }
 
+/* The refs index caches the deployed refs of the installation with
+ * their active checksums, so that listing them or looking them up is
+ * a single read of a gvdb file instead of a walk over the deploy
+ * tree. It records the generation, inode and mtime of .changed and
+ * the mtimes of the app and runtime dirs when it was built, and is
+ * rebuilt when they don't match. The generation catches changes that
+ * happen within the mtime resolution, and the inode (.changed is
+ * replaced on every change) ones made concurrently by other
+ * processes. The dir mtimes only catch refs removed by hand. */
+static guint64
+get_mtime_usec (GFile *file)
+{
+  g_autofree char *path = g_file_get_path (file);
+  struct stat stbuf;
+
+  if (stat (path, &stbuf) != 0)
+    return 0;
+
+  return (guint64)stbuf.st_mtim.tv_sec * G_USEC_PER_SEC + stbuf.st_mtim.tv_nsec / 1000;
+}
+
+static GVariant *
+get_refs_index_stamp (XdgAppDir *self)
+{
+  g_autoptr(GFile) changed = xdg_app_dir_get_changed_path (self);
+  g_autoptr(GFile) app_dir = g_file_get_child (self->basedir, "app");
+  g_autoptr(GFile) runtime_dir = g_file_get_child (self->basedir, "runtime");
+  struct stat stbuf;
+  guint64 changed_ino = 0;
+
+  if (stat (gs_file_get_path_cached (changed), &stbuf) == 0)
+    changed_ino = stbuf.st_ino;
+
+  return g_variant_ref_sink (g_variant_new ("(ttttt)",
+                                            get_changed_generation (self),
+                                            changed_ino,
+                                            get_mtime_usec (changed),
+                                            get_mtime_usec (app_dir),
+                                            get_mtime_usec (runtime_dir)));
+}
+
+static GvdbTable *
+build_refs_index (XdgAppDir     *self,
+                  GCancellable  *cancellable,
+                  GError       **error)
+{
+  g_autoptr(GVariant) stamp = NULL;
+  g_autoptr(GFile) index_file = NULL;
+  g_autoptr(GBytes) contents = NULL;
+  GHashTable *root;
+  GHashTable *refs_h;
+  GvdbItem *item;
+  const char *kinds[] = { "app", "runtime" };
+  GvdbTable *index;
+  int i, j;
+
+  /* Take the stamp before scanning, so that we never record a stamp
+     newer than the state we saw */
+  stamp = get_refs_index_stamp (self);
+
+  root = gvdb_hash_table_new (NULL, NULL);
+  refs_h = gvdb_hash_table_new (root, "refs");
+  g_hash_table_unref (refs_h);
+
+  for (i = 0; i < G_N_ELEMENTS (kinds); i++)
+    {
+      g_auto(GStrv) refs = NULL;
+
+      if (!scan_refs (self, kinds[i], &refs, cancellable, error))
+        {
+          g_hash_table_unref (root);
+          return NULL;
+        }
+
+      for (j = 0; refs[j] != NULL; j++)
+        {
+          g_autofree char *active = xdg_app_dir_read_active (self, refs[j], cancellable);
+
+          item = gvdb_hash_table_insert (refs_h, refs[j]);
+          gvdb_item_set_value (item, g_variant_new_string (active ? active : ""));
+        }
+    }
+
+  item = gvdb_hash_table_insert (root, "stamp");
+  gvdb_item_set_value (item, stamp);
+
+  contents = gvdb_table_get_content (root, FALSE);
+  g_hash_table_unref (root);
+
+  /* This is only a cache, and e.g. users can't write the index of
+     the system installation */
+  index_file = g_file_get_child (self->basedir, ".refs-index");
+  if (!g_file_replace_contents (index_file,
+                                g_bytes_get_data (contents, NULL),
+                                g_bytes_get_size (contents),
+                                NULL, FALSE,
+                                G_FILE_CREATE_REPLACE_DESTINATION, NULL,
+                                cancellable, NULL))
+    g_debug ("Failed to save refs index");
+
+  index = gvdb_table_new_from_bytes (contents, TRUE, error);
+  if (index == NULL)
+    return NULL;
+
+  return index;
+}
+
+/* Returns the table mapping each deployed ref to its active checksum,
+   or "" if it has none */
+static GvdbTable *
+get_refs_index (XdgAppDir     *self,
+                GCancellable  *cancellable,
+                GError       **error)
+{
+  g_autoptr(GVariant) stamp = NULL;
+  g_autoptr(GFile) index_file = NULL;
+  GvdbTable *index;
+  GvdbTable *refs;
+
+  g_rec_mutex_lock (&self->refs_index_lock);
+
+  stamp = get_refs_index_stamp (self);
+  index_file = g_file_get_child (self->basedir, ".refs-index");
+
+  index = gvdb_table_new (gs_file_get_path_cached (index_file), FALSE, NULL);
+  if (index != NULL)
+    {
+      g_autoptr(GVariant) saved_stamp = gvdb_table_get_value (index, "stamp");
+
+      if (saved_stamp == NULL || !g_variant_equal (saved_stamp, stamp))
+        g_clear_pointer (&index, gvdb_table_free);
+    }
+
+  if (index == NULL)
+    {
+      g_debug ("Rebuilding refs index");
+      index = build_refs_index (self, cancellable, error);
+    }
+
+  g_rec_mutex_unlock (&self->refs_index_lock);
+
+  if (index == NULL)
+    return NULL;
+
+  refs = gvdb_table_get_table (index, "refs");
+  gvdb_table_free (index);
+
+  if (refs == NULL)
+    {
+      xdg_app_fail (error, "Invalid refs index");
+      return NULL;
+    }
+
+  return refs;
+}
+
+static gboolean
+list_indexed_refs (XdgAppDir      *self,
+                   const char     *prefix,
+                   char         ***refs_out,
+                   GCancellable   *cancellable,
+                   GError        **error)
+{
+  GvdbTable *index;
+  g_autofree char **names = NULL;
+  GPtrArray *refs;
+  int i;
+
+  index = get_refs_index (self, cancellable, error);
+  if (index == NULL)
+    return FALSE;
+
+  names = gvdb_table_get_names (index, NULL);
+  gvdb_table_free (index);
+
+  refs = g_ptr_array_new ();
+  for (i = 0; names[i] != NULL; i++)
+    {
+      if (g_str_has_prefix (names[i], prefix))
+        g_ptr_array_add (refs, names[i]);
+      else
+        g_free (names[i]);
+    }
+
+  g_ptr_array_sort (refs, (GCompareFunc)strvcmp);
+  g_ptr_array_add (refs, NULL);
+  *refs_out = (char **)g_ptr_array_free (refs, FALSE);
+
+  return TRUE;
+}
+
+gboolean
+xdg_app_dir_list_refs_for_name (XdgAppDir      *self,
+                                const char     *kind,
+                                const char     *name,
+                                char         ***refs_out,
+                                GCancellable   *cancellable,
+                                GError        **error)
+{
+  g_autofree char *prefix = g_strdup_printf ("%s/%s/", kind, name);
+
+  return list_indexed_refs (self, prefix, refs_out, cancellable, error);
+}
+
+gboolean
+xdg_app_dir_list_refs (XdgAppDir      *self,
+                       const char     *kind,
+                       char         ***refs_out,
+                       GCancellable   *cancellable,
+                       GError        **error)
+{
+  g_autofree char *prefix = g_strdup_printf ("%s/", kind);
+
+  return list_indexed_refs (self, prefix, refs_out, cancellable, error);
+}
+
 gboolean
 xdg_app_dir_set_active (XdgAppDir *self,
                         const char *ref,
@@ -855,120 +1167,464 @@ xdg_app_dir_set_active (XdgAppDir *self,
         }
     }
 
+  /* The change has already happened, so don't fail for this. It only
+     means caches may be used for a while after they are stale. */
+  if (!xdg_app_dir_mark_changed (self, &my_error))
+    {
+      g_warning ("Failed to mark %s as changed: %s",
+                 gs_file_get_path_cached (self->basedir), my_error->message);
+      g_clear_error (&my_error);
+    }
+
   ret = TRUE;
  out:
   return ret;
 }
 
 
-gboolean
-xdg_app_dir_run_triggers (XdgAppDir *self,
-			  GCancellable *cancellable,
-			  GError **error)
-{
-  gboolean ret = FALSE;
-  g_autoptr(GFileEnumerator) dir_enum = NULL;
-  g_autoptr(GFileInfo) child_info = NULL;
-  g_autoptr(GFile) triggersdir = NULL;
-  GError *temp_error = NULL;
+/* A trigger can declare which subtrees of the exports it reads,
+ * with header lines like:
+ *
+ *   # xdg-app-trigger-depends: share/applications
+ *
+ * Triggers that do are only run when something in those subtrees
+ * changed since they last ran, and they are run concurrently, since
+ * they don't touch each other's files. Triggers without the header
+ * are always run, one at a time.
+ */
+#define TRIGGER_DEPENDS_PREFIX "# xdg-app-trigger-depends:"
 
-  g_debug ("running triggers");
+typedef struct {
+  char *name;
+  char **depends;
+  GPid pid;
+} TriggerRun;
 
-  triggersdir = g_file_new_for_path (XDG_APP_TRIGGERDIR);
+static void
+trigger_run_free (TriggerRun *run)
+{
+  g_free (run->name);
+  g_strfreev (run->depends);
+  g_free (run);
+}
 
-  dir_enum = g_file_enumerate_children (triggersdir, "standard::type,standard::name",
-                                        0, cancellable, error);
-  if (!dir_enum)
-    goto out;
+static char **
+get_trigger_depends (GFile *trigger)
+{
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  g_autoptr(GPtrArray) depends = NULL;
+  int i, j;
 
-  while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)) != NULL)
+  if (!g_file_load_contents (trigger, NULL, &contents, NULL, NULL, NULL))
+    return NULL;
+
+  depends = g_ptr_array_new_with_free_func (g_free);
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
     {
-      g_autoptr(GFile) child = NULL;
-      const char *name;
-      GError *trigger_error = NULL;
+      g_auto(GStrv) dirs = NULL;
 
-      name = g_file_info_get_name (child_info);
+      if (!g_str_has_prefix (lines[i], TRIGGER_DEPENDS_PREFIX))
+        continue;
 
-      child = g_file_get_child (triggersdir, name);
+      dirs = g_strsplit (lines[i] + strlen (TRIGGER_DEPENDS_PREFIX), " ", -1);
+      for (j = 0; dirs[j] != NULL; j++)
+        {
+          if (*dirs[j] != 0)
+            g_ptr_array_add (depends, g_strdup (dirs[j]));
+        }
+    }
 
-      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_REGULAR &&
-	  g_str_has_suffix (name, ".trigger"))
-	{
-	  g_autoptr(GPtrArray) argv_array = NULL;
-
-	  g_debug ("running trigger %s", name);
-
-	  argv_array = g_ptr_array_new_with_free_func (g_free);
-	  g_ptr_array_add (argv_array, g_strdup (HELPER));
-	  g_ptr_array_add (argv_array, g_strdup ("-a"));
-	  g_ptr_array_add (argv_array, g_file_get_path (self->basedir));
-	  g_ptr_array_add (argv_array, g_strdup ("-e"));
-	  g_ptr_array_add (argv_array, g_strdup ("-F"));
-	  g_ptr_array_add (argv_array, g_strdup ("/usr"));
-	  g_ptr_array_add (argv_array, g_file_get_path (child));
-	  g_ptr_array_add (argv_array, NULL);
-
-	  if (!g_spawn_sync ("/",
-			     (char **)argv_array->pdata,
-			     NULL,
-			     G_SPAWN_DEFAULT,
-			     NULL, NULL,
-			     NULL, NULL,
-			     NULL, &trigger_error))
-	    {
-	      g_warning ("Error running trigger %s: %s", name, trigger_error->message);
-	      g_clear_error (&trigger_error);
-	    }
-	}
+  if (depends->len == 0)
+    return NULL;
 
-      g_clear_object (&child_info);
-    }
+  g_ptr_array_add (depends, NULL);
+  return (char **)g_ptr_array_free (g_steal_pointer (&depends), FALSE);
+}
 
-  if (temp_error != NULL)
-    {
-      g_propagate_error (error, temp_error);
-      goto out;
-    }
+static gboolean
+is_same_or_subdir (const char *dir,
+                   const char *parent)
+{
+  gsize len = strlen (parent);
 
-  ret = TRUE;
- out:
-  return ret;
+  return strncmp (dir, parent, len) == 0 && (dir[len] == 0 || dir[len] == '/');
 }
 
 static gboolean
-read_fd (int           fd,
-         struct stat  *stat_buf,
-         gchar       **contents,
-         gsize        *length,
-         GError      **error)
+trigger_depends_changed (char              **depends,
+                         const char * const *changed_dirs)
 {
-  gchar *buf;
-  gsize bytes_read;
-  gsize size;
-  gsize alloc_size;
+  int i, j;
 
-  size = stat_buf->st_size;
+  for (i = 0; depends[i] != NULL; i++)
+    for (j = 0; changed_dirs[j] != NULL; j++)
+      {
+        if (is_same_or_subdir (changed_dirs[j], depends[i]) ||
+            is_same_or_subdir (depends[i], changed_dirs[j]))
+          return TRUE;
+      }
 
-  alloc_size = size + 1;
-  buf = g_try_malloc (alloc_size);
+  return FALSE;
+}
 
-  if (buf == NULL)
-    {
-      g_set_error (error,
-                   G_FILE_ERROR,
-                   G_FILE_ERROR_NOMEM,
-                   "not enough memory");
-      return FALSE;
-    }
+static int
+compare_names (gconstpointer a,
+               gconstpointer b)
+{
+  return strcmp (*(const char **)a, *(const char **)b);
+}
 
-  bytes_read = 0;
-  while (bytes_read < size)
+/* Adds the names and stat info of everything under a directory of
+   the exports, following the symlinks into the deployments. A new
+   deployment means new inodes, so this catches content changes
+   without reading any files. */
+static void
+hash_export_tree (GChecksum  *checksum,
+                  int         parent_fd,
+                  const char *name,
+                  const char *relpath)
+{
+  g_auto(GLnxDirFdIterator) iter = {0};
+  g_autoptr(GPtrArray) names = NULL;
+  struct dirent *dent;
+  int i;
+
+  if (!glnx_dirfd_iterator_init_at (parent_fd, name, TRUE, &iter, NULL))
+    return;
+
+  /* Hash in a stable order */
+  names = g_ptr_array_new_with_free_func (g_free);
+  while (glnx_dirfd_iterator_next_dent (&iter, &dent, NULL, NULL) && dent != NULL)
+    g_ptr_array_add (names, g_strdup (dent->d_name));
+  g_ptr_array_sort (names, compare_names);
+
+  for (i = 0; i < names->len; i++)
     {
-      gssize rc;
+      const char *child_name = g_ptr_array_index (names, i);
+      g_autofree char *child_relpath = g_build_filename (relpath, child_name, NULL);
+      struct stat stbuf;
 
-      rc = read (fd, buf + bytes_read, size - bytes_read);
+      if (fstatat (iter.fd, child_name, &stbuf, 0) != 0)
+        continue;
 
-      if (rc < 0)
+      g_checksum_update (checksum, (guchar *)child_relpath, strlen (child_relpath) + 1);
+
+      if (S_ISDIR (stbuf.st_mode))
+        hash_export_tree (checksum, iter.fd, child_name, child_relpath);
+      else
+        {
+          guint64 info[3];
+
+          info[0] = stbuf.st_ino;
+          info[1] = stbuf.st_size;
+          info[2] = stbuf.st_mtime;
+          g_checksum_update (checksum, (guchar *)info, sizeof (info));
+        }
+    }
+}
+
+static char *
+get_trigger_inputs_hash (XdgAppDir *self,
+                         char     **depends)
+{
+  g_autoptr(GFile) exports = NULL;
+  GChecksum *checksum;
+  char *res;
+  int i;
+
+  exports = xdg_app_dir_get_exports_dir (self);
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  for (i = 0; depends[i] != NULL; i++)
+    {
+      g_autoptr(GFile) dir = g_file_resolve_relative_path (exports, depends[i]);
+
+      g_checksum_update (checksum, (guchar *)depends[i], strlen (depends[i]) + 1);
+      hash_export_tree (checksum, AT_FDCWD, gs_file_get_path_cached (dir), depends[i]);
+    }
+
+  res = g_strdup (g_checksum_get_string (checksum));
+  g_checksum_free (checksum);
+  return res;
+}
+
+/* A trigger must also run again when its script changes, e.g. with a
+   new version of xdg-app, whatever its inputs */
+static char *
+get_trigger_script_hash (const char *name)
+{
+  g_autofree char *path = g_build_filename (XDG_APP_TRIGGERDIR, name, NULL);
+  g_autofree char *contents = NULL;
+  gsize len;
+
+  if (!g_file_get_contents (path, &contents, &len, NULL))
+    return g_strdup ("");
+
+  return g_compute_checksum_for_data (G_CHECKSUM_SHA256, (guchar *)contents, len);
+}
+
+/* The stamp of a trigger holds the hash of its script and of its
+   inputs, on separate lines */
+static GFile *
+get_trigger_stamp_file (XdgAppDir  *self,
+                        const char *name)
+{
+  g_autoptr(GFile) stamps = g_file_get_child (self->basedir, ".triggers");
+  return g_file_get_child (stamps, name);
+}
+
+static void
+save_trigger_stamp (XdgAppDir  *self,
+                    TriggerRun *run)
+{
+  g_autoptr(GFile) stamp = get_trigger_stamp_file (self, run->name);
+  g_autoptr(GFile) stamps = g_file_get_parent (stamp);
+  g_autofree char *script_hash = get_trigger_script_hash (run->name);
+  g_autofree char *inputs_hash = get_trigger_inputs_hash (self, run->depends);
+  g_autofree char *hash = g_strconcat (script_hash, "\n", inputs_hash, NULL);
+
+  /* Without a stamp the trigger just runs again next time */
+  if (!gs_file_ensure_directory (stamps, TRUE, NULL, NULL) ||
+      !g_file_replace_contents (stamp, hash, strlen (hash), NULL, FALSE,
+                                G_FILE_CREATE_REPLACE_DESTINATION, NULL,
+                                NULL, NULL))
+    g_debug ("Failed to save stamp for trigger %s", run->name);
+}
+
+static gboolean
+trigger_needs_run (XdgAppDir          *self,
+                   TriggerRun         *run,
+                   const char * const *changed_dirs)
+{
+  g_autoptr(GFile) stamp = NULL;
+  g_autofree char *old_hash = NULL;
+  g_autofree char *script_hash = NULL;
+  g_autofree char *inputs_hash = NULL;
+  char *old_inputs_hash;
+
+  stamp = get_trigger_stamp_file (self, run->name);
+  if (!g_file_load_contents (stamp, NULL, &old_hash, NULL, NULL, NULL))
+    return TRUE;
+
+  old_inputs_hash = strchr (old_hash, '\n');
+  if (old_inputs_hash == NULL)
+    return TRUE;
+  *old_inputs_hash++ = 0;
+
+  script_hash = get_trigger_script_hash (run->name);
+  if (strcmp (script_hash, old_hash) != 0)
+    return TRUE;
+
+  if (changed_dirs != NULL && !trigger_depends_changed (run->depends, changed_dirs))
+    return FALSE;
+
+  inputs_hash = get_trigger_inputs_hash (self, run->depends);
+  return strcmp (inputs_hash, old_inputs_hash) != 0;
+}
+
+static char **
+get_trigger_argv (XdgAppDir *self,
+                  const char *name)
+{
+  GPtrArray *argv_array;
+
+  argv_array = g_ptr_array_new ();
+  g_ptr_array_add (argv_array, g_strdup (HELPER));
+  g_ptr_array_add (argv_array, g_strdup ("-a"));
+  g_ptr_array_add (argv_array, g_file_get_path (self->basedir));
+  g_ptr_array_add (argv_array, g_strdup ("-e"));
+  g_ptr_array_add (argv_array, g_strdup ("-F"));
+  g_ptr_array_add (argv_array, g_strdup ("/usr"));
+  g_ptr_array_add (argv_array, g_build_filename (XDG_APP_TRIGGERDIR, name, NULL));
+  g_ptr_array_add (argv_array, NULL);
+
+  return (char **)g_ptr_array_free (argv_array, FALSE);
+}
+
+/* If changed_dirs is not NULL, it lists the directories under the
+   exports where files changed. It is used to skip triggers that
+   don't depend on them, and is passed to the triggers that run in
+   XDG_APP_EXPORTS_CHANGED, so they can limit their work. */
+gboolean
+xdg_app_dir_run_triggers (XdgAppDir *self,
+			  const char * const *changed_dirs,
+			  GCancellable *cancellable,
+			  GError **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  g_autoptr(GFileInfo) child_info = NULL;
+  g_autoptr(GFile) triggersdir = NULL;
+  g_autoptr(GPtrArray) concurrent = NULL;
+  g_autoptr(GPtrArray) serial = NULL;
+  g_auto(GStrv) envp = NULL;
+  GError *temp_error = NULL;
+  int i;
+
+  g_debug ("running triggers");
+
+  envp = g_get_environ ();
+  if (changed_dirs != NULL)
+    {
+      g_autofree char *dirs = g_strjoinv (":", (char **)changed_dirs);
+      envp = g_environ_setenv (envp, "XDG_APP_EXPORTS_CHANGED", dirs, TRUE);
+    }
+
+  triggersdir = g_file_new_for_path (XDG_APP_TRIGGERDIR);
+
+  dir_enum = g_file_enumerate_children (triggersdir, "standard::type,standard::name",
+                                        0, cancellable, error);
+  if (!dir_enum)
+    goto out;
+
+  concurrent = g_ptr_array_new_with_free_func ((GDestroyNotify)trigger_run_free);
+  serial = g_ptr_array_new_with_free_func ((GDestroyNotify)trigger_run_free);
+
+  while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)) != NULL)
+    {
+      g_autoptr(GFile) child = NULL;
+      const char *name;
+
+      name = g_file_info_get_name (child_info);
+
+      child = g_file_get_child (triggersdir, name);
+
+      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_REGULAR &&
+	  g_str_has_suffix (name, ".trigger"))
+	{
+	  TriggerRun *run = g_new0 (TriggerRun, 1);
+
+	  run->name = g_strdup (name);
+	  run->depends = get_trigger_depends (child);
+
+	  if (run->depends == NULL)
+	    g_ptr_array_add (serial, run);
+	  else if (trigger_needs_run (self, run, changed_dirs))
+	    g_ptr_array_add (concurrent, run);
+	  else
+	    {
+	      g_debug ("skipping trigger %s, its inputs are unchanged", name);
+	      trigger_run_free (run);
+	    }
+	}
+
+      g_clear_object (&child_info);
+    }
+
+  if (temp_error != NULL)
+    {
+      g_propagate_error (error, temp_error);
+      goto out;
+    }
+
+  for (i = 0; i < concurrent->len; i++)
+    {
+      TriggerRun *run = g_ptr_array_index (concurrent, i);
+      g_auto(GStrv) argv = get_trigger_argv (self, run->name);
+      GError *trigger_error = NULL;
+
+      g_debug ("running trigger %s", run->name);
+
+      if (!g_spawn_async ("/", argv, envp,
+                          G_SPAWN_DO_NOT_REAP_CHILD,
+                          NULL, NULL,
+                          &run->pid, &trigger_error))
+        {
+          g_warning ("Error running trigger %s: %s", run->name, trigger_error->message);
+          g_clear_error (&trigger_error);
+        }
+    }
+
+  for (i = 0; i < concurrent->len; i++)
+    {
+      TriggerRun *run = g_ptr_array_index (concurrent, i);
+      GError *trigger_error = NULL;
+      int status;
+
+      if (run->pid == 0)
+        continue;
+
+      while (waitpid (run->pid, &status, 0) == -1)
+        {
+          if (errno != EINTR)
+            {
+              status = -1;
+              break;
+            }
+        }
+      g_spawn_close_pid (run->pid);
+
+      if (!g_spawn_check_exit_status (status, &trigger_error))
+        {
+          g_warning ("Error running trigger %s: %s", run->name, trigger_error->message);
+          g_clear_error (&trigger_error);
+        }
+      else
+        save_trigger_stamp (self, run);
+    }
+
+  for (i = 0; i < serial->len; i++)
+    {
+      TriggerRun *run = g_ptr_array_index (serial, i);
+      g_auto(GStrv) argv = get_trigger_argv (self, run->name);
+      GError *trigger_error = NULL;
+
+      g_debug ("running trigger %s", run->name);
+
+      if (!g_spawn_sync ("/",
+			 argv,
+			 envp,
+			 G_SPAWN_DEFAULT,
+			 NULL, NULL,
+			 NULL, NULL,
+			 NULL, &trigger_error))
+	{
+	  g_warning ("Error running trigger %s: %s", run->name, trigger_error->message);
+	  g_clear_error (&trigger_error);
+	}
+    }
+
+  ret = TRUE;
+ out:
+  return ret;
+}
+
+static gboolean
+read_fd (int           fd,
+         struct stat  *stat_buf,
+         gchar       **contents,
+         gsize        *length,
+         GError      **error)
+{
+  gchar *buf;
+  gsize bytes_read;
+  gsize size;
+  gsize alloc_size;
+
+  size = stat_buf->st_size;
+
+  alloc_size = size + 1;
+  buf = g_try_malloc (alloc_size);
+
+  if (buf == NULL)
+    {
+      g_set_error (error,
+                   G_FILE_ERROR,
+                   G_FILE_ERROR_NOMEM,
+                   "not enough memory");
+      return FALSE;
+    }
+
+  bytes_read = 0;
+  while (bytes_read < size)
+    {
+      gssize rc;
+
+      rc = read (fd, buf + bytes_read, size - bytes_read);
+
+      if (rc < 0)
         {
           if (errno != EINTR)
             {
@@ -1379,106 +2035,490 @@ xdg_app_export_dir (GFile    *source,
   return ret;
 }
 
-gboolean
-xdg_app_dir_update_exports (XdgAppDir *self,
-                            const char *changed_app,
-                            GCancellable *cancellable,
-                            GError **error)
+/* The export manifest of an app lists the files it currently has
+ * in the exports, each with a checksum of its content, so that an
+ * update only needs to touch the symlinks of files that were added
+ * or removed, and knows which directories have changed content. */
+static GFile *
+get_export_manifest_file (XdgAppDir  *self,
+                          const char *app)
 {
-  gboolean ret = FALSE;
-  g_autoptr(GFile) exports = NULL;
-  g_autofree char *current_ref = NULL;
-  g_autofree char *active_id = NULL;
-  g_autofree char *symlink_prefix = NULL;
+  g_autoptr(GFile) manifests = g_file_get_child (self->basedir, ".export-manifests");
+  return g_file_get_child (manifests, app);
+}
 
-  exports = xdg_app_dir_get_exports_dir (self);
+static GHashTable *
+load_export_manifest (GFile *file)
+{
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  GHashTable *manifest;
+  int i;
 
-  if (!gs_file_ensure_directory (exports, TRUE, cancellable, error))
-    goto out;
+  if (!g_file_load_contents (file, NULL, &contents, NULL, NULL, NULL))
+    return NULL;
 
-  if (changed_app &&
-      (current_ref = xdg_app_dir_current_ref (self, changed_app, cancellable)) &&
-      (active_id = xdg_app_dir_read_active (self, current_ref, cancellable)))
+  manifest = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
     {
-      g_autoptr(GFile) deploy_base = NULL;
-      g_autoptr(GFile) active = NULL;
-      g_autoptr(GFile) export = NULL;
+      char *space = strchr (lines[i], ' ');
 
-      deploy_base = xdg_app_dir_get_deploy_dir (self, current_ref);
-      active = g_file_get_child (deploy_base, active_id);
-      export = g_file_get_child (active, "export");
+      if (space == NULL)
+        continue;
 
-      if (g_file_query_exists (export, cancellable))
-        {
-          symlink_prefix = g_build_filename ("..", "app", changed_app, "current", "active", "export", NULL);
-          if (!xdg_app_export_dir (export, exports,
-                                   symlink_prefix,
-                                   cancellable,
-                                   error))
-            goto out;
-        }
+      *space = 0;
+      g_hash_table_insert (manifest, g_strdup (space + 1), g_strdup (lines[i]));
     }
 
-  if (!xdg_app_remove_dangling_symlinks (exports, cancellable, error))
-    goto out;
+  return manifest;
+}
 
-  if (!xdg_app_dir_run_triggers (self, cancellable, error))
-    goto out;
+static gboolean
+save_export_manifest (GFile        *file,
+                      GHashTable   *manifest,
+                      GCancellable *cancellable,
+                      GError      **error)
+{
+  g_autoptr(GFile) parent = NULL;
+  GString *contents;
+  GHashTableIter iter;
+  gpointer key, value;
+  gboolean res;
 
-  ret = TRUE;
+  if (g_hash_table_size (manifest) == 0)
+    {
+      g_file_delete (file, cancellable, NULL);
+      return TRUE;
+    }
 
- out:
-  return ret;
+  parent = g_file_get_parent (file);
+  if (!gs_file_ensure_directory (parent, TRUE, cancellable, error))
+    return FALSE;
+
+  contents = g_string_new ("");
+  g_hash_table_iter_init (&iter, manifest);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_string_append_printf (contents, "%s %s\n", (char *)value, (char *)key);
+
+  res = g_file_replace_contents (file, contents->str, contents->len, NULL, FALSE,
+                                 G_FILE_CREATE_REPLACE_DESTINATION, NULL,
+                                 cancellable, error);
+  g_string_free (contents, TRUE);
+  return res;
 }
 
-gboolean
-xdg_app_dir_deploy (XdgAppDir *self,
-                    const char *ref,
-                    const char *checksum,
-                    GCancellable *cancellable,
-                    GError **error)
+static gboolean
+scan_export_dir (int            parent_fd,
+                 const char    *name,
+                 const char    *relpath,
+                 GHashTable    *manifest,
+                 GCancellable  *cancellable,
+                 GError       **error)
 {
-  gboolean ret = FALSE;
-  g_autofree char *resolved_ref = NULL;
-  g_autoptr(GFile) root = NULL;
-  g_autoptr(GFileInfo) file_info = NULL;
-  g_autoptr(GFile) deploy_base = NULL;
-  g_autoptr(GFile) checkoutdir = NULL;
-  g_autoptr(GFile) dotref = NULL;
-  g_autoptr(GFile) export = NULL;
-
-  if (!xdg_app_dir_ensure_repo (self, cancellable, error))
-    goto out;
+  g_auto(GLnxDirFdIterator) iter = {0};
+  struct dirent *dent;
 
-  deploy_base = xdg_app_dir_get_deploy_dir (self, ref);
+  if (!glnx_dirfd_iterator_init_at (parent_fd, name, FALSE, &iter, error))
+    return FALSE;
 
-  if (checksum == NULL)
+  while (TRUE)
     {
-      g_autofree char *origin = xdg_app_dir_get_origin (self, ref, NULL, NULL);
-      g_autofree char *origin_and_ref = NULL;
+      struct stat stbuf;
+      g_autofree char *child_relpath = NULL;
 
-      /* There may be several remotes with the same branch (if we for
-       * instance changed the origin, so prepend the current origin to
-       * make sure we get the right one */
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, cancellable, error))
+        return FALSE;
 
-      if (origin)
-        origin_and_ref = g_strdup_printf ("%s:%s", origin, ref);
-      else
-        origin_and_ref = g_strdup (ref);
+      if (dent == NULL)
+        break;
 
-      g_debug ("No checksum specified, getting tip of %s", origin_and_ref);
-      if (!ostree_repo_resolve_rev (self->repo, origin_and_ref, FALSE, &resolved_ref, error))
+      if (fstatat (iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
         {
-          g_prefix_error (error, "While trying to resolve ref %s: ", ref);
-          goto out;
+          if (errno == ENOENT)
+            continue;
+          glnx_set_error_from_errno (error);
+          return FALSE;
         }
 
-      checksum = resolved_ref;
-      g_debug ("tip resolved to: %s", checksum);
-    }
-  else
-    {
-      g_autoptr(GFile) root = NULL;
+      child_relpath = g_build_filename (relpath, dent->d_name, NULL);
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          if (!scan_export_dir (iter.fd, dent->d_name, child_relpath, manifest,
+                                cancellable, error))
+            return FALSE;
+        }
+      else if (S_ISREG (stbuf.st_mode))
+        {
+          glnx_fd_close int fd = -1;
+          g_autofree char *data = NULL;
+          gsize data_len;
+
+          if (!gs_file_openat_noatime (iter.fd, dent->d_name, &fd, cancellable, error))
+            return FALSE;
+
+          if (!read_fd (fd, &stbuf, &data, &data_len, error))
+            return FALSE;
+
+          g_hash_table_insert (manifest, g_steal_pointer (&child_relpath),
+                               g_compute_checksum_for_data (G_CHECKSUM_SHA256, (guchar *)data, data_len));
+        }
+    }
+
+  return TRUE;
+}
+
+/* Exports the files of the current version of an app, by diffing
+ * them against the manifest of what was exported last time. The
+ * directories with added, removed or modified files are added to
+ * changed_dirs. If there was no manifest, stale symlinks from the
+ * previous version can't be found, and need_sweep gets set. */
+static gboolean
+xdg_app_dir_export_app (XdgAppDir *self,
+                        GFile *exports,
+                        const char *changed_app,
+                        GHashTable *changed_dirs,
+                        gboolean *need_sweep,
+                        GCancellable *cancellable,
+                        GError **error)
+{
+  g_autofree char *current_ref = NULL;
+  g_autofree char *active_id = NULL;
+  g_autofree char *symlink_prefix = NULL;
+  g_autoptr(GHashTable) old_manifest = NULL;
+  g_autoptr(GHashTable) new_manifest = NULL;
+  g_autoptr(GFile) manifest_file = NULL;
+  const char *exports_path;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  new_manifest = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  if ((current_ref = xdg_app_dir_current_ref (self, changed_app, cancellable)) &&
+      (active_id = xdg_app_dir_read_active (self, current_ref, cancellable)))
+    {
+      g_autoptr(GFile) deploy_base = NULL;
+      g_autoptr(GFile) active = NULL;
+      g_autoptr(GFile) export = NULL;
+
+      deploy_base = xdg_app_dir_get_deploy_dir (self, current_ref);
+      active = g_file_get_child (deploy_base, active_id);
+      export = g_file_get_child (active, "export");
+
+      if (g_file_query_exists (export, cancellable) &&
+          !scan_export_dir (AT_FDCWD, gs_file_get_path_cached (export), "",
+                            new_manifest, cancellable, error))
+        return FALSE;
+    }
+
+  manifest_file = get_export_manifest_file (self, changed_app);
+  old_manifest = load_export_manifest (manifest_file);
+  if (old_manifest == NULL)
+    {
+      *need_sweep = TRUE;
+      old_manifest = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    }
+
+  exports_path = gs_file_get_path_cached (exports);
+  symlink_prefix = g_build_filename ("..", "app", changed_app, "current", "active", "export", NULL);
+
+  g_hash_table_iter_init (&iter, old_manifest);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      g_autofree char *path = NULL;
+
+      if (g_hash_table_contains (new_manifest, key))
+        continue;
+
+      path = g_build_filename (exports_path, key, NULL);
+      if (unlink (path) != 0 && errno != ENOENT)
+        {
+          glnx_set_error_from_errno (error);
+          return FALSE;
+        }
+
+      g_hash_table_add (changed_dirs, g_path_get_dirname (key));
+    }
+
+  g_hash_table_iter_init (&iter, new_manifest);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const char *relpath = key;
+      const char *old_checksum = g_hash_table_lookup (old_manifest, relpath);
+      g_autofree char *path = NULL;
+      struct stat stbuf;
+
+      if (old_checksum == NULL || strcmp (old_checksum, value) != 0)
+        g_hash_table_add (changed_dirs, g_path_get_dirname (relpath));
+
+      /* The symlinks go through the current and active links, so
+         they don't change when the app is updated */
+      path = g_build_filename (exports_path, relpath, NULL);
+      if (old_checksum == NULL || lstat (path, &stbuf) != 0)
+        {
+          g_autoptr(GFile) file = g_file_new_for_path (path);
+          g_autoptr(GFile) parent = g_file_get_parent (file);
+          g_autoptr(GString) target = g_string_new ("");
+          const char *p;
+
+          if (!gs_file_ensure_directory (parent, TRUE, cancellable, error))
+            return FALSE;
+
+          for (p = strchr (relpath, '/'); p != NULL; p = strchr (p + 1, '/'))
+            g_string_append (target, "../");
+          g_string_append_printf (target, "%s/%s", symlink_prefix, relpath);
+
+          if (unlink (path) != 0 && errno != ENOENT)
+            {
+              glnx_set_error_from_errno (error);
+              return FALSE;
+            }
+
+          if (symlink (target->str, path) != 0)
+            {
+              glnx_set_error_from_errno (error);
+              return FALSE;
+            }
+        }
+    }
+
+  return save_export_manifest (manifest_file, new_manifest, cancellable, error);
+}
+
+gboolean
+xdg_app_dir_update_exports (XdgAppDir *self,
+                            const char *changed_app,
+                            GCancellable *cancellable,
+                            GError **error)
+{
+  const char *changed_apps[2];
+
+  changed_apps[0] = changed_app;
+  changed_apps[1] = NULL;
+  return xdg_app_dir_update_exports_for_apps (self, changed_apps, cancellable, error);
+}
+
+/* Like xdg_app_dir_update_exports(), but for many apps at once, with
+   a single pass over the exports and a single run of the triggers */
+gboolean
+xdg_app_dir_update_exports_for_apps (XdgAppDir *self,
+                                     const char * const *changed_apps,
+                                     GCancellable *cancellable,
+                                     GError **error)
+{
+  gboolean ret = FALSE;
+  g_autoptr(GFile) exports = NULL;
+  g_autoptr(GHashTable) changed_dirs = NULL;
+  gboolean need_sweep = FALSE;
+  int i;
+
+  exports = xdg_app_dir_get_exports_dir (self);
+
+  if (!gs_file_ensure_directory (exports, TRUE, cancellable, error))
+    goto out;
+
+  changed_dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  if (changed_apps == NULL || changed_apps[0] == NULL)
+    need_sweep = TRUE;
+
+  for (i = 0; changed_apps != NULL && changed_apps[i] != NULL; i++)
+    {
+      if (!xdg_app_dir_export_app (self, exports, changed_apps[i],
+                                   changed_dirs, &need_sweep,
+                                   cancellable, error))
+        goto out;
+    }
+
+  if (need_sweep)
+    {
+      if (!xdg_app_remove_dangling_symlinks (exports, cancellable, error))
+        goto out;
+
+      /* We don't know what the sweep removed, so let the triggers
+         look at everything */
+      if (!xdg_app_dir_run_triggers (self, NULL, cancellable, error))
+        goto out;
+    }
+  else if (g_hash_table_size (changed_dirs) > 0)
+    {
+      g_autofree char **dirs = NULL;
+
+      dirs = (char **)g_hash_table_get_keys_as_array (changed_dirs, NULL);
+      if (!xdg_app_dir_run_triggers (self, (const char * const *)dirs, cancellable, error))
+        goto out;
+    }
+  else
+    g_debug ("No exported files changed, not running triggers");
+
+  ret = TRUE;
+
+ out:
+  return ret;
+}
+
+/* Whether files can be hardlinked from the repo into deploy_base */
+static gboolean
+xdg_app_dir_can_hardlink (XdgAppDir *self,
+                          GFile *deploy_base)
+{
+  g_autoptr(GFile) repodir = NULL;
+  g_autoptr(GFile) deploy_dir = NULL;
+  g_autofree char *repo_path = NULL;
+  struct stat repo_stbuf, deploy_stbuf;
+
+  repodir = g_file_get_child (self->basedir, "repo");
+  repo_path = g_file_get_path (repodir);
+
+  if (stat (repo_path, &repo_stbuf) != 0)
+    return FALSE;
+
+  /* The deploy base may not be created yet, it ends up on the same
+     filesystem as its nearest existing parent */
+  deploy_dir = g_object_ref (deploy_base);
+  while (TRUE)
+    {
+      g_autofree char *deploy_path = g_file_get_path (deploy_dir);
+      GFile *parent;
+
+      if (stat (deploy_path, &deploy_stbuf) == 0)
+        break;
+
+      if (errno != ENOENT)
+        return FALSE;
+
+      parent = g_file_get_parent (deploy_dir);
+      if (parent == NULL)
+        return FALSE;
+
+      g_object_unref (deploy_dir);
+      deploy_dir = parent;
+    }
+
+  return repo_stbuf.st_dev == deploy_stbuf.st_dev;
+}
+
+/* Checks out commit checksum into checkoutdir. The repo is bare (or
+ * bare-user for user installs) and the checkout mode matches it, so
+ * ostree hardlinks the file objects rather than copying them, as long
+ * as the repo and the deploy dir are on the same filesystem. */
+static gboolean
+xdg_app_dir_checkout (XdgAppDir *self,
+                      const char *checksum,
+                      GFile *deploy_base,
+                      GFile *checkoutdir,
+                      GCancellable *cancellable,
+                      GError **error)
+{
+  g_autofree char *checkoutpath = NULL;
+  OstreeRepoCheckoutMode mode;
+
+  mode = self->user ? OSTREE_REPO_CHECKOUT_MODE_USER : OSTREE_REPO_CHECKOUT_MODE_NONE;
+  checkoutpath = g_file_get_path (checkoutdir);
+
+  if (!xdg_app_dir_can_hardlink (self, deploy_base))
+    g_debug ("Repo and %s are on different filesystems, copying files", checkoutpath);
+
+#ifdef HAVE_OSTREE_REPO_CHECKOUT_TREE_AT
+  {
+    OstreeRepoCheckoutOptions options = { 0, };
+
+    options.mode = mode;
+    options.overwrite_mode = OSTREE_REPO_CHECKOUT_OVERWRITE_NONE;
+
+    /* This goes straight from the commit to the dirtree objects,
+       without the per-file GFileInfo queries of the GFile API */
+    if (!ostree_repo_checkout_tree_at (self->repo, &options,
+                                       AT_FDCWD, checkoutpath,
+                                       checksum,
+                                       cancellable, error))
+      {
+        g_prefix_error (error, "While trying to checkout %s into %s: ", checksum, checkoutpath);
+        return FALSE;
+      }
+  }
+#else
+  {
+    g_autoptr(GFile) root = NULL;
+    g_autoptr(GFileInfo) file_info = NULL;
+
+    if (!ostree_repo_read_commit (self->repo, checksum, &root, NULL, cancellable, error))
+      {
+        g_prefix_error (error, "Failed to read commit %s: ", checksum);
+        return FALSE;
+      }
+
+    file_info = g_file_query_info (root, OSTREE_GIO_FAST_QUERYINFO,
+                                   G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                   cancellable, error);
+    if (file_info == NULL)
+      return FALSE;
+
+    if (!ostree_repo_checkout_tree (self->repo, mode,
+                                    OSTREE_REPO_CHECKOUT_OVERWRITE_NONE,
+                                    checkoutdir,
+                                    OSTREE_REPO_FILE (root), file_info,
+                                    cancellable, error))
+      {
+        g_autofree char *rootpath = NULL;
+
+        rootpath = g_file_get_path (root);
+        g_prefix_error (error, "While trying to checkout %s into %s: ", rootpath, checkoutpath);
+        return FALSE;
+      }
+  }
+#endif
+
+  return TRUE;
+}
+
+gboolean
+xdg_app_dir_deploy (XdgAppDir *self,
+                    const char *ref,
+                    const char *checksum,
+                    GCancellable *cancellable,
+                    GError **error)
+{
+  gboolean ret = FALSE;
+  g_autofree char *resolved_ref = NULL;
+  g_autoptr(GFile) deploy_base = NULL;
+  g_autoptr(GFile) checkoutdir = NULL;
+  g_autoptr(GFile) dotref = NULL;
+  g_autoptr(GFile) export = NULL;
+
+  if (!xdg_app_dir_ensure_repo (self, cancellable, error))
+    goto out;
+
+  deploy_base = xdg_app_dir_get_deploy_dir (self, ref);
+
+  if (checksum == NULL)
+    {
+      g_autofree char *origin = xdg_app_dir_get_origin (self, ref, NULL, NULL);
+      g_autofree char *origin_and_ref = NULL;
+
+      /* There may be several remotes with the same branch (if we for
+       * instance changed the origin, so prepend the current origin to
+       * make sure we get the right one */
+
+      if (origin)
+        origin_and_ref = g_strdup_printf ("%s:%s", origin, ref);
+      else
+        origin_and_ref = g_strdup (ref);
+
+      g_debug ("No checksum specified, getting tip of %s", origin_and_ref);
+      if (!ostree_repo_resolve_rev (self->repo, origin_and_ref, FALSE, &resolved_ref, error))
+        {
+          g_prefix_error (error, "While trying to resolve ref %s: ", ref);
+          goto out;
+        }
+
+      checksum = resolved_ref;
+      g_debug ("tip resolved to: %s", checksum);
+    }
+  else
+    {
+      g_autoptr(GFile) root = NULL;
       g_autofree char *commit = NULL;
 
       g_debug ("Looking for checksum %s in local repo", checksum);
@@ -1526,34 +2566,10 @@ xdg_app_dir_deploy (XdgAppDir *self,
       goto out;
     }
 
-  if (!ostree_repo_read_commit (self->repo, checksum, &root, NULL, cancellable, error))
-    {
-      g_prefix_error (error, "Failed to read commit %s: ", checksum);
-      goto out;
-    }
-
-  file_info = g_file_query_info (root, OSTREE_GIO_FAST_QUERYINFO,
-                                 G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                 cancellable, error);
-  if (file_info == NULL)
+  if (!xdg_app_dir_checkout (self, checksum, deploy_base, checkoutdir,
+                             cancellable, error))
     goto out;
 
-  if (!ostree_repo_checkout_tree (self->repo,
-                                  self->user ? OSTREE_REPO_CHECKOUT_MODE_USER : OSTREE_REPO_CHECKOUT_MODE_NONE,
-                                  OSTREE_REPO_CHECKOUT_OVERWRITE_NONE,
-                                  checkoutdir,
-                                  OSTREE_REPO_FILE (root), file_info,
-                                  cancellable, error))
-    {
-      g_autofree char *rootpath = NULL;
-      g_autofree char *checkoutpath = NULL;
-
-      rootpath = g_file_get_path (root);
-      checkoutpath = g_file_get_path (checkoutdir);
-      g_prefix_error (error, "While trying to checkout %s into %s: ", rootpath, checkoutpath);
-      goto out;
-    }
-
   dotref = g_file_resolve_relative_path (checkoutdir, "files/.ref");
   if (!g_file_replace_contents (dotref, "", 0, NULL, FALSE,
                                 G_FILE_CREATE_NONE, NULL, cancellable, error))
@@ -1580,48 +2596,52 @@ xdg_app_dir_deploy (XdgAppDir *self,
   return ret;
 }
 
-gboolean
-xdg_app_dir_collect_deployed_refs (XdgAppDir *self,
-				   const char *type,
-				   const char *name_prefix,
-				   const char *branch,
-				   const char *arch,
-				   GHashTable *hash,
-				   GCancellable *cancellable,
-				   GError **error)
+/* Checkouts are disk bound, so more than a few at a time just
+   makes them fight over the disk */
+#define DEPLOY_DEFAULT_JOBS 4
+
+typedef struct {
+  XdgAppDir *dir;
+  const char *ref;
+  gboolean want_stats;
+  gboolean deployed;
+  XdgAppDeployStats stats;
+  GError *error;
+} DeployJob;
+
+static gboolean
+get_tree_size (GFile *dir,
+               guint64 *size,
+               GCancellable *cancellable,
+               GError **error)
 {
-  gboolean ret = FALSE;
-  g_autoptr(GFile) dir = NULL;
   g_autoptr(GFileEnumerator) dir_enum = NULL;
-  g_autoptr(GFileInfo) child_info = NULL;
+  GFileInfo *child_info;
   GError *temp_error = NULL;
 
-  dir = g_file_get_child (self->basedir, type);
-  if (!g_file_query_exists (dir, cancellable))
-    return TRUE;
-
-  dir_enum = g_file_enumerate_children (dir, OSTREE_GIO_FAST_QUERYINFO,
+  dir_enum = g_file_enumerate_children (dir,
+                                        G_FILE_ATTRIBUTE_STANDARD_NAME ","
+                                        G_FILE_ATTRIBUTE_STANDARD_TYPE ","
+                                        G_FILE_ATTRIBUTE_STANDARD_SIZE,
                                         G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                        cancellable,
-                                        error);
+                                        cancellable, error);
   if (!dir_enum)
-    goto out;
+    return FALSE;
 
-  while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)) != NULL)
+  while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)))
     {
-      const char *name = g_file_info_get_name (child_info);
-
-      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_DIRECTORY &&
-          name[0] != '.' && (name_prefix == NULL || g_str_has_prefix (name, name_prefix)))
-	{
-	  g_autoptr(GFile) child1 = g_file_get_child (dir, name);
-	  g_autoptr(GFile) child2 = g_file_get_child (child1, branch);
-	  g_autoptr(GFile) child3 = g_file_get_child (child2, arch);
-	  g_autoptr(GFile) active = g_file_get_child (child3, "active");
+      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_DIRECTORY)
+        {
+          g_autoptr(GFile) child = g_file_get_child (dir, g_file_info_get_name (child_info));
 
-	  if (g_file_query_exists (active, cancellable))
-	    g_hash_table_add (hash, g_strdup (name));
-	}
+          if (!get_tree_size (child, size, cancellable, error))
+            {
+              g_object_unref (child_info);
+              return FALSE;
+            }
+        }
+      else
+        *size += g_file_info_get_size (child_info);
 
       g_clear_object (&child_info);
     }
@@ -1629,12 +2649,174 @@ xdg_app_dir_collect_deployed_refs (XdgAppDir *self,
   if (temp_error != NULL)
     {
       g_propagate_error (error, temp_error);
-      goto out;
+      return FALSE;
     }
 
-  ret = TRUE;
- out:
-  return ret;
+  return TRUE;
+}
+
+static void
+deploy_job_run (gpointer data,
+                gpointer user_data)
+{
+  DeployJob *job = data;
+  GCancellable *cancellable = user_data;
+  GError *my_error = NULL;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+
+  if (!xdg_app_dir_deploy (job->dir, job->ref, NULL, cancellable, &my_error))
+    {
+      if (g_error_matches (my_error, XDG_APP_DIR_ERROR, XDG_APP_DIR_ERROR_ALREADY_DEPLOYED))
+        g_error_free (my_error);
+      else
+        job->error = my_error;
+      return;
+    }
+
+  job->deployed = TRUE;
+  job->stats.elapsed_usec = g_get_monotonic_time () - start;
+
+  if (job->want_stats)
+    {
+      g_autoptr(GFile) deploy_base = NULL;
+      g_autoptr(GFile) checkoutdir = NULL;
+      g_autofree char *active = NULL;
+
+      /* The stats are informational, so failing to get them is fine */
+      deploy_base = xdg_app_dir_get_deploy_dir (job->dir, job->ref);
+      active = xdg_app_dir_read_active (job->dir, job->ref, cancellable);
+      if (active != NULL)
+        {
+          checkoutdir = g_file_get_child (deploy_base, active);
+          get_tree_size (checkoutdir, &job->stats.bytes, cancellable, NULL);
+        }
+    }
+
+  g_debug ("Checked out %s in %.2fs", job->ref,
+           job->stats.elapsed_usec / (double) G_USEC_PER_SEC);
+}
+
+/* Deploys the tip of each ref, running up to max_jobs checkouts
+ * concurrently, or a default number if max_jobs is 0. deployed gets,
+ * for each ref, whether a new version was deployed; it is not an error
+ * if the tip was already deployed. If stats is not NULL it gets the
+ * time taken and the size of each new checkout. All refs are tried
+ * even if some fail, in which case the first error is returned. If
+ * errors is not NULL it gets the error of each ref, or NULL. */
+gboolean
+xdg_app_dir_deploy_refs (XdgAppDir *self,
+                         const char * const *refs,
+                         int max_jobs,
+                         gboolean *deployed,
+                         XdgAppDeployStats *stats,
+                         GError **errors,
+                         GCancellable *cancellable,
+                         GError **error)
+{
+  g_autofree DeployJob *jobs = NULL;
+  GThreadPool *pool;
+  GError *first_error = NULL;
+  int n_refs, i;
+
+  /* Open the repo before any of the workers need it */
+  if (!xdg_app_dir_ensure_repo (self, cancellable, error))
+    return FALSE;
+
+  if (max_jobs <= 0)
+    max_jobs = DEPLOY_DEFAULT_JOBS;
+
+  n_refs = g_strv_length ((char **)refs);
+  jobs = g_new0 (DeployJob, n_refs);
+
+  pool = g_thread_pool_new (deploy_job_run, cancellable,
+                            max_jobs, FALSE, NULL);
+
+  for (i = 0; i < n_refs; i++)
+    {
+      jobs[i].dir = self;
+      jobs[i].ref = refs[i];
+      jobs[i].want_stats = stats != NULL;
+      if (pool == NULL || !g_thread_pool_push (pool, &jobs[i], NULL))
+        deploy_job_run (&jobs[i], cancellable);
+    }
+
+  if (pool != NULL)
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+  for (i = 0; i < n_refs; i++)
+    {
+      deployed[i] = jobs[i].deployed;
+      if (stats)
+        stats[i] = jobs[i].stats;
+
+      if (errors)
+        errors[i] = NULL;
+
+      if (jobs[i].error == NULL)
+        continue;
+
+      g_prefix_error (&jobs[i].error, "While deploying %s: ", refs[i]);
+
+      if (first_error == NULL)
+        first_error = g_error_copy (jobs[i].error);
+
+      if (errors)
+        errors[i] = jobs[i].error;
+      else
+        g_error_free (jobs[i].error);
+    }
+
+  if (first_error != NULL)
+    {
+      g_propagate_error (error, first_error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+gboolean
+xdg_app_dir_collect_deployed_refs (XdgAppDir *self,
+				   const char *type,
+				   const char *name_prefix,
+				   const char *branch,
+				   const char *arch,
+				   GHashTable *hash,
+				   GCancellable *cancellable,
+				   GError **error)
+{
+  GvdbTable *index;
+  g_auto(GStrv) names = NULL;
+  int i;
+
+  index = get_refs_index (self, cancellable, error);
+  if (index == NULL)
+    return FALSE;
+
+  names = gvdb_table_get_names (index, NULL);
+
+  for (i = 0; names[i] != NULL; i++)
+    {
+      g_auto(GStrv) parts = g_strsplit (names[i], "/", 0);
+      g_autoptr(GVariant) active = NULL;
+
+      if (g_strv_length (parts) != 4 ||
+          strcmp (parts[0], type) != 0 ||
+          (name_prefix != NULL && !g_str_has_prefix (parts[1], name_prefix)) ||
+          strcmp (parts[2], arch) != 0 ||
+          strcmp (parts[3], branch) != 0)
+        continue;
+
+      active = gvdb_table_get_value (index, names[i]);
+      if (active != NULL && *g_variant_get_string (active, NULL) != 0)
+        g_hash_table_add (hash, g_strdup (parts[1]));
+    }
+
+  gvdb_table_free (index);
+
+  return TRUE;
 }
 
 gboolean
@@ -1873,6 +3055,149 @@ xdg_app_dir_cleanup_removed (XdgAppDir      *self,
 }
 
 
+/* How often prune_commits falls back to a full prune, in seconds */
+#define FULL_PRUNE_INTERVAL (7 * 24 * 60 * 60)
+
+static GFile *
+get_reachable_cache_file (XdgAppDir  *self,
+                          const char *commit)
+{
+  g_autoptr(GFile) cache_dir = g_file_get_child (self->basedir, ".reachable");
+  return g_file_get_child (cache_dir, commit);
+}
+
+/* Returns the names of all the objects reachable from commit, as an
+ * a(su) variant. Commits never change, so this is cached on disk the
+ * first time. */
+static GVariant *
+load_reachable (XdgAppDir    *self,
+                const char   *commit,
+                GCancellable *cancellable,
+                GError      **error)
+{
+  g_autoptr(GFile) cache_file = NULL;
+  g_autoptr(GFile) cache_dir = NULL;
+  g_autoptr(GHashTable) reachable = NULL;
+  g_autoptr(GVariant) variant = NULL;
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer key;
+  char *data;
+  gsize data_len;
+
+  cache_file = get_reachable_cache_file (self, commit);
+  if (g_file_load_contents (cache_file, cancellable, &data, &data_len, NULL, NULL))
+    return g_variant_ref_sink (g_variant_new_from_data (G_VARIANT_TYPE ("a(su)"),
+                                                        data, data_len,
+                                                        FALSE, g_free, data));
+
+  if (!ostree_repo_traverse_commit (self->repo, commit, 0, &reachable,
+                                    cancellable, error))
+    return NULL;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(su)"));
+  g_hash_table_iter_init (&iter, reachable);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_variant_builder_add_value (&builder, key);
+  variant = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  /* Failing to cache just means we traverse again next time */
+  cache_dir = g_file_get_parent (cache_file);
+  if (!gs_file_ensure_directory (cache_dir, TRUE, cancellable, NULL) ||
+      !g_file_replace_contents (cache_file,
+                                g_variant_get_data (variant),
+                                g_variant_get_size (variant),
+                                NULL, FALSE,
+                                G_FILE_CREATE_REPLACE_DESTINATION, NULL,
+                                cancellable, NULL))
+    g_debug ("Failed to cache reachable objects of %s", commit);
+
+  return g_steal_pointer (&variant);
+}
+
+static void
+add_object_names (GHashTable *objects,
+                  GVariant   *names)
+{
+  GVariantIter iter;
+  GVariant *object;
+
+  g_variant_iter_init (&iter, names);
+  while ((object = g_variant_iter_next_value (&iter)))
+    g_hash_table_replace (objects, object, object);
+}
+
+/* Gets the set of commits that some ref in the repo points to */
+static gboolean
+list_ref_tips (XdgAppDir     *self,
+               GHashTable   **out_tips,
+               GCancellable  *cancellable,
+               GError       **error)
+{
+  g_autoptr(GHashTable) refs = NULL;
+  g_autoptr(GHashTable) tips = NULL;
+  GHashTableIter iter;
+  gpointer value;
+
+  if (!ostree_repo_list_refs (self->repo, NULL, &refs, cancellable, error))
+    return FALSE;
+
+  tips = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_hash_table_iter_init (&iter, refs);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    g_hash_table_add (tips, g_strdup (value));
+
+  *out_tips = g_steal_pointer (&tips);
+  return TRUE;
+}
+
+/* Drops the cached reachable objects of commits no ref points to */
+static gboolean
+prune_reachable_cache (XdgAppDir     *self,
+                       GCancellable  *cancellable,
+                       GError       **error)
+{
+  g_autoptr(GHashTable) tips = NULL;
+  g_autoptr(GFile) cache_dir = NULL;
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+  GFileInfo *child_info;
+  GError *temp_error = NULL;
+
+  cache_dir = g_file_get_child (self->basedir, ".reachable");
+  if (!g_file_query_exists (cache_dir, cancellable))
+    return TRUE;
+
+  if (!list_ref_tips (self, &tips, cancellable, error))
+    return FALSE;
+
+  dir_enum = g_file_enumerate_children (cache_dir, G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                        cancellable, error);
+  if (!dir_enum)
+    return FALSE;
+
+  while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)))
+    {
+      const char *name = g_file_info_get_name (child_info);
+
+      if (!g_hash_table_contains (tips, name))
+        {
+          g_autoptr(GFile) child = g_file_get_child (cache_dir, name);
+          g_file_delete (child, cancellable, NULL);
+        }
+
+      g_clear_object (&child_info);
+    }
+
+  if (temp_error != NULL)
+    {
+      g_propagate_error (error, temp_error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 gboolean
 xdg_app_dir_prune (XdgAppDir      *self,
                    GCancellable   *cancellable,
@@ -1898,12 +3223,135 @@ xdg_app_dir_prune (XdgAppDir      *self,
   formatted_freed_size = g_format_size_full (pruned_object_size_total, 0);
   g_debug ("Pruned %d/%d objects, size %s", objects_total, objects_pruned, formatted_freed_size);
 
+  if (!prune_reachable_cache (self, cancellable, error))
+    goto out;
+
   ret = TRUE;
  out:
   return ret;
 
 }
 
+/* Prunes only the objects of the given commits that no ref in the
+ * repo still needs, which is much cheaper than a full prune since the
+ * objects reachable from each ref are cached. Every so often this does
+ * a full prune instead, to clean up anything that got missed, such as
+ * commits that were pulled but never deployed. */
+gboolean
+xdg_app_dir_prune_commits (XdgAppDir      *self,
+                           const char * const *commits,
+                           GCancellable   *cancellable,
+                           GError        **error)
+{
+  g_autoptr(GFile) stamp = NULL;
+  g_autoptr(GFileInfo) stamp_info = NULL;
+  g_autoptr(GHashTable) candidates = NULL;
+  g_autoptr(GHashTable) tips = NULL;
+  GHashTableIter iter;
+  gpointer key;
+  guint64 now;
+  int n_pruned = 0;
+  int i;
+
+  if (!xdg_app_dir_ensure_repo (self, cancellable, error))
+    return FALSE;
+
+  stamp = g_file_get_child (self->basedir, ".last-full-prune");
+  stamp_info = g_file_query_info (stamp, G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                  G_FILE_QUERY_INFO_NONE, cancellable, NULL);
+  now = g_get_real_time () / G_USEC_PER_SEC;
+  if (stamp_info == NULL ||
+      g_file_info_get_attribute_uint64 (stamp_info, G_FILE_ATTRIBUTE_TIME_MODIFIED) + FULL_PRUNE_INTERVAL < now)
+    {
+      g_debug ("Doing periodic full prune");
+      if (!xdg_app_dir_prune (self, cancellable, error))
+        return FALSE;
+
+      return g_file_replace_contents (stamp, "", 0, NULL, FALSE,
+                                      G_FILE_CREATE_REPLACE_DESTINATION, NULL,
+                                      cancellable, error);
+    }
+
+  candidates = ostree_repo_traverse_new_reachable ();
+  for (i = 0; commits[i] != NULL; i++)
+    {
+      g_autoptr(GVariant) reachable = NULL;
+      GError *temp_error = NULL;
+
+      reachable = load_reachable (self, commits[i], cancellable, &temp_error);
+      if (reachable == NULL)
+        {
+          /* Already gone, e.g. pruned by some other operation */
+          if (g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+            {
+              g_error_free (temp_error);
+              continue;
+            }
+          g_propagate_error (error, temp_error);
+          return FALSE;
+        }
+
+      add_object_names (candidates, reachable);
+    }
+
+  if (!list_ref_tips (self, &tips, cancellable, error))
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, tips);
+  while (g_hash_table_size (candidates) > 0 &&
+         g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      g_autoptr(GVariant) reachable = NULL;
+      GVariantIter objects;
+      GVariant *object;
+
+      reachable = load_reachable (self, key, cancellable, error);
+      if (reachable == NULL)
+        return FALSE;
+
+      g_variant_iter_init (&objects, reachable);
+      while ((object = g_variant_iter_next_value (&objects)))
+        {
+          g_hash_table_remove (candidates, object);
+          g_variant_unref (object);
+        }
+    }
+
+  g_hash_table_iter_init (&iter, candidates);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+      GError *temp_error = NULL;
+
+      ostree_object_name_deserialize (key, &checksum, &objtype);
+      if (!ostree_repo_delete_object (self->repo, objtype, checksum, cancellable, &temp_error))
+        {
+          if (!g_error_matches (temp_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+            {
+              g_propagate_error (error, temp_error);
+              return FALSE;
+            }
+          g_error_free (temp_error);
+        }
+      else
+        n_pruned++;
+    }
+
+  g_debug ("Pruned %d objects", n_pruned);
+
+  for (i = 0; commits[i] != NULL; i++)
+    {
+      if (!g_hash_table_contains (tips, commits[i]))
+        {
+          g_autoptr(GFile) cache_file = get_reachable_cache_file (self, commits[i]);
+          g_file_delete (cache_file, NULL, NULL);
+        }
+    }
+
+  return TRUE;
+}
+
 GFile *
 xdg_app_dir_get_if_deployed (XdgAppDir     *self,
                              const char    *ref,
@@ -52,6 +52,17 @@ typedef enum {
 
 GQuark       xdg_app_dir_error_quark      (void);
 
+typedef struct {
+  gint64  elapsed_usec;
+  guint64 bytes;
+} XdgAppDeployStats;
+
+typedef struct {
+  guint   fetched_objects;
+  guint64 bytes;
+  guint   fetched_delta_parts;
+} XdgAppPullStats;
+
 GFile *  xdg_app_get_system_base_dir_location (void);
 GFile *  xdg_app_get_user_base_dir_location   (void);
 
@@ -86,6 +97,9 @@ char *      xdg_app_dir_get_origin      (XdgAppDir      *self,
                                          GError        **error);
 GFile *     xdg_app_dir_get_exports_dir (XdgAppDir      *self);
 GFile *     xdg_app_dir_get_removed_dir (XdgAppDir      *self);
+GFile *     xdg_app_dir_get_changed_path (XdgAppDir     *self);
+gboolean    xdg_app_dir_mark_changed    (XdgAppDir      *self,
+                                         GError        **error);
 GFile *     xdg_app_dir_get_if_deployed (XdgAppDir      *self,
                                          const char     *ref,
                                          const char     *checksum,
@@ -105,6 +119,13 @@ gboolean    xdg_app_dir_ensure_repo     (XdgAppDir      *self,
 gboolean    xdg_app_dir_pull            (XdgAppDir      *self,
                                          const char     *repository,
                                          const char     *ref,
+                                         XdgAppPullStats *stats,
+                                         GCancellable   *cancellable,
+                                         GError        **error);
+gboolean    xdg_app_dir_pull_refs       (XdgAppDir      *self,
+                                         const char     *repository,
+                                         const char * const *refs,
+                                         XdgAppPullStats *stats,
                                          GCancellable   *cancellable,
                                          GError        **error);
 gboolean    xdg_app_dir_list_refs_for_name (XdgAppDir      *self,
@@ -147,6 +168,14 @@ gboolean    xdg_app_dir_deploy          (XdgAppDir      *self,
                                          const char     *checksum,
                                          GCancellable   *cancellable,
                                          GError        **error);
+gboolean    xdg_app_dir_deploy_refs     (XdgAppDir      *self,
+                                         const char * const *refs,
+                                         int             max_jobs,
+                                         gboolean       *deployed,
+                                         XdgAppDeployStats *stats,
+                                         GError        **errors,
+                                         GCancellable   *cancellable,
+                                         GError        **error);
 gboolean    xdg_app_dir_undeploy        (XdgAppDir      *self,
                                          const char     *ref,
                                          const char     *checksum,
@@ -157,9 +186,17 @@ gboolean    xdg_app_dir_update_exports  (XdgAppDir      *self,
                                          const char     *app,
                                          GCancellable   *cancellable,
                                          GError        **error);
+gboolean    xdg_app_dir_update_exports_for_apps (XdgAppDir  *self,
+                                                 const char * const *apps,
+                                                 GCancellable *cancellable,
+                                                 GError    **error);
 gboolean    xdg_app_dir_prune           (XdgAppDir      *self,
                                          GCancellable   *cancellable,
                                          GError        **error);
+gboolean    xdg_app_dir_prune_commits   (XdgAppDir      *self,
+                                         const char * const *commits,
+                                         GCancellable   *cancellable,
+                                         GError        **error);
 gboolean    xdg_app_dir_cleanup_removed (XdgAppDir      *self,
                                          GCancellable   *cancellable,
                                          GError        **error);
@@ -33,26 +33,36 @@
 #include <signal.h>
 #include <poll.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mount.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/signalfd.h>
 #include <sys/capability.h>
 #include <sys/prctl.h>
 #include <sys/utsname.h>
+#include <time.h>
 #include <unistd.h>
 #include <pwd.h>
 #include <grp.h>
 
 #ifdef ENABLE_SECCOMP
-#include <seccomp.h>
+#include "xdg-app-seccomp.h"
+#endif
+#ifdef HAVE_PREBUILT_SECCOMP
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include "xdg-app-seccomp-filters.h"
 #endif
 
 #if 0
@@ -143,11 +153,35 @@ xstrdup (const char *str)
   return res;
 }
 
+/* All the environment changes we make are recorded, so that the
+   zygote can apply them to the environment of later launches */
+typedef struct {
+  char *name;
+  char *value;
+  int overwrite;
+} EnvOverride;
+
+static EnvOverride *env_overrides = NULL;
+static int n_env_overrides = 0;
+
+static void
+record_env_override (const char *name, const char *value, int overwrite)
+{
+  int i = n_env_overrides;
+
+  n_env_overrides++;
+  env_overrides = xrealloc (env_overrides, n_env_overrides * sizeof (EnvOverride));
+  env_overrides[i].name = xstrdup (name);
+  env_overrides[i].value = value ? xstrdup (value) : NULL;
+  env_overrides[i].overwrite = overwrite;
+}
+
 static void
 xsetenv (const char *name, const char *value, int overwrite)
 {
   if (setenv (name, value, overwrite))
     die ("setenv failed");
+  record_env_override (name, value, overwrite);
 }
 
 static void
@@ -155,6 +189,21 @@ xunsetenv (const char *name)
 {
   if (unsetenv(name))
     die ("unsetenv failed");
+  record_env_override (name, NULL, 0);
+}
+
+static void
+apply_env_overrides (void)
+{
+  int i;
+
+  for (i = 0; i < n_env_overrides; i++)
+    {
+      if (env_overrides[i].value)
+        setenv (env_overrides[i].name, env_overrides[i].value, env_overrides[i].overwrite);
+      else
+        unsetenv (env_overrides[i].name);
+    }
 }
 
 static char *
@@ -231,6 +280,63 @@ get_relative_path (const char *path)
   return path;
 }
 
+/* Launch tracing, enabled with -t FD. Each phase of the setup is
+ * recorded with CLOCK_MONOTONIC timestamps (which are comparable
+ * with the ones of the calling process) and the report is written to
+ * the fd right before we exec the app. */
+typedef struct {
+  char *name;
+  uint64_t start;
+  uint64_t end;
+} TracePhase;
+
+static int trace_fd = -1;
+static TracePhase *trace_phases = NULL;
+static int n_trace_phases = 0;
+
+static uint64_t
+trace_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Returns a phase id to pass to trace_end(), or -1 if not tracing */
+static int
+trace_begin (const char *format, ...)
+{
+  va_list args;
+  char *name = NULL;
+  int i = n_trace_phases;
+
+  if (trace_fd == -1)
+    return -1;
+
+  va_start (args, format);
+  vasprintf (&name, format, args);
+  va_end (args);
+
+  if (name == NULL)
+    die_oom ();
+
+  n_trace_phases++;
+  trace_phases = xrealloc (trace_phases, n_trace_phases * sizeof (TracePhase));
+  trace_phases[i].name = name;
+  trace_phases[i].start = trace_now ();
+  trace_phases[i].end = 0;
+
+  return i;
+}
+
+static void
+trace_end (int phase)
+{
+  if (phase >= 0)
+    trace_phases[phase].end = trace_now ();
+}
+
 #ifndef HAVE_FDWALK
 static int
 fdwalk (int (*cb)(void *data, int fd), void *data)
@@ -294,165 +400,57 @@ static inline int raw_clone(unsigned long flags, void *child_stack) {
 #endif
 }
 
-static void
-setup_seccomp (bool devel)
+#ifdef HAVE_PREBUILT_SECCOMP
+/* Load one of the filters compiled at build time by
+   xdg-app-seccomp-gen, returns FALSE if the kernel refuses it */
+static bool
+load_prebuilt_seccomp (bool devel, bool filter_sockets)
 {
-#ifdef ENABLE_SECCOMP
-  scmp_filter_ctx seccomp;
-  /**** BEGIN NOTE ON CODE SHARING
-   *
-   * There are today a number of different Linux container
-   * implementations.  That will likely continue for long into the
-   * future.  But we can still try to share code, and it's important
-   * to do so because it affects what library and application writers
-   * can do, and we should support code portability between different
-   * container tools.
-   *
-   * This syscall blacklist is copied from xdg-app, which was in turn
-   * clearly influenced by the Sandstorm.io blacklist.
-   *
-   * If you make any changes here, I suggest sending the changes along
-   * to other sandbox maintainers.  Using the libseccomp list is also
-   * an appropriate venue:
-   * https://groups.google.com/forum/#!topic/libseccomp
-   *
-   * A non-exhaustive list of links to container tooling that might
-   * want to share this blacklist:
-   *
-   *  https://github.com/sandstorm-io/sandstorm
-   *    in src/sandstorm/supervisor.c++
-   *  http://cgit.freedesktop.org/xdg-app/xdg-app/
-   *    in lib/xdg-app-helper.c
-   *  https://git.gnome.org/browse/linux-user-chroot
-   *    in src/setup-seccomp.c
-   *
-   **** END NOTE ON CODE SHARING
-   */
-  struct {
-    int scall;
-    struct scmp_arg_cmp *arg;
-  } syscall_blacklist[] = {
-    /* Block dmesg */
-    {SCMP_SYS(syslog)},
-    /* Useless old syscall */
-    {SCMP_SYS(uselib)},
-    /* Don't allow you to switch to bsd emulation or whatnot */
-    {SCMP_SYS(personality)},
-    /* Don't allow disabling accounting */
-    {SCMP_SYS(acct)},
-    /* 16-bit code is unnecessary in the sandbox, and modify_ldt is a
-       historic source of interesting information leaks. */
-    {SCMP_SYS(modify_ldt)},
-    /* Don't allow reading current quota use */
-    {SCMP_SYS(quotactl)},
-
-    /* Scary VM/NUMA ops */
-    {SCMP_SYS(move_pages)},
-    {SCMP_SYS(mbind)},
-    {SCMP_SYS(get_mempolicy)},
-    {SCMP_SYS(set_mempolicy)},
-    {SCMP_SYS(migrate_pages)},
-
-    /* Don't allow subnamespace setups: */
-    {SCMP_SYS(unshare)},
-    {SCMP_SYS(mount)},
-    {SCMP_SYS(pivot_root)},
-    {SCMP_SYS(clone), &SCMP_A0(SCMP_CMP_MASKED_EQ, CLONE_NEWUSER, CLONE_NEWUSER)},
-  };
-
-  struct {
-    int scall;
-    struct scmp_arg_cmp *arg;
-  } syscall_nondevel_blacklist[] = {
-    /* Profiling operations; we expect these to be done by tools from outside
-     * the sandbox.  In particular perf has been the source of many CVEs.
-     */
-    {SCMP_SYS(perf_event_open)},
-    {SCMP_SYS(ptrace)}
-  };
-  /* Blacklist all but unix, inet, inet6 and netlink */
-  int socket_family_blacklist[] = {
-    AF_AX25,
-    AF_IPX,
-    AF_APPLETALK,
-    AF_NETROM,
-    AF_BRIDGE,
-    AF_ATMPVC,
-    AF_X25,
-    AF_ROSE,
-    AF_DECnet,
-    AF_NETBEUI,
-    AF_SECURITY,
-    AF_KEY,
-    AF_NETLINK + 1, /* Last gets CMP_GE, so order is important */
-  };
-  int i, r;
-  struct utsname uts;
+  struct sock_fprog prog;
 
-  seccomp = seccomp_init(SCMP_ACT_ALLOW);
-  if (!seccomp)
-    return die_oom ();
+  if (devel)
+    {
+      prog.filter = (struct sock_filter *)(filter_sockets ? seccomp_filter_devel_sockets : seccomp_filter_devel);
+      prog.len = filter_sockets ? N_ELEMENTS (seccomp_filter_devel_sockets) : N_ELEMENTS (seccomp_filter_devel);
+    }
+  else
+    {
+      prog.filter = (struct sock_filter *)(filter_sockets ? seccomp_filter_sockets : seccomp_filter);
+      prog.len = filter_sockets ? N_ELEMENTS (seccomp_filter_sockets) : N_ELEMENTS (seccomp_filter);
+    }
 
-  /* Add in all possible secondary archs we are aware of that
-   * this kernel might support. */
-#if defined(__i386__) || defined(__x86_64__)
-  r = seccomp_arch_add (seccomp, SCMP_ARCH_X86);
-  if (r < 0 && r != -EEXIST)
-    die_with_error ("Failed to add x86 architecture to seccomp filter");
+  /* seccomp_load() does this for us in the libseccomp case */
+  if (prctl (PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0)
+    return FALSE;
 
-  r = seccomp_arch_add (seccomp, SCMP_ARCH_X86_64);
-  if (r < 0 && r != -EEXIST)
-    die_with_error ("Failed to add x86_64 architecture to seccomp filter");
+  if (prctl (PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) != 0)
+    return FALSE;
 
-  r = seccomp_arch_add (seccomp, SCMP_ARCH_X32);
-  if (r < 0 && r != -EEXIST)
-    die_with_error ("Failed to add x32 architecture to seccomp filter");
+  return TRUE;
+}
 #endif
 
-  /* TODO: Should we filter the kernel keyring syscalls in some way?
-   * We do want them to be used by desktop apps, but they could also perhaps
-   * leak system stuff or secrets from other apps.
-   */
+static void
+setup_seccomp (bool devel)
+{
+#ifdef ENABLE_SECCOMP
+  scmp_filter_ctx seccomp;
+  char error[256];
+  bool filter_sockets;
+  struct utsname uts;
+  int r;
 
-  for (i = 0; i < N_ELEMENTS (syscall_blacklist); i++)
-    {
-      int scall = syscall_blacklist[i].scall;
-      if (syscall_blacklist[i].arg)
-        r = seccomp_rule_add (seccomp, SCMP_ACT_ERRNO(EPERM), scall, 1, *syscall_blacklist[i].arg);
-      else
-        r = seccomp_rule_add (seccomp, SCMP_ACT_ERRNO(EPERM), scall, 0);
-      if (r < 0 && r == -EFAULT /* unknown syscall */)
-        die_with_error ("Failed to block syscall %d", scall);
-    }
+  /* Socket filtering doesn't work on x86 */
+  filter_sockets = uname (&uts) == 0 && strcmp (uts.machine, "i686") != 0;
 
-  if (!devel)
-    {
-      for (i = 0; i < N_ELEMENTS (syscall_nondevel_blacklist); i++)
-        {
-          int scall = syscall_nondevel_blacklist[i].scall;
-          if (syscall_nondevel_blacklist[i].arg)
-            r = seccomp_rule_add (seccomp, SCMP_ACT_ERRNO(EPERM), scall, 1, *syscall_nondevel_blacklist[i].arg);
-          else
-            r = seccomp_rule_add (seccomp, SCMP_ACT_ERRNO(EPERM), scall, 0);
-          if (r < 0 && r == -EFAULT /* unknown syscall */)
-            die_with_error ("Failed to block syscall %d", scall);
-        }
-    }
+#ifdef HAVE_PREBUILT_SECCOMP
+  if (load_prebuilt_seccomp (devel, filter_sockets))
+    return;
+#endif
 
-  /* Socket filtering doesn't work on x86 */
-  if (uname (&uts) == 0 && strcmp (uts.machine, "i686") != 0)
-    {
-      for (i = 0; i < N_ELEMENTS (socket_family_blacklist); i++)
-	{
-	  int family = socket_family_blacklist[i];
-	  if (i == N_ELEMENTS (socket_family_blacklist) - 1)
-	    r = seccomp_rule_add (seccomp, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1, SCMP_A0(SCMP_CMP_GE, family));
-	  else
-	    r = seccomp_rule_add (seccomp, SCMP_ACT_ERRNO(EAFNOSUPPORT), SCMP_SYS(socket), 1, SCMP_A0(SCMP_CMP_EQ, family));
-	  if (r < 0)
-	    die_with_error ("Failed to block socket family %d", family);
-	}
-    }
+  seccomp = xdg_app_seccomp_filter_new (devel, filter_sockets, error, sizeof (error));
+  if (seccomp == NULL)
+    die_with_error ("%s", error);
 
   r = seccomp_load (seccomp);
   if (r < 0)
@@ -486,12 +484,14 @@ usage (char **argv)
            "	-m PATH		 Set path to xdg-app-session-helper output\n"
            "	-n		 Share network namespace with session\n"
            "	-p SOCKETPATH	 Use SOCKETPATH as pulseaudio connection\n"
+           "	-t FD		 Write a trace of the setup phases to FD\n"
            "	-s		 Share Shm namespace with session\n"
            "	-v PATH		 Mount PATH as /var\n"
            "	-w		 Make /app writable\n"
            "	-W		 Make /usr writable\n"
            "	-x SOCKETPATH	 Use SOCKETPATH as X display\n"
            "	-y SOCKETPATH	 Use SOCKETPATH as Wayland display\n"
+           "	-z SOCKETPATH	 Keep the sandbox around, accepting launches on SOCKETPATH\n"
            );
   exit (1);
 }
@@ -507,6 +507,94 @@ pivot_root (const char * new_root, const char * put_old)
 #endif
 }
 
+/* The new mount API (Linux 5.2, mount_setattr in 5.12). If the
+   headers are too old to have the syscall numbers, only use the
+   common ones on architectures known to use them unchanged (alpha,
+   ia64, mips and x32 add an offset). Elsewhere the old mount path is
+   used. */
+#if defined(__x86_64__) && !defined(__ILP32__)
+#define HAVE_COMMON_SYSCALL_NUMBERS 1
+#elif defined(__i386__) || defined(__aarch64__) || \
+      (defined(__arm__) && defined(__ARM_EABI__)) || \
+      defined(__powerpc__) || defined(__s390__) || defined(__riscv)
+#define HAVE_COMMON_SYSCALL_NUMBERS 1
+#endif
+
+#ifdef HAVE_COMMON_SYSCALL_NUMBERS
+#ifndef __NR_open_tree
+#define __NR_open_tree 428
+#endif
+#ifndef __NR_move_mount
+#define __NR_move_mount 429
+#endif
+#ifndef __NR_mount_setattr
+#define __NR_mount_setattr 442
+#endif
+#endif
+
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#define OPEN_TREE_CLOEXEC O_CLOEXEC
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY 0x00000001
+#define MOUNT_ATTR_NOSUID 0x00000002
+#define MOUNT_ATTR_NODEV  0x00000004
+#endif
+
+/* Same layout as the kernel struct mount_attr, which may or may
+   not be in the headers */
+struct xdg_app_mount_attr {
+  uint64_t attr_set;
+  uint64_t attr_clr;
+  uint64_t propagation;
+  uint64_t userns_fd;
+};
+
+static int
+sys_open_tree (int dirfd, const char *pathname, unsigned int flags)
+{
+#ifdef __NR_open_tree
+  return syscall(__NR_open_tree, dirfd, pathname, flags);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static int
+sys_move_mount (int from_dirfd, const char *from_pathname,
+                int to_dirfd, const char *to_pathname,
+                unsigned int flags)
+{
+#ifdef __NR_move_mount
+  return syscall(__NR_move_mount, from_dirfd, from_pathname, to_dirfd, to_pathname, flags);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static int
+sys_mount_setattr (int dirfd, const char *pathname, unsigned int flags,
+                   struct xdg_app_mount_attr *attr, size_t size)
+{
+#ifdef __NR_mount_setattr
+  return syscall(__NR_mount_setattr, dirfd, pathname, flags, attr, size);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
 typedef enum {
   FILE_TYPE_REGULAR,
   FILE_TYPE_DIR,
@@ -822,68 +910,133 @@ unescape_string (const char *escaped, size_t len)
   return res;
 }
 
-static char *
-get_mountinfo (const char *mountpoint)
+/* The flags that are per-mount, as opposed to per-superblock, and
+   which we need to preserve when remounting */
+#define MOUNT_FLAGS_MASK (MS_RDONLY | MS_NOSUID | MS_NODEV | MS_NOEXEC | \
+                          MS_NOATIME | MS_NODIRATIME | MS_RELATIME)
+
+/* We need the current flags of a mount whenever we remount it, which
+ * we do for every bind mount. Rather than re-parsing
+ * /proc/self/mountinfo each time we parse it once, the first time
+ * it is needed, and then update our copy as we mount things.
+ *
+ * Entries are never removed, a later mount on the same mountpoint
+ * just shadows the earlier one in the index.
+ */
+typedef struct {
+  char *mountpoint;
+  size_t len;
+  unsigned long flags;
+} MountTabEntry;
+
+static MountTabEntry *mount_tab = NULL;
+static int n_mount_tab = 0;
+static int mount_tab_size = 0;
+static bool mount_tab_loaded = FALSE;
+
+/* Open addressing hash of mountpoint -> index in mount_tab */
+static int *mount_tab_index = NULL;
+static unsigned int mount_tab_index_size = 0;
+
+static unsigned int
+str_hash (const char *str, size_t len)
 {
-  char *line_mountpoint, *line_mountpoint_end;
-  char *mountinfo;
-  char *free_me = NULL;
-  char *line, *line_start;
-  char *res = NULL;
-  int i;
+  unsigned int hash = 5381;
 
-  if (mountpoint[0] != '/')
-    {
-      char *cwd = getcwd(NULL, 0);
-      if (cwd == NULL)
-        die_oom ();
+  while (len-- > 0)
+    hash = hash * 33 + (unsigned char)*str++;
+
+  return hash;
+}
+
+static int
+mount_tab_find (const char *mountpoint, size_t len)
+{
+  unsigned int mask = mount_tab_index_size - 1;
+  unsigned int i;
+  int idx;
 
-      mountpoint = free_me = strconcat3 (cwd, "/", mountpoint);
-      free (cwd);
+  if (mount_tab_index_size == 0)
+    return -1;
+
+  i = str_hash (mountpoint, len) & mask;
+  while ((idx = mount_tab_index[i]) != -1)
+    {
+      if (mount_tab[idx].len == len &&
+          memcmp (mount_tab[idx].mountpoint, mountpoint, len) == 0)
+        return idx;
+      i = (i + 1) & mask;
     }
 
-  mountinfo = load_file ("/proc/self/mountinfo");
-  if (mountinfo == NULL)
-    return NULL;
+  return -1;
+}
 
-  line = mountinfo;
+static void
+mount_tab_index_entry (int idx)
+{
+  unsigned int mask = mount_tab_index_size - 1;
+  unsigned int i;
+  int other;
 
-  while (*line != 0)
+  i = str_hash (mount_tab[idx].mountpoint, mount_tab[idx].len) & mask;
+  while ((other = mount_tab_index[i]) != -1)
     {
-      char *unescaped;
+      if (mount_tab[other].len == mount_tab[idx].len &&
+          memcmp (mount_tab[other].mountpoint, mount_tab[idx].mountpoint, mount_tab[idx].len) == 0)
+        break;
+      i = (i + 1) & mask;
+    }
 
-      line_start = line;
-      for (i = 0; i < 4; i++)
-        line = skip_token (line, TRUE);
-      line_mountpoint = line;
-      line = skip_token (line, FALSE);
-      line_mountpoint_end = line;
-      line = skip_line (line);
+  mount_tab_index[i] = idx;
+}
 
-      unescaped = unescape_string (line_mountpoint, line_mountpoint_end - line_mountpoint);
-      if (strcmp (mountpoint, unescaped) == 0)
-        {
-	  free (unescaped);
-          res = line_start;
-          line[-1] = 0;
-          break;
-        }
-      free (unescaped);
+static void
+mount_tab_reindex (void)
+{
+  unsigned int i;
+  int idx;
+
+  while (mount_tab_index_size < 64 || mount_tab_index_size < 2 * n_mount_tab)
+    mount_tab_index_size = mount_tab_index_size ? mount_tab_index_size * 2 : 64;
+
+  mount_tab_index = xrealloc (mount_tab_index, mount_tab_index_size * sizeof (int));
+  for (i = 0; i < mount_tab_index_size; i++)
+    mount_tab_index[i] = -1;
+
+  /* In order, so that later mounts shadow earlier ones */
+  for (idx = 0; idx < n_mount_tab; idx++)
+    mount_tab_index_entry (idx);
+}
+
+/* Takes ownership of mountpoint, which must be absolute and canonical */
+static int
+mount_tab_add (char *mountpoint, unsigned long flags)
+{
+  int idx = n_mount_tab;
+
+  if (n_mount_tab == mount_tab_size)
+    {
+      mount_tab_size = mount_tab_size ? mount_tab_size * 2 : 64;
+      mount_tab = xrealloc (mount_tab, mount_tab_size * sizeof (MountTabEntry));
     }
 
-  if (free_me)
-    free (free_me);
-  free (mountinfo);
+  n_mount_tab++;
+  mount_tab[idx].mountpoint = mountpoint;
+  mount_tab[idx].len = strlen (mountpoint);
+  mount_tab[idx].flags = flags & MOUNT_FLAGS_MASK;
+
+  if (2 * n_mount_tab > mount_tab_index_size)
+    mount_tab_reindex ();
+  else
+    mount_tab_index_entry (idx);
 
-  if (res)
-    return xstrdup (res);
-  return NULL;
+  return idx;
 }
 
 static unsigned long
-get_mountflags (const char *mountpoint)
+decode_mountflags (char *options)
 {
-  char *line, *token, *end_token;
+  char *token, *end_token;
   int i;
   unsigned long flags = 0;
   static const struct  { int flag; char *name; } flags_data[] = {
@@ -898,17 +1051,7 @@ get_mountflags (const char *mountpoint)
     { 0, NULL }
   };
 
-  line = get_mountinfo (mountpoint);
-  if (line == NULL)
-    return 0;
-
-  token = line;
-  for (i = 0; i < 5; i++)
-    token = skip_token (token, TRUE);
-
-  end_token = skip_token (token, FALSE);
-  *end_token = 0;
-
+  token = options;
   do {
     end_token = strchr (token, ',');
     if (end_token != NULL)
@@ -926,79 +1069,328 @@ get_mountflags (const char *mountpoint)
       token = NULL;
   } while (token != NULL);
 
-  free (line);
-
   return flags;
 }
 
-
-static char **
-get_submounts (const char *parent_mount)
+static void
+mount_tab_load (void)
 {
-  char *mountpoint, *mountpoint_end;
-  char **submounts;
-  int i, n_submounts, submounts_size;
   char *mountinfo;
   char *line;
+  int i;
+
+  for (i = 0; i < n_mount_tab; i++)
+    free (mount_tab[i].mountpoint);
+  n_mount_tab = 0;
+
+  mount_tab_loaded = TRUE;
 
   mountinfo = load_file ("/proc/self/mountinfo");
   if (mountinfo == NULL)
-    return NULL;
-
-  submounts_size = 8;
-  n_submounts = 0;
-  submounts = xmalloc (sizeof (char *) * submounts_size);
+    {
+      mount_tab_reindex ();
+      return;
+    }
 
   line = mountinfo;
 
   while (*line != 0)
     {
-      char *unescaped;
+      char *mountpoint, *mountpoint_end;
+      char *options, *options_end;
+
       for (i = 0; i < 4; i++)
         line = skip_token (line, TRUE);
       mountpoint = line;
-      line = skip_token (line, FALSE);
-      mountpoint_end = line;
-      line = skip_line (line);
-      *mountpoint_end = 0;
+      mountpoint_end = skip_token (mountpoint, FALSE);
+      options = skip_token (mountpoint, TRUE);
+      options_end = skip_token (options, FALSE);
+      line = skip_line (options_end);
+      *options_end = 0;
+
+      /* Not using mount_tab_add, as we index everything at the end */
+      if (n_mount_tab == mount_tab_size)
+        {
+          mount_tab_size = mount_tab_size ? mount_tab_size * 2 : 64;
+          mount_tab = xrealloc (mount_tab, mount_tab_size * sizeof (MountTabEntry));
+        }
+      mount_tab[n_mount_tab].mountpoint = unescape_string (mountpoint, mountpoint_end - mountpoint);
+      mount_tab[n_mount_tab].len = strlen (mount_tab[n_mount_tab].mountpoint);
+      mount_tab[n_mount_tab].flags = decode_mountflags (options);
+      n_mount_tab++;
+    }
+
+  free (mountinfo);
+
+  mount_tab_reindex ();
+}
+
+static void
+mount_tab_ensure_loaded (void)
+{
+  if (!mount_tab_loaded)
+    mount_tab_load ();
+}
+
+/* Returns a newly allocated absolute path, resolving symlinks if
+   the path exists, like the kernel does for mountpoints */
+static char *
+resolve_mount_path (const char *path)
+{
+  char *resolved;
+  char *cwd;
+
+  resolved = realpath (path, NULL);
+  if (resolved != NULL)
+    return resolved;
+
+  if (path[0] == '/')
+    return xstrdup (path);
 
-      unescaped = unescape_string (mountpoint, -1);
+  cwd = getcwd (NULL, 0);
+  if (cwd == NULL)
+    die_oom ();
+
+  resolved = strconcat3 (cwd, "/", path);
+  free (cwd);
+
+  return resolved;
+}
 
-      if (*unescaped == '/' &&
-          str_has_prefix (unescaped + 1, parent_mount) &&
-          *(unescaped + 1 + strlen (parent_mount)) == '/')
+/* Finds the mount that path (absolute and canonical) is on */
+static int
+mount_tab_find_containing (const char *path)
+{
+  size_t len = strlen (path);
+  int idx;
+
+  while (TRUE)
+    {
+      idx = mount_tab_find (path, len);
+      if (idx >= 0 || len <= 1)
+        return idx;
+
+      while (len > 1 && path[len - 1] != '/')
+        len--;
+      if (len > 1)
+        len--;
+    }
+}
+
+/* Looks up the current flags of mountpoint. A mount we don't know
+   about may have been made behind our back, so reload the table
+   before giving up, rather than guessing flags that could clear
+   MS_NOEXEC, MS_NODEV or MS_RDONLY. */
+static int
+get_mountflags (const char *mountpoint, unsigned long *flags)
+{
+  int idx;
+
+  mount_tab_ensure_loaded ();
+
+  idx = mount_tab_find (mountpoint, strlen (mountpoint));
+  if (idx < 0)
+    {
+      mount_tab_load ();
+      idx = mount_tab_find (mountpoint, strlen (mountpoint));
+      if (idx < 0)
         {
-          if (n_submounts + 1 >= submounts_size)
-            {
-              submounts_size *= 2;
-              submounts = xrealloc (submounts, sizeof (char *) * submounts_size);
-            }
-          submounts[n_submounts++] = xstrdup (unescaped + 1);
+          errno = ENOENT;
+          return -1;
         }
-      free (unescaped);
     }
 
-  submounts[n_submounts] = NULL;
+  *flags = mount_tab[idx].flags;
+  return 0;
+}
 
-  free (mountinfo);
+/* A new mount defaults to relatime unless told otherwise */
+static unsigned long
+new_mount_flags (unsigned long flags)
+{
+  if ((flags & (MS_NOATIME | MS_STRICTATIME)) == 0)
+    flags |= MS_RELATIME;
+
+  return flags;
+}
+
+/* Record a new (non-bind) mount made on mountpoint */
+static void
+mount_tab_add_mount (const char *mountpoint, unsigned long flags)
+{
+  /* If we didn't load the table yet it will be picked up when we do */
+  if (!mount_tab_loaded)
+    return;
 
-  return submounts;
+  mount_tab_add (resolve_mount_path (mountpoint), new_mount_flags (flags));
 }
 
+/* Record a bind mount of src on dest, returns the index of the first
+   new entry, which is the one for dest itself */
 static int
-bind_mount (const char *src, const char *dest, bind_option_t options)
+mount_tab_add_bind (const char *src, const char *dest, bool recursive)
+{
+  char *resolved_src;
+  size_t src_len;
+  int first, last, idx, i;
+  unsigned long flags = 0;
+
+  resolved_src = resolve_mount_path (src);
+  idx = mount_tab_find_containing (resolved_src);
+  if (idx >= 0)
+    flags = mount_tab[idx].flags;
+
+  first = mount_tab_add (resolve_mount_path (dest), flags);
+
+  if (recursive)
+    {
+      /* The submounts of src get copied too. Match against "" for "/" */
+      src_len = strcmp (resolved_src, "/") == 0 ? 0 : strlen (resolved_src);
+      last = first;
+      for (i = 0; i < last; i++)
+        {
+          if (mount_tab[i].len > src_len + 1 &&
+              mount_tab[i].mountpoint[src_len] == '/' &&
+              strncmp (mount_tab[i].mountpoint, resolved_src, src_len) == 0)
+            mount_tab_add (strconcat (mount_tab[first].mountpoint, mount_tab[i].mountpoint + src_len),
+                           mount_tab[i].flags);
+        }
+    }
+
+  free (resolved_src);
+
+  return first;
+}
+
+/* Remount a mountpoint (absolute and canonical) with its current
+ * flags plus extra_flags.
+ *
+ * Our mount table doesn't see mounts propagated in from the parent
+ * namespace, so if the kernel refuses the remount because we're
+ * trying to clear a locked flag we reload it and try again.
+ */
+static int
+remount_with_flags (const char *mountpoint, unsigned long remount_flags, unsigned long extra_flags)
+{
+  unsigned long flags;
+  int idx;
+
+  if (get_mountflags (mountpoint, &flags) != 0)
+    return -1;
+  flags |= extra_flags;
+
+  if (mount ("none", mountpoint,
+             NULL, MS_MGC_VAL|MS_REMOUNT|remount_flags|flags, NULL) != 0)
+    {
+      if (errno != EPERM)
+        return -1;
+
+      mount_tab_load ();
+
+      if (get_mountflags (mountpoint, &flags) != 0)
+        return -1;
+      flags |= extra_flags;
+      if (mount ("none", mountpoint,
+                 NULL, MS_MGC_VAL|MS_REMOUNT|remount_flags|flags, NULL) != 0)
+        return -1;
+    }
+
+  idx = mount_tab_find (mountpoint, strlen (mountpoint));
+  if (idx >= 0)
+    mount_tab[idx].flags = flags & MOUNT_FLAGS_MASK;
+
+  return 0;
+}
+
+/* Set to FALSE the first time we find that the kernel doesn't
+   support the new mount API */
+static bool have_new_mount_api = TRUE;
+
+/* Bind mount using the new mount API. This clones the tree, applies
+ * the flags to all of it in one go and then attaches it, so unlike
+ * the MS_REMOUNT way it doesn't need to know the current flags of
+ * each mount. Returns -1 without having mounted anything on
+ * failure, so the caller can fall back to the old way.
+ */
+static int
+bind_mount_new_api (const char *src, const char *dest,
+                    bool readonly, bool private, bool devices, bool recursive)
+{
+  struct xdg_app_mount_attr attr = { 0 };
+  int first, i;
+  int tree_fd;
+  int errsv;
+
+  if (!have_new_mount_api)
+    return -1;
+
+  tree_fd = sys_open_tree (AT_FDCWD, src, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | (recursive ? AT_RECURSIVE : 0));
+  if (tree_fd < 0)
+    {
+      /* EPERM rather than ENOSYS is what container seccomp
+         profiles typically return for unknown syscalls */
+      if (errno == ENOSYS || errno == EPERM)
+        have_new_mount_api = FALSE;
+      return -1;
+    }
+
+  attr.attr_set = MOUNT_ATTR_NOSUID | (devices ? 0 : MOUNT_ATTR_NODEV) | (readonly ? MOUNT_ATTR_RDONLY : 0);
+  if (private)
+    attr.propagation = MS_PRIVATE;
+
+  if (sys_mount_setattr (tree_fd, "", AT_EMPTY_PATH | (recursive ? AT_RECURSIVE : 0),
+                         &attr, sizeof (attr)) != 0)
+    {
+      errsv = errno;
+      if (errsv == ENOSYS)
+        have_new_mount_api = FALSE;
+      close (tree_fd);
+      errno = errsv;
+      return -1;
+    }
+
+  if (sys_move_mount (tree_fd, "", AT_FDCWD, dest, MOVE_MOUNT_F_EMPTY_PATH) != 0)
+    {
+      errsv = errno;
+      close (tree_fd);
+      errno = errsv;
+      return -1;
+    }
+
+  close (tree_fd);
+
+  first = mount_tab_add_bind (src, dest, recursive);
+  for (i = first; i < n_mount_tab; i++)
+    mount_tab[i].flags |= (devices?0:MS_NODEV)|MS_NOSUID|(readonly?MS_RDONLY:0);
+
+  return 0;
+}
+
+static int
+do_bind_mount (const char *src, const char *dest, bind_option_t options)
 {
   bool readonly = (options & BIND_READONLY) != 0;
   bool private = (options & BIND_PRIVATE) != 0;
   bool devices = (options & BIND_DEVICES) != 0;
   bool recursive = (options & BIND_RECURSIVE) != 0;
-  unsigned long current_flags;
+  unsigned long extra_flags = (devices?0:MS_NODEV)|MS_NOSUID|(readonly?MS_RDONLY:0);
   char **submounts;
-  int i;
+  int first, i, n_submounts;
+  int res = 0;
+  int errsv;
+
+  /* Make sure the table is loaded before we mount, so that we know
+     what to add */
+  mount_tab_ensure_loaded ();
+
+  if (bind_mount_new_api (src, dest, readonly, private, devices, recursive) == 0)
+    return 0;
 
   if (mount (src, dest, NULL, MS_MGC_VAL|MS_BIND|(recursive?MS_REC:0), NULL) != 0)
     return 1;
 
+  first = mount_tab_add_bind (src, dest, recursive);
+
   if (private)
     {
       if (mount ("none", dest,
@@ -1006,35 +1398,61 @@ bind_mount (const char *src, const char *dest, bind_option_t options)
         return 2;
     }
 
-  current_flags = get_mountflags (dest);
+  /* Copy the paths, as remount_with_flags may reload the table */
+  n_submounts = n_mount_tab - first;
+  submounts = xmalloc (sizeof (char *) * n_submounts);
+  for (i = 0; i < n_submounts; i++)
+    submounts[i] = xstrdup (mount_tab[first + i].mountpoint);
 
-  if (mount ("none", dest,
-             NULL, MS_MGC_VAL|MS_BIND|MS_REMOUNT|current_flags|(devices?0:MS_NODEV)|MS_NOSUID|(readonly?MS_RDONLY:0), NULL) != 0)
-    return 3;
+  if (remount_with_flags (submounts[0], MS_BIND, extra_flags) != 0)
+    {
+      res = 3;
+      goto out;
+    }
 
   /* We need to work around the fact that a bind mount does not apply the flags, so we need to manually
    * apply the flags to all submounts in the recursive case.
    * Note: This does not apply the flags to mounts which are later propagated into this namespace.
    */
-  if (recursive)
+  for (i = 1; i < n_submounts; i++)
     {
-      submounts = get_submounts (dest);
-      if (submounts == NULL)
-        return 4;
-
-      for (i = 0; submounts[i] != NULL; i++)
+      if (remount_with_flags (submounts[i], MS_BIND, extra_flags) != 0)
         {
-          current_flags = get_mountflags (submounts[i]);
-          if (mount ("none", submounts[i],
-                     NULL, MS_MGC_VAL|MS_BIND|MS_REMOUNT|current_flags|(devices?0:MS_NODEV)|MS_NOSUID|(readonly?MS_RDONLY:0), NULL) != 0)
-            return 5;
-          free (submounts[i]);
+          /* If we can't read the mountpoint we can't remount it, but that
+             should be safe to ignore because it's not something the app
+             can access either. */
+          if (errno != EACCES)
+            {
+              res = 5;
+              goto out;
+            }
         }
-
-      free (submounts);
     }
 
-  return 0;
+ out:
+  errsv = errno;
+  for (i = 0; i < n_submounts; i++)
+    free (submounts[i]);
+  free (submounts);
+  errno = errsv;
+
+  return res;
+}
+
+static int
+bind_mount (const char *src, const char *dest, bind_option_t options)
+{
+  int phase;
+  int res;
+  int errsv;
+
+  phase = trace_begin ("bind-mount %s", dest);
+  res = do_bind_mount (src, dest, options);
+  errsv = errno;
+  trace_end (phase);
+  errno = errsv;
+
+  return res;
 }
 
 static bool
@@ -1132,9 +1550,34 @@ write_to_file (int fd, const char *content, ssize_t len)
 }
 
 #define BUFSIZE	8192
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+static ssize_t
+sys_copy_file_range (int fd_in, int fd_out, size_t len)
+{
+#ifdef __NR_copy_file_range
+  return syscall(__NR_copy_file_range, fd_in, NULL, fd_out, NULL, len, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/* Errors that mean this way of copying isn't supported for these
+   files, rather than that the copy failed */
 static bool
-copy_file_data (int     sfd,
-                int     dfd)
+copy_not_supported (int err)
+{
+  return err == ENOSYS || err == EXDEV || err == EINVAL ||
+    err == EOPNOTSUPP || err == ENOTTY;
+}
+
+static bool
+copy_file_data_loop (int     sfd,
+                     int     dfd)
 {
   char buffer[BUFSIZE];
   ssize_t bytes_read;
@@ -1153,11 +1596,79 @@ copy_file_data (int     sfd,
       if (bytes_read == 0)
         break;
 
-      if (!write_to_file (dfd, buffer, bytes_read))
+      if (!write_to_file (dfd, buffer, bytes_read))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Copies all of sfd into dfd, which must both be at offset 0 with
+ * dfd empty. Prefers sharing the extents (reflink) if both are on
+ * the same filesystem, then copying in the kernel, and only bounces
+ * the data through userspace if neither works. */
+static bool
+copy_file_data (int     sfd,
+                int     dfd)
+{
+  static bool have_copy_file_range = TRUE;
+  bool copied_any;
+  ssize_t res;
+
+  if (ioctl (dfd, FICLONE, sfd) == 0)
+    return TRUE;
+
+  if (have_copy_file_range)
+    {
+      copied_any = FALSE;
+      while ((res = sys_copy_file_range (sfd, dfd, 1 << 30)) != 0)
+        {
+          if (res > 0)
+            {
+              copied_any = TRUE;
+              continue;
+            }
+
+          if (errno == EINTR)
+            continue;
+
+          if (copied_any || !copy_not_supported (errno))
+            return FALSE;
+
+          if (errno == ENOSYS)
+            have_copy_file_range = FALSE;
+          break;
+        }
+
+      /* copy_file_range and sendfile may copy nothing at all rather
+         than fail, for instance for procfs and sysfs files, which also
+         claim to be empty. So an immediate EOF is only trusted from
+         read() */
+      if (res == 0 && copied_any)
+        return TRUE;
+    }
+
+  copied_any = FALSE;
+  while ((res = sendfile (dfd, sfd, NULL, 1 << 30)) != 0)
+    {
+      if (res > 0)
+        {
+          copied_any = TRUE;
+          continue;
+        }
+
+      if (errno == EINTR)
+        continue;
+
+      if (copied_any || !copy_not_supported (errno))
         return FALSE;
+      break;
     }
 
-  return TRUE;
+  if (res == 0 && copied_any)
+    return TRUE;
+
+  return copy_file_data_loop (sfd, dfd);
 }
 
 static bool
@@ -1210,6 +1721,32 @@ write_file (const char *path, const char *content)
   return res;
 }
 
+/* The report has a header line, and then one line per phase with
+   the start and end times in microseconds followed by the name */
+static void
+trace_write (void)
+{
+  char *line;
+  int i;
+
+  if (trace_fd == -1)
+    return;
+
+  write_to_file (trace_fd, "xdg-app-helper-trace 1\n", strlen ("xdg-app-helper-trace 1\n"));
+  for (i = 0; i < n_trace_phases; i++)
+    {
+      line = strdup_printf ("%llu %llu %s\n",
+                            (unsigned long long)trace_phases[i].start,
+                            (unsigned long long)(trace_phases[i].end ? trace_phases[i].end : trace_phases[i].start),
+                            trace_phases[i].name);
+      write_to_file (trace_fd, line, strlen (line));
+      free (line);
+    }
+
+  close (trace_fd);
+  trace_fd = -1;
+}
+
 static bool
 create_file (const char *path, mode_t mode, const char *content)
 {
@@ -1249,7 +1786,6 @@ create_files (const create_table_t *create, int n_create, int ignore_shm, const
       mode_t mode = create[i].mode;
       file_flags_t flags = create[i].flags;
       int *option = create[i].option;
-      unsigned long current_mount_flags;
       char *in_root;
       int k;
       bool found;
@@ -1402,6 +1938,7 @@ create_files (const create_table_t *create, int n_create, int ignore_shm, const
                             mount_table[k].flags,
                             mount_table[k].options) < 0)
                     die_with_error ("Mounting %s", name);
+                  mount_tab_add_mount (mount_table[k].where, mount_table[k].flags);
                   found = TRUE;
                 }
             }
@@ -1412,10 +1949,14 @@ create_files (const create_table_t *create, int n_create, int ignore_shm, const
           break;
 
         case FILE_TYPE_REMOUNT:
-          current_mount_flags = get_mountflags (name);
-          if (mount ("none", name,
-                     NULL, MS_MGC_VAL|MS_REMOUNT|current_mount_flags|mode, NULL) != 0)
-            die_with_error ("Unable to remount %s\n", name);
+          {
+            char *mountpoint = resolve_mount_path (name);
+
+            if (remount_with_flags (mountpoint, 0, mode) != 0)
+              die_with_error ("Unable to remount %s\n", name);
+
+            free (mountpoint);
+          }
 
           break;
 
@@ -1816,6 +2357,41 @@ close_extra_fds (void *data, int fd)
   return 0;
 }
 
+/* Final setup in the app process, right before exec */
+static void
+setup_app_process (bool devel)
+{
+  int phase;
+
+#ifndef DISABLE_USERNS
+  phase = trace_begin ("userns");
+  {
+    char *uid_map, *gid_map;
+    /* Now that devpts is mounted we can create a new userspace and map
+       our uid 1:1 */
+
+    if (unshare (CLONE_NEWUSER))
+      die_with_error ("unshare user ns");
+
+    uid_map = strdup_printf ("%d 0 1\n", uid);
+    if (!write_file ("/proc/self/uid_map", uid_map))
+      die_with_error ("setting up uid map");
+    free (uid_map);
+
+    gid_map = strdup_printf ("%d 0 1\n", gid);
+    if (!write_file ("/proc/self/gid_map", gid_map))
+      die_with_error ("setting up gid map");
+    free (gid_map);
+  }
+  trace_end (phase);
+#endif
+
+  __debug__(("setting up seccomp in child\n"));
+  phase = trace_begin ("seccomp");
+  setup_seccomp (devel);
+  trace_end (phase);
+}
+
 /* This stays around for as long as the initial process in the app does
  * and when that exits it exits, propagating the exit status. We do this
  * by having pid1 in the sandbox detect this exit and tell the monitor
@@ -1920,6 +2496,470 @@ do_init (int event_fd, pid_t initial_pid)
   return initial_exit_status;
 }
 
+/* Zygote mode, enabled with -z SOCKETPATH.
+ *
+ * Instead of exiting when the sandbox is empty, pid1 keeps the fully
+ * set up namespace around and listens on SOCKETPATH for requests to
+ * start more processes in it, so that later launches of the same app
+ * skip the sandbox setup entirely.
+ *
+ * The protocol is:
+ *  client -> zygote: a native uint32 length with stdin, stdout and
+ *     stderr attached as SCM_RIGHTS, followed by that many bytes of
+ *     nul terminated strings: the cwd, the argv, an empty string and
+ *     then the environment.
+ *  client -> zygote: any number of ints, signals to forward to the
+ *     process.
+ *  zygote -> client: an int with the wait status of the process once
+ *     it exits.
+ *
+ * Only connections from our own uid are accepted. Requests are read
+ * from the main loop as they arrive, so a client that is slow to send
+ * one doesn't hold up the other sandboxes, and it is dropped if it
+ * hasn't sent all of it within ZYGOTE_REQUEST_TIMEOUT_MSECS.
+ */
+
+/* Exit the zygote after being empty for this long */
+#ifndef ZYGOTE_IDLE_TIMEOUT_SECS
+#define ZYGOTE_IDLE_TIMEOUT_SECS 300
+#endif
+#define ZYGOTE_MAX_REQUEST_SIZE (1024 * 1024)
+#define ZYGOTE_REQUEST_TIMEOUT_MSECS 5000
+
+typedef struct {
+  int fd;
+  pid_t pid; /* -1 until the whole request has been read */
+
+  /* The request being read */
+  uint64_t deadline;
+  uint32_t len;
+  char *data;
+  uint32_t n_read;
+  int stdio_fds[3];
+} ZygoteClient;
+
+static void
+zygote_client_clear_request (ZygoteClient *client)
+{
+  int i;
+
+  for (i = 0; i < 3; i++)
+    {
+      if (client->stdio_fds[i] != -1)
+        close (client->stdio_fds[i]);
+      client->stdio_fds[i] = -1;
+    }
+  free (client->data);
+  client->data = NULL;
+}
+
+static int
+zygote_listen (const char *path)
+{
+  struct sockaddr_un addr;
+  mode_t old_umask;
+  int fd;
+  int res;
+
+  if (strlen (path) >= sizeof (addr.sun_path))
+    return -1;
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+
+  old_umask = umask (0077);
+  res = bind (fd, (struct sockaddr *)&addr, sizeof (addr));
+  if (res != 0 && errno == EADDRINUSE)
+    {
+      int other_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+      /* Left over from a zygote that exited? Otherwise someone else
+         just started one, and we run without */
+      if (other_fd != -1 &&
+          connect (other_fd, (struct sockaddr *)&addr, sizeof (addr)) != 0 &&
+          errno == ECONNREFUSED)
+        {
+          unlink (path);
+          res = bind (fd, (struct sockaddr *)&addr, sizeof (addr));
+        }
+
+      if (other_fd != -1)
+        close (other_fd);
+    }
+  umask (old_umask);
+
+  if (res != 0 || listen (fd, 16) != 0)
+    {
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+/* Forks the process for a fully read request, returns its pid or -1 */
+static pid_t
+zygote_spawn (ZygoteClient *client)
+{
+  char *data = client->data;
+  uint32_t len = client->len;
+  char **strs = NULL;
+  char **child_argv, **child_env;
+  const char *cwd;
+  int n_strs, i;
+  pid_t pid = -1;
+
+  if (data[len - 1] != 0)
+    goto out;
+
+  n_strs = 0;
+  for (i = 0; i < len; i++)
+    if (data[i] == 0)
+      n_strs++;
+
+  strs = xmalloc ((n_strs + 2) * sizeof (char *));
+  strs[0] = data;
+  for (i = 0, n_strs = 1; i < len - 1; i++)
+    if (data[i] == 0)
+      strs[n_strs++] = data + i + 1;
+  strs[n_strs] = NULL;
+
+  /* cwd, then argv up to the first empty string, then env */
+  cwd = strs[0];
+  child_argv = &strs[1];
+  for (i = 1; strs[i] != NULL && *strs[i] != 0; i++)
+    ;
+  if (strs[i] == NULL || i == 1)
+    goto out;
+  strs[i] = NULL;
+  child_env = &strs[i + 1];
+
+  pid = fork ();
+  if (pid == -1)
+    goto out;
+
+  if (pid == 0)
+    {
+      int dont_close[] = { -1 };
+
+      /* Don't get hit by signals for the zygote's session */
+      setsid ();
+
+      for (i = 0; i < 3; i++)
+        if (dup2 (client->stdio_fds[i], i) == -1)
+          die_with_error ("dup2");
+      fdwalk (close_extra_fds, dont_close);
+
+      clearenv ();
+      for (i = 0; child_env[i] != NULL; i++)
+        putenv (child_env[i]);
+      apply_env_overrides ();
+
+      if (chdir (cwd) < 0)
+        {
+          /* If the old cwd is not mapped, go to home */
+          const char *home = getenv("HOME");
+          chdir (home);
+        }
+
+      /* The user namespace and seccomp filter are inherited from the
+         zygote, see do_zygote() */
+
+      unblock_sigchild ();
+
+      if (execvp (child_argv[0], child_argv) == -1)
+        die_with_error ("execvp %s", child_argv[0]);
+      exit (1);
+    }
+
+ out:
+  free (strs);
+
+  return pid;
+}
+
+/* Reads as much of the request of a new client as is available, and
+ * once it is complete forks the process for it. Returns 1 when the
+ * process was started, 0 if more of the request is needed and -1 if
+ * the client should be dropped. */
+static int
+zygote_read_request (ZygoteClient *client)
+{
+  ssize_t res;
+
+  if (client->data == NULL)
+    {
+      struct msghdr msg = { 0 };
+      struct iovec iov;
+      struct cmsghdr *cmsg;
+      union {
+        char buf[CMSG_SPACE (3 * sizeof (int))];
+        struct cmsghdr align;
+      } control;
+
+      iov.iov_base = &client->len;
+      iov.iov_len = sizeof (client->len);
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control.buf;
+      msg.msg_controllen = sizeof (control.buf);
+
+      do
+        res = recvmsg (client->fd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+      while (res < 0 && errno == EINTR);
+
+      if (res < 0 && errno == EAGAIN)
+        return 0;
+
+      if (res != sizeof (client->len) || (msg.msg_flags & MSG_CTRUNC) != 0)
+        return -1;
+
+      for (cmsg = CMSG_FIRSTHDR (&msg); cmsg != NULL; cmsg = CMSG_NXTHDR (&msg, cmsg))
+        {
+          if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+              cmsg->cmsg_len == CMSG_LEN (3 * sizeof (int)))
+            memcpy (client->stdio_fds, CMSG_DATA (cmsg), 3 * sizeof (int));
+        }
+
+      if (client->stdio_fds[0] == -1 || client->len == 0 || client->len > ZYGOTE_MAX_REQUEST_SIZE)
+        return -1;
+
+      client->data = xmalloc (client->len);
+      client->n_read = 0;
+    }
+
+  while (client->n_read < client->len)
+    {
+      res = read (client->fd, client->data + client->n_read, client->len - client->n_read);
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (res < 0 && errno == EAGAIN)
+        return 0;
+      if (res <= 0)
+        return -1;
+      client->n_read += res;
+    }
+
+  client->pid = zygote_spawn (client);
+  zygote_client_clear_request (client);
+
+  return client->pid == -1 ? -1 : 1;
+}
+
+static int
+zygote_accept (int listen_fd, ZygoteClient *client)
+{
+  struct ucred cred;
+  socklen_t cred_len = sizeof (cred);
+  int fd;
+
+  fd = accept4 (listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if (fd == -1)
+    return -1;
+
+  if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 ||
+      cred.uid != getuid ())
+    {
+      close (fd);
+      return -1;
+    }
+
+  memset (client, 0, sizeof (*client));
+  client->fd = fd;
+  client->pid = -1;
+  client->stdio_fds[0] = client->stdio_fds[1] = client->stdio_fds[2] = -1;
+  client->deadline = trace_now () / 1000 + ZYGOTE_REQUEST_TIMEOUT_MSECS;
+
+  return 0;
+}
+
+static void
+zygote_drop_client (ZygoteClient *clients, int *n_clients, int i)
+{
+  zygote_client_clear_request (&clients[i]);
+  close (clients[i].fd);
+  clients[i] = clients[--(*n_clients)];
+}
+
+/* Like do_init(), but also handles launch requests, and only exits
+ * after the sandbox has been empty for a while. */
+static int
+do_zygote (int event_fd, pid_t initial_pid, int listen_fd, bool devel)
+{
+  ZygoteClient *clients = NULL;
+  struct pollfd *fds = NULL;
+  int n_clients = 0;
+  int signal_fd;
+  sigset_t mask;
+  bool have_children = TRUE;
+  bool idle;
+  uint64_t now;
+  int timeout;
+  int res, i;
+
+  lock_all_dirs ();
+
+  /* Set up the user namespace and the seccomp filter of the app
+     processes here rather than in each of them, so that the zygote
+     has the same filter as the monitor has without it. They inherit
+     both, and wouldn't be allowed to create their own namespace
+     under the filter anyway. */
+  setup_app_process (devel);
+
+  /* SIGCHLD is still blocked from before the clone */
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGCHLD);
+
+  signal_fd = signalfd (-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (signal_fd == -1)
+    die_with_error ("signalfd");
+
+  while (1)
+    {
+      fds = xrealloc (fds, (2 + n_clients) * sizeof (struct pollfd));
+      fds[0].fd = listen_fd;
+      fds[0].events = POLLIN;
+      fds[1].fd = signal_fd;
+      fds[1].events = POLLIN;
+      for (i = 0; i < n_clients; i++)
+        {
+          fds[2 + i].fd = clients[i].fd;
+          fds[2 + i].events = POLLIN;
+        }
+
+      /* Wait for the first request deadline, if any, and otherwise
+         only time out when there is nothing left in the sandbox */
+      timeout = -1;
+      idle = FALSE;
+      now = trace_now () / 1000;
+      for (i = 0; i < n_clients; i++)
+        {
+          if (clients[i].pid == -1)
+            {
+              int left = clients[i].deadline > now ? clients[i].deadline - now : 0;
+
+              if (timeout == -1 || left < timeout)
+                timeout = left;
+            }
+        }
+      if (timeout == -1 && !have_children && n_clients == 0)
+        {
+          timeout = ZYGOTE_IDLE_TIMEOUT_SECS * 1000;
+          idle = TRUE;
+        }
+
+      res = poll (fds, 2 + n_clients, timeout);
+      if (res == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          die_with_error ("poll");
+        }
+
+      if (res == 0 && idle)
+        break;
+
+      /* Requests and signals to forward, backwards so we can remove
+         clients */
+      now = trace_now () / 1000;
+      for (i = n_clients - 1; i >= 0; i--)
+        {
+          int sig;
+          ssize_t s;
+
+          if (clients[i].pid == -1)
+            {
+              if ((fds[2 + i].revents & (POLLIN | POLLHUP | POLLERR)) != 0 &&
+                  zygote_read_request (&clients[i]) != 0)
+                {
+                  if (clients[i].pid == -1)
+                    zygote_drop_client (clients, &n_clients, i);
+                  else
+                    have_children = TRUE;
+                }
+              else if (clients[i].deadline <= now)
+                zygote_drop_client (clients, &n_clients, i);
+              continue;
+            }
+
+          if ((fds[2 + i].revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+            continue;
+
+          s = read (clients[i].fd, &sig, sizeof (sig));
+          if (s == sizeof (sig))
+            {
+              if (sig > 0 && sig < NSIG)
+                kill (clients[i].pid, sig);
+            }
+          else if (s == 0 || (s < 0 && errno != EINTR && errno != EAGAIN))
+            {
+              /* Client went away, the process keeps running */
+              close (clients[i].fd);
+              clients[i] = clients[--n_clients];
+            }
+        }
+
+      if (fds[1].revents & POLLIN)
+        {
+          struct signalfd_siginfo fdsi;
+
+          while (read (signal_fd, &fdsi, sizeof (fdsi)) == sizeof (fdsi))
+            ;
+
+          while (1)
+            {
+              pid_t child;
+              int status;
+
+              child = waitpid (-1, &status, WNOHANG);
+              if (child == 0)
+                break;
+              if (child == -1)
+                {
+                  if (errno == EINTR)
+                    continue;
+                  if (errno != ECHILD)
+                    die_with_error ("init wait()");
+                  have_children = FALSE;
+                  break;
+                }
+
+              if (child == initial_pid)
+                {
+                  uint64_t val = (WIFEXITED (status) ? WEXITSTATUS (status) : 1) + 1;
+                  write (event_fd, &val, 8);
+                }
+
+              for (i = n_clients - 1; i >= 0; i--)
+                {
+                  if (clients[i].pid == child)
+                    {
+                      write (clients[i].fd, &status, sizeof (status));
+                      close (clients[i].fd);
+                      clients[i] = clients[--n_clients];
+                    }
+                }
+            }
+        }
+
+      if (fds[0].revents & POLLIN)
+        {
+          clients = xrealloc (clients, (n_clients + 1) * sizeof (ZygoteClient));
+          if (zygote_accept (listen_fd, &clients[n_clients]) == 0)
+            n_clients++;
+        }
+    }
+
+  /* We can't unlink the socket, as it's outside the sandbox, but the
+     next launch will notice that it is stale and replace it. */
+  return 0;
+}
+
 #ifdef DISABLE_USERNS
 
 #define REQUIRED_CAPS (CAP_TO_MASK(CAP_SYS_ADMIN))
@@ -2031,7 +3071,13 @@ main (int argc,
   pid_t pid;
   int event_fd;
   int sync_fd = -1;
+  char *zygote_path = NULL;
+  int zygote_fd = -1;
   char *endp;
+  int phase;
+  uint64_t start_time;
+
+  start_time = trace_now ();
 
 #ifdef DISABLE_USERNS
   /* Get the capabilities we need, drop root */
@@ -2044,7 +3090,7 @@ main (int argc,
 
   clean_argv (argc, argv);
 
-  while ((c =  getopt (argc, argv, "+inWwceEsfFHra:m:M:b:B:p:x:ly:d:D:v:I:gS:")) >= 0)
+  while ((c =  getopt (argc, argv, "+inWwceEsfFHra:m:M:b:B:p:t:x:ly:d:D:v:I:gS:z:")) >= 0)
     {
       switch (c)
         {
@@ -2165,6 +3211,12 @@ main (int argc,
 	    die ("Invalid fd argument");
           break;
 
+        case 't':
+          trace_fd = strtol (optarg, &endp, 10);
+	  if (endp == optarg || *endp != 0)
+	    die ("Invalid fd argument");
+          break;
+
         case 'v':
           var_path = optarg;
           break;
@@ -2185,6 +3237,10 @@ main (int argc,
           wayland_socket = optarg;
           break;
 
+        case 'z':
+          zygote_path = optarg;
+          break;
+
         default: /* '?' */
           usage (argv);
       }
@@ -2193,6 +3249,13 @@ main (int argc,
   args = &argv[optind];
   n_args = argc - optind;
 
+  if (trace_fd != -1)
+    {
+      phase = trace_begin ("startup");
+      trace_phases[phase].start = start_time;
+      trace_end (phase);
+    }
+
   if (monitor_path != NULL && create_etc_dir)
     {
       create_monitor_links = TRUE;
@@ -2229,6 +3292,7 @@ main (int argc,
 
   block_sigchild (); /* Block before we clone to avoid races */
 
+  phase = trace_begin ("clone");
   pid = raw_clone (SIGCHLD | CLONE_NEWNS | CLONE_NEWPID |
 #ifndef DISABLE_USERNS
                    CLONE_NEWUSER |
@@ -2247,7 +3311,10 @@ main (int argc,
       exit (0); /* Should not be reached, but better safe... */
     }
 
+  trace_end (phase);
+
 #ifndef DISABLE_USERNS
+  phase = trace_begin ("uid-map");
   {
     char *uid_map, *gid_map;
     /* This is a bit hacky, but we need to first map the real uid/gid to
@@ -2267,6 +3334,7 @@ main (int argc,
       die_with_error ("setting up gid map");
     free (gid_map);
   }
+  trace_end (phase);
 #endif
 
   old_umask = umask (0);
@@ -2286,7 +3354,9 @@ main (int argc,
   if (chdir (newroot) != 0)
       die_with_error ("chdir");
 
+  phase = trace_begin ("create-files");
   create_files (create, N_ELEMENTS (create), share_shm, runtime_path);
+  trace_end (phase);
 
   if (share_shm)
     {
@@ -2325,7 +3395,9 @@ main (int argc,
         die_with_error ("mount var");
     }
 
+  phase = trace_begin ("create-files-post");
   create_files (create_post, N_ELEMENTS (create_post), share_shm, runtime_path);
+  trace_end (phase);
 
   if (create_etc_dir)
     link_extra_etc_dirs ();
@@ -2347,6 +3419,7 @@ main (int argc,
    * to global abstract unix domain sockets are still accessible to the app
    * though...
    */
+  phase = trace_begin ("x11");
   if (x11_socket)
     {
       struct stat st;
@@ -2373,7 +3446,10 @@ main (int argc,
       xunsetenv ("XAUTHORITY");
     }
 
+  trace_end (phase);
+
   /* Bind mount in the Wayland socket */
+  phase = trace_begin ("wayland");
   if (wayland_socket != 0)
     {
       char *wayland_path_relative = strdup_printf ("run/user/%d/wayland-0", uid);
@@ -2383,6 +3459,9 @@ main (int argc,
       free (wayland_path_relative);
     }
 
+  trace_end (phase);
+
+  phase = trace_begin ("pulseaudio");
   if (pulseaudio_socket != NULL)
     {
       char *pulse_path_relative = strdup_printf ("run/user/%d/pulse/native", uid);
@@ -2409,6 +3488,9 @@ main (int argc,
       free (client_config);
    }
 
+  trace_end (phase);
+
+  phase = trace_begin ("dbus");
   if (system_dbus_socket != NULL)
     {
       if (create_file ("run/dbus/system_bus_socket", 0666, NULL) &&
@@ -2433,6 +3515,9 @@ main (int argc,
       free (session_dbus_address);
    }
 
+  trace_end (phase);
+
+  phase = trace_begin ("filesystems");
   if (mount_host_fs)
     {
       mount_extra_root_dirs (mount_host_fs_ro);
@@ -2465,6 +3550,9 @@ main (int argc,
       free (dconf_run_path);
     }
 
+  trace_end (phase);
+
+  phase = trace_begin ("extra-files");
   for (i = 0; i < n_extra_files; i++)
     {
       bool is_dir;
@@ -2495,9 +3583,19 @@ main (int argc,
         }
     }
 
+  trace_end (phase);
+
+  phase = trace_begin ("loopback");
   if (!network)
     loopback_setup ();
+  trace_end (phase);
+
+  /* Needs to be done before we lose access to the host filesystem.
+     If this fails we just run without the zygote. */
+  if (zygote_path)
+    zygote_fd = zygote_listen (zygote_path);
 
+  phase = trace_begin ("pivot-root");
   if (pivot_root (newroot, ".oldroot"))
     die_with_error ("pivot_root");
 
@@ -2509,6 +3607,7 @@ main (int argc,
 
   if (umount2 (".oldroot", MNT_DETACH))
     die_with_error ("unmount oldroot");
+  trace_end (phase);
 
   umask (old_umask);
 
@@ -2546,6 +3645,7 @@ main (int argc,
 
   __debug__(("forking for child\n"));
 
+  phase = trace_begin ("fork");
   pid = fork ();
   if (pid == -1)
     die_with_error("Can't fork for child");
@@ -2554,50 +3654,53 @@ main (int argc,
     {
       __debug__(("launch executable %s\n", args[0]));
 
-#ifndef DISABLE_USERNS
-      {
-        char *uid_map, *gid_map;
-        /* Now that devpts is mounted we can create a new userspace and map
-           our uid 1:1 */
-
-        if (unshare (CLONE_NEWUSER))
-          die_with_error ("unshare user ns");
-
-        uid_map = strdup_printf ("%d 0 1\n", uid);
-        if (!write_file ("/proc/self/uid_map", uid_map))
-          die_with_error ("setting up uid map");
-        free (uid_map);
-
-        gid_map = strdup_printf ("%d 0 1\n", gid);
-        if (!write_file ("/proc/self/gid_map", gid_map))
-          die_with_error ("setting up gid map");
-        free (gid_map);
-      }
-#endif
+      trace_end (phase);
 
-      __debug__(("setting up seccomp in child\n"));
-      setup_seccomp (devel);
+      setup_app_process (devel);
 
       if (sync_fd != -1)
 	close (sync_fd);
 
       unblock_sigchild ();
 
+      /* This closes the trace fd, so the app doesn't get it */
+      trace_begin ("exec %s", args[0]);
+      trace_write ();
+
       if (execvp (args[0], args) == -1)
         die_with_error ("execvp %s", args[0]);
       return 0;
     }
 
-  __debug__(("setting up seccomp in monitor\n"));
-  setup_seccomp (devel);
+  /* The zygote sets up its filter together with the user namespace
+     that its app processes share, in do_zygote() */
+  if (zygote_fd == -1)
+    {
+      __debug__(("setting up seccomp in monitor\n"));
+      setup_seccomp (devel);
+    }
 
   /* Close all extra fds in pid 1.
      Any passed in fds have been passed on to the child anyway. */
   {
-    int dont_close[] = { event_fd, sync_fd, -1 };
+    int dont_close[4];
+    int n_dont_close = 0;
+
+    dont_close[n_dont_close++] = event_fd;
+    if (zygote_fd != -1)
+      dont_close[n_dont_close++] = zygote_fd;
+    dont_close[n_dont_close++] = sync_fd;
+    dont_close[n_dont_close] = -1;
     fdwalk (close_extra_fds, dont_close);
   }
 
+  if (zygote_fd != -1)
+    {
+      if (app_id)
+        set_procname (strdup_printf ("xdg-app-helper %s zygote", app_id));
+      return do_zygote (event_fd, pid, zygote_fd, devel);
+    }
+
   if (app_id)
     set_procname (strdup_printf ("xdg-app-helper %s monitor", app_id));
   return do_init (event_fd, pid);
@@ -20,11 +20,20 @@
 
 #include "config.h"
 
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/utsname.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <signal.h>
 
 #include <X11/Xauth.h>
 
@@ -1116,6 +1125,432 @@ create_proxy_socket (char *template)
   return g_steal_pointer (&proxy_socket);
 }
 
+char *
+xdg_app_run_get_dbus_proxy_control_path (void)
+{
+  return g_build_filename (g_get_user_runtime_dir (), "xdg-dbus-proxy", "control", NULL);
+}
+
+static gboolean
+write_all (int fd, const char *data, gsize len)
+{
+  while (len > 0)
+    {
+      ssize_t res = write (fd, data, len);
+      if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return FALSE;
+        }
+      data += res;
+      len -= res;
+    }
+
+  return TRUE;
+}
+
+/* Hands the proxy arguments to an already running shared dbus proxy
+ * (xdg-dbus-proxy --control) instead of spawning a new one. Returns
+ * the connection to the proxy once it is listening on the requested
+ * sockets, or -1 if there is no such proxy or it failed. The proxies
+ * stay alive until the returned fd is closed, so it can be used
+ * exactly like the sync pipe of a spawned proxy.
+ */
+int
+xdg_app_run_connect_dbus_proxy (GPtrArray *dbus_proxy_argv)
+{
+  g_autofree char *control_path = xdg_app_run_get_dbus_proxy_control_path ();
+  g_autoptr(GString) request = g_string_new ("");
+  struct sockaddr_un addr = { 0 };
+  char x;
+  int fd;
+  int i;
+
+  if (strlen (control_path) >= sizeof (addr.sun_path))
+    return -1;
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, control_path);
+  if (connect (fd, (struct sockaddr *)&addr, sizeof (addr)) != 0)
+    goto fail;
+
+  for (i = 0; i < dbus_proxy_argv->len; i++)
+    g_string_append_len (request, dbus_proxy_argv->pdata[i],
+                         strlen (dbus_proxy_argv->pdata[i]) + 1);
+  g_string_append_c (request, 0);
+
+  if (!write_all (fd, request->str, request->len))
+    goto fail;
+
+  /* Wait until the proxies are listening */
+  if (TEMP_FAILURE_RETRY (read (fd, &x, 1)) != 1)
+    goto fail;
+
+  return fd;
+
+ fail:
+  close (fd);
+  return -1;
+}
+
+/* The plan holds the merged permissions of the app, so it must be
+   kept out of the app's own data dir, which the app can write to */
+static GFile *
+get_launch_plan_file (const char *app_ref)
+{
+  g_auto(GStrv) parts = g_strsplit (app_ref, "/", 0);
+  g_autofree char *path = g_build_filename (g_get_user_cache_dir (), "xdg-app",
+                                            "launch-plans", parts[1], NULL);
+
+  return g_file_new_for_path (path);
+}
+
+static void
+launch_plan_checksum_mtime (GChecksum *checksum,
+                            GFile     *file)
+{
+  const char *path = gs_file_get_path_cached (file);
+  struct stat st;
+
+  g_checksum_update (checksum, (guchar *)path, strlen (path) + 1);
+  if (stat (path, &st) == 0)
+    g_checksum_update (checksum, (guchar *)&st.st_mtim, sizeof (st.st_mtim));
+}
+
+static void
+launch_plan_checksum_active (GChecksum  *checksum,
+                             XdgAppDir  *user_dir,
+                             XdgAppDir  *system_dir,
+                             const char *ref)
+{
+  g_autofree char *active = NULL;
+  const char *where = "user";
+
+  active = xdg_app_dir_read_active (user_dir, ref, NULL);
+  if (active == NULL)
+    {
+      active = xdg_app_dir_read_active (system_dir, ref, NULL);
+      where = "system";
+    }
+
+  g_checksum_update (checksum, (guchar *)ref, strlen (ref) + 1);
+  g_checksum_update (checksum, (guchar *)where, strlen (where) + 1);
+  if (active)
+    g_checksum_update (checksum, (guchar *)active, strlen (active));
+  g_checksum_update (checksum, (guchar *)"", 1);
+}
+
+/* A launch plan is valid as long as the active deployments of the app
+ * and runtime are the same, the overrides for the app are unmodified
+ * and no deployment changed in either installation (which could
+ * change the set of extensions). All of this can be checked with a
+ * few stats, without loading any metadata. */
+static char *
+get_launch_plan_stamp (const char *app_ref,
+                       const char *runtime_ref,
+                       const char *runtime,
+                       gboolean    devel)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autoptr(XdgAppDir) user_dir = xdg_app_dir_get_user ();
+  g_autoptr(XdgAppDir) system_dir = xdg_app_dir_get_system ();
+  g_auto(GStrv) parts = g_strsplit (app_ref, "/", 0);
+  XdgAppDir *dirs[] = { user_dir, system_dir };
+  int i;
+
+  g_checksum_update (checksum, (guchar *)(runtime ? runtime : ""), runtime ? strlen (runtime) + 1 : 1);
+  g_checksum_update (checksum, (guchar *)(devel ? "devel" : ""), devel ? 6 : 1);
+
+  launch_plan_checksum_active (checksum, user_dir, system_dir, app_ref);
+  launch_plan_checksum_active (checksum, user_dir, system_dir, runtime_ref);
+
+  for (i = 0; i < G_N_ELEMENTS (dirs); i++)
+    {
+      g_autoptr(GFile) changed = xdg_app_dir_get_changed_path (dirs[i]);
+      g_autoptr(GFile) overrides = g_file_resolve_relative_path (xdg_app_dir_get_path (dirs[i]), "overrides");
+      g_autoptr(GFile) app_overrides = g_file_get_child (overrides, parts[1]);
+
+      launch_plan_checksum_mtime (checksum, changed);
+      launch_plan_checksum_mtime (checksum, app_overrides);
+    }
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+/* Returns the launch plan saved by an earlier run of app_ref with the
+ * same options, or NULL if there is none or it is out of date. */
+GKeyFile *
+xdg_app_run_load_launch_plan (const char *app_ref,
+                              const char *runtime,
+                              gboolean    devel)
+{
+  g_autoptr(GFile) plan_file = get_launch_plan_file (app_ref);
+  g_autoptr(GKeyFile) plan = g_key_file_new ();
+  g_autofree char *runtime_ref = NULL;
+  g_autofree char *stamp = NULL;
+  g_autofree char *current_stamp = NULL;
+
+  if (!g_key_file_load_from_file (plan, gs_file_get_path_cached (plan_file), G_KEY_FILE_NONE, NULL))
+    return NULL;
+
+  runtime_ref = g_key_file_get_string (plan, XDG_APP_LAUNCH_PLAN_GROUP,
+                                       XDG_APP_LAUNCH_PLAN_KEY_RUNTIME, NULL);
+  stamp = g_key_file_get_string (plan, XDG_APP_LAUNCH_PLAN_GROUP,
+                                 XDG_APP_LAUNCH_PLAN_KEY_STAMP, NULL);
+  if (runtime_ref == NULL || stamp == NULL ||
+      !g_key_file_has_key (plan, XDG_APP_LAUNCH_PLAN_GROUP, XDG_APP_LAUNCH_PLAN_KEY_APP_FILES, NULL) ||
+      !g_key_file_has_key (plan, XDG_APP_LAUNCH_PLAN_GROUP, XDG_APP_LAUNCH_PLAN_KEY_RUNTIME_FILES, NULL) ||
+      !g_key_file_has_key (plan, XDG_APP_LAUNCH_PLAN_GROUP, XDG_APP_LAUNCH_PLAN_KEY_COMMAND, NULL))
+    return NULL;
+
+  current_stamp = get_launch_plan_stamp (app_ref, runtime_ref, runtime, devel);
+  if (strcmp (stamp, current_stamp) != 0)
+    return NULL;
+
+  return g_steal_pointer (&plan);
+}
+
+/* The plan is only a cache, so failing to save it is not an error */
+void
+xdg_app_run_save_launch_plan (GKeyFile   *plan,
+                              const char *app_ref,
+                              const char *runtime,
+                              gboolean    devel)
+{
+  g_autoptr(GFile) plan_file = get_launch_plan_file (app_ref);
+  g_autoptr(GFile) plan_dir = g_file_get_parent (plan_file);
+  g_autoptr(GError) my_error = NULL;
+  g_autofree char *runtime_ref = NULL;
+  g_autofree char *stamp = NULL;
+
+  runtime_ref = g_key_file_get_string (plan, XDG_APP_LAUNCH_PLAN_GROUP,
+                                       XDG_APP_LAUNCH_PLAN_KEY_RUNTIME, NULL);
+  if (runtime_ref == NULL)
+    return;
+
+  stamp = get_launch_plan_stamp (app_ref, runtime_ref, runtime, devel);
+  g_key_file_set_string (plan, XDG_APP_LAUNCH_PLAN_GROUP,
+                         XDG_APP_LAUNCH_PLAN_KEY_STAMP, stamp);
+
+  if (!gs_file_ensure_directory (plan_dir, TRUE, NULL, &my_error) ||
+      !g_key_file_save_to_file (plan, gs_file_get_path_cached (plan_file), &my_error))
+    g_debug ("Failed to save launch plan: %s", my_error->message);
+}
+
+/* Deployed files are reached through the "active" symlink, which
+ * keeps its path across updates, so use the deploy it points to */
+static void
+checksum_add_resolved_path (GChecksum  *checksum,
+                            const char *path)
+{
+  g_autofree char *resolved = realpath (path, NULL);
+
+  if (resolved == NULL)
+    resolved = g_strdup (path);
+
+  g_checksum_update (checksum, (guchar *)resolved, strlen (resolved) + 1);
+}
+
+/* The sandbox for an app can be reused by later launches if it was
+ * started in zygote mode (see xdg-app-helper -z). The socket path is
+ * derived from everything that affects the sandbox setup, so that
+ * changing the app, its runtime, its extensions or its permissions
+ * gets a new one.
+ */
+char *
+xdg_app_run_get_zygote_path (const char    *app_ref,
+                             GFile         *app_files,
+                             GFile         *runtime_files,
+                             char         **extension_args,
+                             XdgAppContext *context,
+                             gboolean       devel)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autoptr(GKeyFile) metakey = g_key_file_new ();
+  g_autofree char *metadata = NULL;
+  gsize metadata_len;
+  const char *env_vars[] = { "HOME", "DISPLAY", "WAYLAND_DISPLAY", "XAUTHORITY",
+                             "PULSE_SERVER", "DBUS_SESSION_BUS_ADDRESS",
+                             "DBUS_SYSTEM_BUS_ADDRESS", NULL };
+  int i;
+
+  xdg_app_context_save_metadata (context, metakey);
+  metadata = g_key_file_to_data (metakey, &metadata_len, NULL);
+
+  g_checksum_update (checksum, (guchar *)app_ref, strlen (app_ref) + 1);
+  checksum_add_resolved_path (checksum, gs_file_get_path_cached (app_files));
+  checksum_add_resolved_path (checksum, gs_file_get_path_cached (runtime_files));
+  for (i = 0; extension_args != NULL && extension_args[i] != NULL; i++)
+    {
+      const char *arg = extension_args[i];
+      const char *source = strchr (arg, '=');
+
+      /* Bind mount args are DEST=SOURCE, with SOURCE a deployed extension */
+      if (source == NULL)
+        {
+          g_checksum_update (checksum, (guchar *)arg, strlen (arg) + 1);
+          continue;
+        }
+
+      source++;
+      g_checksum_update (checksum, (guchar *)arg, source - arg);
+      checksum_add_resolved_path (checksum, source);
+    }
+  g_checksum_update (checksum, (guchar *)(devel ? "devel" : ""), devel ? 6 : 1);
+  g_checksum_update (checksum, (guchar *)metadata, metadata_len + 1);
+  for (i = 0; env_vars[i] != NULL; i++)
+    {
+      const char *val = g_getenv (env_vars[i]);
+      if (val)
+        g_checksum_update (checksum, (guchar *)val, strlen (val));
+      g_checksum_update (checksum, (guchar *)"", 1);
+    }
+
+  return g_build_filename (g_get_user_runtime_dir (), "xdg-app-zygote",
+                           g_checksum_get_string (checksum), NULL);
+}
+
+/* Runs argv in an existing zygote for the app, forwarding signals to
+ * it until it exits. Returns FALSE if there is no (working) zygote,
+ * in which case nothing was started. */
+gboolean
+xdg_app_run_in_zygote (const char  *zygote_path,
+                       char       **argv,
+                       char       **envp,
+                       int         *exit_status)
+{
+  g_autoptr(GString) request = g_string_new ("");
+  g_autofree char *cwd = g_get_current_dir ();
+  struct sockaddr_un addr = { 0 };
+  struct ucred cred;
+  socklen_t cred_len = sizeof (cred);
+  struct msghdr msg = { 0 };
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    char buf[CMSG_SPACE (3 * sizeof (int))];
+    struct cmsghdr align;
+  } control;
+  int stdio_fds[3] = { 0, 1, 2 };
+  sigset_t mask, old_mask;
+  struct pollfd fds[2];
+  guint32 len;
+  int status = -1;
+  int signal_fd;
+  int fd;
+  int i;
+
+  if (strlen (zygote_path) >= sizeof (addr.sun_path))
+    return FALSE;
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return FALSE;
+
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, zygote_path);
+  if (connect (fd, (struct sockaddr *)&addr, sizeof (addr)) != 0)
+    goto fail;
+
+  /* Don't hand our stdio to someone else's zygote */
+  if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 ||
+      cred.uid != getuid ())
+    goto fail;
+
+  g_string_append_len (request, cwd, strlen (cwd) + 1);
+  for (i = 0; argv[i] != NULL; i++)
+    g_string_append_len (request, argv[i], strlen (argv[i]) + 1);
+  g_string_append_c (request, 0);
+  for (i = 0; envp[i] != NULL; i++)
+    g_string_append_len (request, envp[i], strlen (envp[i]) + 1);
+
+  len = request->len;
+  iov.iov_base = &len;
+  iov.iov_len = sizeof (len);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof (control.buf);
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (stdio_fds));
+  memcpy (CMSG_DATA (cmsg), stdio_fds, sizeof (stdio_fds));
+
+  if (TEMP_FAILURE_RETRY (sendmsg (fd, &msg, MSG_NOSIGNAL)) != sizeof (len) ||
+      !write_all (fd, request->str, request->len))
+    goto fail;
+
+  /* From here on the command is running (or failed to), so we never
+     return FALSE. Forward the signals we'd normally get to it. */
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGINT);
+  sigaddset (&mask, SIGTERM);
+  sigaddset (&mask, SIGHUP);
+  sigaddset (&mask, SIGQUIT);
+  sigprocmask (SIG_BLOCK, &mask, &old_mask);
+  signal_fd = signalfd (-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+
+  fds[0].fd = fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = signal_fd;
+  fds[1].events = POLLIN;
+
+  while (TRUE)
+    {
+      fds[0].revents = fds[1].revents = 0;
+      if (poll (fds, signal_fd != -1 ? 2 : 1, -1) == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          break;
+        }
+
+      if (fds[1].revents & POLLIN)
+        {
+          struct signalfd_siginfo fdsi;
+
+          while (read (signal_fd, &fdsi, sizeof (fdsi)) == sizeof (fdsi))
+            {
+              int sig = fdsi.ssi_signo;
+              write_all (fd, (char *)&sig, sizeof (sig));
+            }
+        }
+
+      if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+          if (TEMP_FAILURE_RETRY (read (fd, &status, sizeof (status))) != sizeof (status))
+            status = -1;
+          break;
+        }
+    }
+
+  if (signal_fd != -1)
+    close (signal_fd);
+  sigprocmask (SIG_SETMASK, &old_mask, NULL);
+  close (fd);
+
+  if (status == -1)
+    *exit_status = 1;
+  else if (WIFEXITED (status))
+    *exit_status = WEXITSTATUS (status);
+  else if (WIFSIGNALED (status))
+    *exit_status = 128 + WTERMSIG (status);
+  else
+    *exit_status = 1;
+
+  return TRUE;
+
+ fail:
+  close (fd);
+  return FALSE;
+}
+
 void
 xdg_app_run_add_system_dbus_args (GPtrArray *argv_array,
 				  GPtrArray *dbus_proxy_argv)
@@ -1208,34 +1643,133 @@ xdg_app_add_bus_filters (GPtrArray *dbus_proxy_argv,
     }
 }
 
+/* Upper bound on the number of threads used to probe the
+   installation directories for extensions */
+#define EXTENSION_PROBE_MAX_THREADS 8
+
+typedef struct {
+  char *prefix;
+  char *type;
+  char *arch;
+  char *branch;
+  char **refs;
+  GError *error;
+} ExtensionListProbe;
+
+typedef struct {
+  char *full_directory;
+  char *ref;
+  char *files_path;
+} ExtensionProbe;
+
 static void
-add_extension_arg (const char *directory,
-                   const char *type,
-                   const char *extension,
-                   const char *arch,
-                   const char *branch,
-                   GPtrArray *argv_array,
-                   GCancellable *cancellable)
-{
-  g_autofree char *extension_ref;
-  g_autoptr(GFile) deploy = NULL;
-  g_autofree char *full_directory = NULL;
-  gboolean is_app;
+extension_list_probe_free (ExtensionListProbe *probe)
+{
+  g_free (probe->prefix);
+  g_free (probe->type);
+  g_free (probe->arch);
+  g_free (probe->branch);
+  g_strfreev (probe->refs);
+  g_clear_error (&probe->error);
+  g_free (probe);
+}
 
-  is_app = strcmp (type, "app") == 0;
+static void
+extension_probe_free (ExtensionProbe *probe)
+{
+  g_free (probe->full_directory);
+  g_free (probe->ref);
+  g_free (probe->files_path);
+  g_free (probe);
+}
+
+static void
+run_extension_list_probe (gpointer data,
+                          gpointer user_data)
+{
+  ExtensionListProbe *probe = data;
+  GCancellable *cancellable = user_data;
 
-  full_directory = g_build_filename (is_app ? "/app" : "/usr", directory, NULL);
+  probe->refs = xdg_app_list_deployed_refs (probe->type, probe->prefix,
+                                            probe->branch, probe->arch,
+                                            cancellable, &probe->error);
+}
 
-  extension_ref = g_build_filename (type, extension, arch, branch, NULL);
-  deploy = xdg_app_find_deploy_dir_for_ref (extension_ref, cancellable, NULL);
+static void
+run_extension_probe (gpointer data,
+                     gpointer user_data)
+{
+  ExtensionProbe *probe = data;
+  GCancellable *cancellable = user_data;
+  g_autoptr(GFile) deploy = NULL;
+
+  deploy = xdg_app_find_deploy_dir_for_ref (probe->ref, cancellable, NULL);
   if (deploy != NULL)
     {
       g_autoptr(GFile) files = g_file_get_child (deploy, "files");
-      g_ptr_array_add (argv_array, g_strdup ("-b"));
-      g_ptr_array_add (argv_array, g_strdup_printf ("%s=%s", full_directory, gs_file_get_path_cached (files)));
+      probe->files_path = g_file_get_path (files);
+    }
+}
+
+/* Each probe only stats a few files, but there is one per installed
+   extension and each looks in both the user and the system
+   installation, so run them concurrently and wait for all of them.
+   The results are stored in the probes themselves, so the caller
+   sees them in the original order. */
+static void
+run_probes (GPtrArray    *probes,
+            GFunc         func,
+            GCancellable *cancellable)
+{
+  g_autoptr(XdgAppDir) user_dir = NULL;
+  g_autoptr(XdgAppDir) system_dir = NULL;
+  GThreadPool *pool = NULL;
+  int i;
+
+  if (probes->len > 1)
+    {
+      /* The installation singletons are created lazily, make sure
+         that happens here rather than racing in the workers. The
+         probes share them, which is safe because listing and looking
+         up deployments only reads the base path, which never changes,
+         and the refs index, which is rebuilt under the dir's lock.
+         Neither opens the ostree repo. */
+      user_dir = xdg_app_dir_get_user ();
+      system_dir = xdg_app_dir_get_system ();
+
+      pool = g_thread_pool_new (func, cancellable,
+                                MIN (probes->len, EXTENSION_PROBE_MAX_THREADS),
+                                FALSE, NULL);
+    }
+
+  for (i = 0; i < probes->len; i++)
+    {
+      if (pool == NULL ||
+          !g_thread_pool_push (pool, g_ptr_array_index (probes, i), NULL))
+        func (g_ptr_array_index (probes, i), cancellable);
     }
+
+  if (pool != NULL)
+    g_thread_pool_free (pool, FALSE, TRUE);
 }
 
+static void
+add_extension_probe (GPtrArray  *probes,
+                     const char *directory,
+                     const char *type,
+                     const char *extension,
+                     const char *arch,
+                     const char *branch)
+{
+  ExtensionProbe *probe = g_new0 (ExtensionProbe, 1);
+  gboolean is_app;
+
+  is_app = strcmp (type, "app") == 0;
+
+  probe->full_directory = g_build_filename (is_app ? "/app" : "/usr", directory, NULL);
+  probe->ref = g_build_filename (type, extension, arch, branch, NULL);
+  g_ptr_array_add (probes, probe);
+}
 
 gboolean
 xdg_app_run_add_extension_args (GPtrArray   *argv_array,
@@ -1246,14 +1780,42 @@ xdg_app_run_add_extension_args (GPtrArray   *argv_array,
 {
   g_auto(GStrv) groups = NULL;
   g_auto(GStrv) parts = NULL;
-  int i;
+  g_autoptr(GPtrArray) list_probes = NULL;
+  g_autoptr(GPtrArray) probes = NULL;
+  int i, j;
 
   parts = g_strsplit (full_ref, "/", 0);
   if (g_strv_length (parts) != 4)
     return xdg_app_fail (error, "Failed to determine parts from ref: %s", full_ref);
 
+  list_probes = g_ptr_array_new_with_free_func ((GDestroyNotify) extension_list_probe_free);
+  probes = g_ptr_array_new_with_free_func ((GDestroyNotify) extension_probe_free);
+
+  /* First list the installed subdirectory extensions, all at once */
   groups = g_key_file_get_groups (metakey, NULL);
   for (i = 0; groups[i] != NULL; i++)
+    {
+      char *extension;
+
+      if (g_str_has_prefix (groups[i], "Extension ") &&
+          *(extension = (groups[i] + strlen ("Extension "))) != 0 &&
+          g_key_file_has_key (metakey, groups[i], "directory", NULL) &&
+          g_key_file_get_boolean (metakey, groups[i], "subdirectories", NULL))
+        {
+          ExtensionListProbe *list_probe = g_new0 (ExtensionListProbe, 1);
+
+          list_probe->prefix = g_strconcat (extension, ".", NULL);
+          list_probe->type = g_strdup (parts[0]);
+          list_probe->arch = g_strdup (parts[2]);
+          list_probe->branch = g_strdup (parts[3]);
+          g_ptr_array_add (list_probes, list_probe);
+        }
+    }
+
+  run_probes (list_probes, run_extension_list_probe, cancellable);
+
+  /* Then collect every candidate deploy, in metadata order */
+  for (i = 0, j = 0; groups[i] != NULL; i++)
     {
       char *extension;
 
@@ -1269,25 +1831,38 @@ xdg_app_run_add_extension_args (GPtrArray   *argv_array,
           if (g_key_file_get_boolean (metakey, groups[i],
                                       "subdirectories", NULL))
             {
-              g_autofree char *prefix = g_strconcat (extension, ".", NULL);
-              g_auto(GStrv) refs = NULL;
-              int i;
+              ExtensionListProbe *list_probe = g_ptr_array_index (list_probes, j++);
+              int k;
 
-              refs = xdg_app_list_deployed_refs (parts[0], prefix, parts[2], parts[3],
-                                                 cancellable, error);
-              if (refs == NULL)
-                return FALSE;
+              if (list_probe->refs == NULL)
+                {
+                  g_propagate_error (error, list_probe->error);
+                  list_probe->error = NULL;
+                  return FALSE;
+                }
 
-              for (i = 0; refs[i] != NULL; i++)
+              for (k = 0; list_probe->refs[k] != NULL; k++)
                 {
-                  g_autofree char *extended_dir = g_build_filename (directory, refs[i] + strlen (prefix), NULL);
-                  add_extension_arg (extended_dir, parts[0], refs[i], parts[2], parts[3],
-                                     argv_array, cancellable);
+                  const char *ref = list_probe->refs[k];
+                  g_autofree char *extended_dir = g_build_filename (directory, ref + strlen (list_probe->prefix), NULL);
+                  add_extension_probe (probes, extended_dir, parts[0], ref, parts[2], parts[3]);
                 }
             }
           else
-            add_extension_arg (directory, parts[0], extension, parts[2], version ? version : parts[3],
-                               argv_array, cancellable);
+            add_extension_probe (probes, directory, parts[0], extension, parts[2], version ? version : parts[3]);
+        }
+    }
+
+  run_probes (probes, run_extension_probe, cancellable);
+
+  for (i = 0; i < probes->len; i++)
+    {
+      ExtensionProbe *probe = g_ptr_array_index (probes, i);
+
+      if (probe->files_path != NULL)
+        {
+          g_ptr_array_add (argv_array, g_strdup ("-b"));
+          g_ptr_array_add (argv_array, g_strdup_printf ("%s=%s", probe->full_directory, probe->files_path));
         }
     }
 
@@ -1684,76 +2259,144 @@ xdg_app_ensure_data_dir (const char *app_id,
   return g_object_ref (dir);
 }
 
-struct JobData {
+typedef struct {
+  char *name;
   char *job;
-  GMainLoop *main_loop;
-};
+  GPtrArray *removed_jobs;
+  GDBusConnection *conn;
+  SystemdManager *manager;
+  gulong job_removed_id;
+  GSource *cancelled_source;
+} TransientUnitData;
 
 static void
-job_removed_cb (SystemdManager *manager,
-                guint32 id,
-                char *job,
-                char *unit,
-                char *result,
-                struct JobData *data)
+transient_unit_data_free (TransientUnitData *data)
 {
-  if (strcmp (job, data->job) == 0)
-    g_main_loop_quit (data->main_loop);
+  g_free (data->name);
+  g_free (data->job);
+  g_ptr_array_unref (data->removed_jobs);
+  g_clear_object (&data->manager);
+  g_clear_object (&data->conn);
+  g_free (data);
 }
 
-void
-xdg_app_run_in_transient_unit (const char *appid)
+/* Drops the last reference to the task, which the async operations
+   passed along until the job finished or the operation failed */
+static void
+transient_unit_return (GTask  *task,
+                       GError *error)
+{
+  TransientUnitData *data = g_task_get_task_data (task);
+
+  if (data != NULL && data->job_removed_id != 0)
+    {
+      g_signal_handler_disconnect (data->manager, data->job_removed_id);
+      data->job_removed_id = 0;
+    }
+
+  if (data != NULL && data->cancelled_source != NULL)
+    {
+      g_source_destroy (data->cancelled_source);
+      g_source_unref (data->cancelled_source);
+      data->cancelled_source = NULL;
+    }
+
+  if (error)
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
+
+  g_object_unref (task);
+}
+
+static gboolean
+transient_unit_cancelled_cb (GCancellable *cancellable,
+                             gpointer      user_data)
 {
-  GDBusConnection *conn = NULL;
+  GTask *task = user_data;
   GError *error = NULL;
-  char *path = NULL;
-  char *address = NULL;
-  char *name = NULL;
-  char *job = NULL;
-  SystemdManager *manager = NULL;
-  GVariantBuilder builder;
-  GVariant *properties = NULL;
-  GVariant *aux = NULL;
-  guint32 pid;
-  GMainContext *main_context = NULL;
-  GMainLoop *main_loop = NULL;
-  struct JobData data;
 
-  path = g_strdup_printf ("/run/user/%d/systemd/private", getuid());
+  g_cancellable_set_error_if_cancelled (cancellable, &error);
+  transient_unit_return (task, error);
 
-  if (!g_file_test (path, G_FILE_TEST_EXISTS))
-    goto out;
+  return G_SOURCE_REMOVE;
+}
 
-  main_context = g_main_context_new ();
-  main_loop = g_main_loop_new (main_context, FALSE);
+static void
+transient_unit_job_removed_cb (SystemdManager *manager,
+                               guint32         id,
+                               char           *job,
+                               char           *unit,
+                               char           *result,
+                               GTask          *task)
+{
+  TransientUnitData *data = g_task_get_task_data (task);
 
-  g_main_context_push_thread_default (main_context);
+  /* The job may finish before we get the reply with its path */
+  if (data->job == NULL)
+    g_ptr_array_add (data->removed_jobs, g_strdup (job));
+  else if (strcmp (job, data->job) == 0)
+    transient_unit_return (task, NULL);
+}
 
+static void
+transient_unit_started_cb (GObject      *source_object,
+                           GAsyncResult *res,
+                           gpointer      user_data)
+{
+  GTask *task = user_data;
+  TransientUnitData *data = g_task_get_task_data (task);
+  GCancellable *cancellable = g_task_get_cancellable (task);
+  GError *error = NULL;
+  int i;
 
-  address = g_strconcat ("unix:path=", path, NULL);
+  if (!systemd_manager_call_start_transient_unit_finish (data->manager, &data->job, res, &error))
+    {
+      g_prefix_error (&error, "Can't start transient unit: ");
+      transient_unit_return (task, error);
+      return;
+    }
+
+  for (i = 0; i < data->removed_jobs->len; i++)
+    {
+      if (strcmp (data->job, g_ptr_array_index (data->removed_jobs, i)) == 0)
+        {
+          transient_unit_return (task, NULL);
+          return;
+        }
+    }
 
-  conn = g_dbus_connection_new_for_address_sync (address,
-                                                 G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
-                                                 NULL,
-                                                 NULL, &error);
-  if (!conn)
+  if (cancellable)
     {
-      g_warning ("Can't connect to systemd: %s\n", error->message);
-      goto out;
+      data->cancelled_source = g_cancellable_source_new (cancellable);
+      g_source_set_callback (data->cancelled_source, (GSourceFunc) transient_unit_cancelled_cb, task, NULL);
+      g_source_attach (data->cancelled_source, g_task_get_context (task));
     }
+}
+
+static void
+transient_unit_manager_ready_cb (GObject      *source_object,
+                                 GAsyncResult *res,
+                                 gpointer      user_data)
+{
+  GTask *task = user_data;
+  TransientUnitData *data = g_task_get_task_data (task);
+  GError *error = NULL;
+  GVariantBuilder builder;
+  GVariant *properties = NULL;
+  GVariant *aux = NULL;
+  guint32 pid;
 
-  manager = systemd_manager_proxy_new_sync (conn,
-                                            G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
-                                            NULL,
-                                            "/org/freedesktop/systemd1",
-                                            NULL, &error);
-  if (!manager)
+  data->manager = systemd_manager_proxy_new_finish (res, &error);
+  if (data->manager == NULL)
     {
-      g_warning ("Can't create manager proxy: %s\n", error->message);
-      goto out;
+      g_prefix_error (&error, "Can't create manager proxy: ");
+      transient_unit_return (task, error);
+      return;
     }
 
-  name = g_strdup_printf ("xdg-app-%s-%d.scope", appid, getpid());
+  data->job_removed_id = g_signal_connect (data->manager, "job-removed",
+                                           G_CALLBACK (transient_unit_job_removed_cb), task);
 
   g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sv)"));
 
@@ -1768,41 +2411,83 @@ xdg_app_run_in_transient_unit (const char *appid)
 
   aux = g_variant_new_array (G_VARIANT_TYPE ("(sa(sv))"), NULL, 0);
 
-  if (!systemd_manager_call_start_transient_unit_sync (manager,
-                                                       name,
-                                                       "fail",
-                                                       properties,
-                                                       aux,
-                                                       &job,
-                                                       NULL,
-                                                       &error))
+  systemd_manager_call_start_transient_unit (data->manager,
+                                             data->name,
+                                             "fail",
+                                             properties,
+                                             aux,
+                                             g_task_get_cancellable (task),
+                                             transient_unit_started_cb,
+                                             task);
+}
+
+static void
+transient_unit_connected_cb (GObject      *source_object,
+                             GAsyncResult *res,
+                             gpointer      user_data)
+{
+  GTask *task = user_data;
+  TransientUnitData *data = g_task_get_task_data (task);
+  GError *error = NULL;
+
+  data->conn = g_dbus_connection_new_for_address_finish (res, &error);
+  if (data->conn == NULL)
     {
-      g_warning ("Can't start transient unit: %s\n", error->message);
-      goto out;
+      g_prefix_error (&error, "Can't connect to systemd: ");
+      transient_unit_return (task, error);
+      return;
     }
 
-  data.job = job;
-  data.main_loop = main_loop;
-  g_signal_connect (manager,"job-removed", G_CALLBACK (job_removed_cb), &data);
+  systemd_manager_proxy_new (data->conn,
+                             G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
+                             NULL,
+                             "/org/freedesktop/systemd1",
+                             g_task_get_cancellable (task),
+                             transient_unit_manager_ready_cb,
+                             task);
+}
+
+/* Moves the current process into a new systemd scope for the app,
+ * completing once systemd has finished the job. If there is no
+ * systemd user instance this completes successfully right away. */
+void
+xdg_app_run_in_transient_unit_async (const char          *appid,
+                                     GCancellable        *cancellable,
+                                     GAsyncReadyCallback  callback,
+                                     gpointer             user_data)
+{
+  GTask *task;
+  TransientUnitData *data;
+  g_autofree char *path = NULL;
+  g_autofree char *address = NULL;
 
-  g_main_loop_run (main_loop);
+  task = g_task_new (NULL, cancellable, callback, user_data);
 
- out:
-  if (main_context)
+  path = g_strdup_printf ("/run/user/%d/systemd/private", getuid());
+  if (!g_file_test (path, G_FILE_TEST_EXISTS))
     {
-      g_main_context_pop_thread_default (main_context);
-      g_main_context_unref (main_context);
+      transient_unit_return (task, NULL);
+      return;
     }
-  if (main_loop)
-    g_main_loop_unref (main_loop);
-  if (error)
-    g_error_free (error);
-  if (manager)
-    g_object_unref (manager);
-  if (conn)
-    g_object_unref (conn);
-  g_free (path);
-  g_free (address);
-  g_free (job);
-  g_free (name);
+
+  data = g_new0 (TransientUnitData, 1);
+  data->name = g_strdup_printf ("xdg-app-%s-%d.scope", appid, getpid());
+  data->removed_jobs = g_ptr_array_new_with_free_func (g_free);
+  g_task_set_task_data (task, data, (GDestroyNotify) transient_unit_data_free);
+
+  address = g_strconcat ("unix:path=", path, NULL);
+
+  g_dbus_connection_new_for_address (address,
+                                     G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
+                                     NULL,
+                                     cancellable,
+                                     transient_unit_connected_cb,
+                                     task);
+}
+
+gboolean
+xdg_app_run_in_transient_unit_finish (GAsyncResult  *result,
+                                      GError       **error)
+{
+  return g_task_propagate_boolean (G_TASK (result), error);
 }
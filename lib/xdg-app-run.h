@@ -24,7 +24,12 @@
 #include "libglnx/libglnx.h"
 #include "dbus-proxy/xdg-app-proxy.h"
 
-void xdg_app_run_in_transient_unit (const char *app_id);
+void     xdg_app_run_in_transient_unit_async  (const char          *app_id,
+                                               GCancellable        *cancellable,
+                                               GAsyncReadyCallback  callback,
+                                               gpointer             user_data);
+gboolean xdg_app_run_in_transient_unit_finish (GAsyncResult        *result,
+                                               GError             **error);
 
 typedef struct XdgAppContext XdgAppContext;
 
@@ -37,6 +42,14 @@ typedef struct XdgAppContext XdgAppContext;
 #define XDG_APP_METADATA_KEY_PERSISTENT "persistent"
 #define XDG_APP_METADATA_KEY_DEVICES "devices"
 
+#define XDG_APP_LAUNCH_PLAN_GROUP "Launch Plan"
+#define XDG_APP_LAUNCH_PLAN_KEY_STAMP "stamp"
+#define XDG_APP_LAUNCH_PLAN_KEY_RUNTIME "runtime"
+#define XDG_APP_LAUNCH_PLAN_KEY_APP_FILES "app-files"
+#define XDG_APP_LAUNCH_PLAN_KEY_RUNTIME_FILES "runtime-files"
+#define XDG_APP_LAUNCH_PLAN_KEY_COMMAND "command"
+#define XDG_APP_LAUNCH_PLAN_KEY_EXTENSION_ARGS "extension-args"
+
 XdgAppContext *xdg_app_context_new                    (void);
 void           xdg_app_context_free                   (XdgAppContext            *context);
 void           xdg_app_context_merge                  (XdgAppContext            *context,
@@ -65,6 +78,25 @@ void     xdg_app_run_add_environment_args    (GPtrArray   *argv_array,
                                               const char  *app_id,
                                               XdgAppContext *context,
                                               GFile       *app_id_dir);
+char *   xdg_app_run_get_dbus_proxy_control_path (void);
+int      xdg_app_run_connect_dbus_proxy      (GPtrArray   *dbus_proxy_argv);
+char *   xdg_app_run_get_zygote_path         (const char  *app_ref,
+                                              GFile       *app_files,
+                                              GFile       *runtime_files,
+                                              char       **extension_args,
+                                              XdgAppContext *context,
+                                              gboolean     devel);
+gboolean xdg_app_run_in_zygote               (const char  *zygote_path,
+                                              char       **argv,
+                                              char       **envp,
+                                              int         *exit_status);
+GKeyFile *xdg_app_run_load_launch_plan       (const char  *app_ref,
+                                              const char  *runtime,
+                                              gboolean     devel);
+void     xdg_app_run_save_launch_plan        (GKeyFile    *plan,
+                                              const char  *app_ref,
+                                              const char  *runtime,
+                                              gboolean     devel);
 char **  xdg_app_run_get_minimal_env         (gboolean     devel);
 char **  xdg_app_run_apply_env_default       (char       **envp);
 char **  xdg_app_run_apply_env_appid         (char       **envp,
@@ -0,0 +1,93 @@
+/*
+ * Copyright © 2014 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+/* Compiles the sandbox seccomp filters to BPF at build time and
+ * writes them to stdout as a C header, so that xdg-app-helper can
+ * load them directly instead of having libseccomp generate them on
+ * every launch. Only used when not cross compiling, as the filters
+ * are specific to the architecture.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/filter.h>
+
+#include "xdg-app-seccomp.h"
+
+static void
+write_filter (int devel, int filter_sockets)
+{
+  scmp_filter_ctx seccomp;
+  char error[256];
+  struct sock_filter insn;
+  FILE *tmp;
+  int r;
+
+  seccomp = xdg_app_seccomp_filter_new (devel, filter_sockets, error, sizeof (error));
+  if (seccomp == NULL)
+    {
+      fprintf (stderr, "%s: %s\n", error, strerror (errno));
+      exit (1);
+    }
+
+  tmp = tmpfile ();
+  if (tmp == NULL)
+    {
+      perror ("tmpfile");
+      exit (1);
+    }
+
+  r = seccomp_export_bpf (seccomp, fileno (tmp));
+  if (r < 0)
+    {
+      fprintf (stderr, "Failed to export seccomp filter: %s\n", strerror (-r));
+      exit (1);
+    }
+
+  seccomp_release (seccomp);
+
+  rewind (tmp);
+
+  printf ("static const struct sock_filter seccomp_filter%s%s[] = {\n",
+          devel ? "_devel" : "", filter_sockets ? "_sockets" : "");
+  while (fread (&insn, sizeof (insn), 1, tmp) == 1)
+    printf ("  { 0x%04x, %u, %u, 0x%08x },\n", insn.code, insn.jt, insn.jf, insn.k);
+  printf ("};\n\n");
+
+  fclose (tmp);
+}
+
+int
+main (int argc, char **argv)
+{
+  printf ("/* Generated by xdg-app-seccomp-gen, do not edit */\n\n");
+
+  write_filter (0, 0);
+  write_filter (0, 1);
+  write_filter (1, 0);
+  write_filter (1, 1);
+
+  return 0;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright © 2014 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *       Alexander Larsson <alexl@redhat.com>
+ */
+
+#ifndef __XDG_APP_SECCOMP_H__
+#define __XDG_APP_SECCOMP_H__
+
+#include <stddef.h>
+#include <seccomp.h>
+
+/* Shared between xdg-app-helper and xdg-app-seccomp-gen, which
+   pre-compiles the filters at build time. No glib here. */
+
+scmp_filter_ctx xdg_app_seccomp_filter_new (int     devel,
+                                            int     filter_sockets,
+                                            char   *error_buf,
+                                            size_t  error_buf_size);
+
+#endif /* __XDG_APP_SECCOMP_H__ */
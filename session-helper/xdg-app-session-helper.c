@@ -23,9 +23,12 @@
 #include <locale.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <gio/gio.h>
 #include "xdg-app-dbus.h"
 #include "xdg-app-permission-store.h"
+#include "xdg-app-run.h"
 
 static GDBusNodeInfo *introspection_data = NULL;
 static char *monitor_dir;
@@ -122,6 +125,47 @@ setup_file_monitor (const char *source)
     g_signal_connect (monitor, "changed", G_CALLBACK (file_changed), (char *)source);
 }
 
+static void
+proxy_child_setup (gpointer user_data)
+{
+  int fd = GPOINTER_TO_INT (user_data);
+  fcntl (fd, F_SETFD, 0);
+}
+
+/* Start a dbus proxy shared by all the sandboxes in the session, so
+   that xdg-app run doesn't have to spawn one per app. It is tied to
+   our lifetime via the sync pipe, which we never close. */
+static void
+start_shared_dbus_proxy (void)
+{
+  g_autofree char *control_path = xdg_app_run_get_dbus_proxy_control_path ();
+  g_autofree char *control_arg = g_strdup_printf ("--control=%s", control_path);
+  g_autofree char *fd_arg = NULL;
+  g_autoptr(GError) error = NULL;
+  int sync_pipes[2];
+  char *proxy_argv[] = { DBUSPROXY, NULL, NULL, NULL };
+
+  if (pipe (sync_pipes) < 0)
+    {
+      g_warning ("Unable to create sync pipe");
+      return;
+    }
+
+  fd_arg = g_strdup_printf ("--fd=%d", sync_pipes[1]);
+  proxy_argv[1] = fd_arg;
+  proxy_argv[2] = control_arg;
+
+  if (!g_spawn_async (NULL, proxy_argv, NULL, 0,
+                      proxy_child_setup, GINT_TO_POINTER (sync_pipes[1]),
+                      NULL, &error))
+    {
+      g_warning ("Unable to start shared dbus proxy: %s", error->message);
+      close (sync_pipes[0]);
+    }
+
+  close (sync_pipes[1]);
+}
+
 int
 main (int    argc,
       char **argv)
@@ -143,6 +187,8 @@ main (int    argc,
 
   setup_file_monitor ("/etc/resolv.conf");
   setup_file_monitor ("/etc/localtime");
+
+  start_shared_dbus_proxy ();
   
   introspection_bytes = g_resources_lookup_data ("/org/freedesktop/XdgApp/org.freedesktop.XdgApp.xml", 0, NULL);
   g_assert (introspection_bytes != NULL);
@@ -0,0 +1,532 @@
+/*
+ * Copyright © 2016 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Measures the cost of the dbus proxy. A private dbus-daemon is
+ * started with a service owning org.xdgapp.Bench, and a client talks
+ * to it directly, through a passthrough proxy and through a filtering
+ * proxy. For each of these we measure method call round trips, a
+ * flood of signals and method calls passing a file descriptor, and
+ * report the rate and the latency added compared to talking directly
+ * to the bus. For the signal flood we can only see when the signals
+ * arrive, so it reports the gaps between them instead of latency.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libglnx/libglnx.h"
+
+#include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+
+#include "dbus-proxy/xdg-app-proxy.h"
+
+#define BENCH_NAME "org.xdgapp.Bench"
+#define BENCH_PATH "/org/xdgapp/Bench"
+#define BENCH_IFACE "org.xdgapp.Bench"
+
+static int opt_iterations = 10000;
+static int opt_signals = 10000;
+static int opt_payload = 64;
+
+static GOptionEntry options[] = {
+  { "iterations", 'n', 0, G_OPTION_ARG_INT, &opt_iterations, "Number of method calls per test", "N" },
+  { "signals", 's', 0, G_OPTION_ARG_INT, &opt_signals, "Number of signals in the flood test", "N" },
+  { "payload", 'p', 0, G_OPTION_ARG_INT, &opt_payload, "Size of the message payload in bytes", "BYTES" },
+  { NULL }
+};
+
+static const char introspection_xml[] =
+  "<node>"
+  "  <interface name='" BENCH_IFACE "'>"
+  "    <method name='Echo'>"
+  "      <arg type='ay' name='data' direction='in'/>"
+  "      <arg type='ay' name='data' direction='out'/>"
+  "    </method>"
+  "    <method name='EchoFd'>"
+  "      <arg type='h' name='fd' direction='in'/>"
+  "      <arg type='h' name='fd' direction='out'/>"
+  "    </method>"
+  "    <method name='Flood'>"
+  "      <arg type='u' name='count' direction='in'/>"
+  "      <arg type='u' name='size' direction='in'/>"
+  "    </method>"
+  "    <signal name='Ping'>"
+  "      <arg type='ay' name='data'/>"
+  "    </signal>"
+  "  </interface>"
+  "</node>";
+
+typedef enum {
+  BENCH_MODE_DIRECT,
+  BENCH_MODE_PASSTHROUGH,
+  BENCH_MODE_FILTER,
+  N_BENCH_MODES
+} BenchMode;
+
+static const char *mode_names[] = { "direct", "passthrough", "filter" };
+
+typedef enum {
+  BENCH_TEST_CALL,
+  BENCH_TEST_SIGNALS,
+  BENCH_TEST_FD,
+  N_BENCH_TESTS
+} BenchTest;
+
+static const char *test_names[] = { "method-call", "signal-gap", "fd-passing" };
+
+typedef struct {
+  gboolean valid;
+  double rate;
+  gint64 p50;
+  gint64 p99;
+} BenchResult;
+
+static char *bus_address;
+static char *proxy_addresses[N_BENCH_MODES];
+static BenchResult results[N_BENCH_MODES][N_BENCH_TESTS];
+static GMainLoop *main_loop;
+static GMutex service_lock;
+static GCond service_cond;
+static gboolean service_ready;
+
+static void
+service_method_call (GDBusConnection       *connection,
+                     const gchar           *sender,
+                     const gchar           *object_path,
+                     const gchar           *interface_name,
+                     const gchar           *method_name,
+                     GVariant              *parameters,
+                     GDBusMethodInvocation *invocation,
+                     gpointer               user_data)
+{
+  if (strcmp (method_name, "Echo") == 0)
+    {
+      g_dbus_method_invocation_return_value (invocation, parameters);
+    }
+  else if (strcmp (method_name, "EchoFd") == 0)
+    {
+      GDBusMessage *message = g_dbus_method_invocation_get_message (invocation);
+      GUnixFDList *fd_list = g_dbus_message_get_unix_fd_list (message);
+
+      g_dbus_method_invocation_return_value_with_unix_fd_list (invocation, parameters, fd_list);
+    }
+  else if (strcmp (method_name, "Flood") == 0)
+    {
+      g_autofree guchar *data = NULL;
+      guint32 count, size, i;
+
+      g_variant_get (parameters, "(uu)", &count, &size);
+      data = g_malloc0 (size);
+
+      for (i = 0; i < count; i++)
+        g_dbus_connection_emit_signal (connection, NULL, BENCH_PATH, BENCH_IFACE, "Ping",
+                                       g_variant_new ("(@ay)",
+                                                      g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+                                                                                 data, size, 1)),
+                                       NULL);
+
+      g_dbus_method_invocation_return_value (invocation, NULL);
+    }
+}
+
+static const GDBusInterfaceVTable service_vtable = {
+  service_method_call,
+};
+
+static gpointer
+service_thread (gpointer data)
+{
+  g_autoptr(GMainContext) context = g_main_context_new ();
+  g_autoptr(GDBusNodeInfo) info = NULL;
+  g_autoptr(GDBusConnection) connection = NULL;
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GError) error = NULL;
+  GMainLoop *loop;
+
+  g_main_context_push_thread_default (context);
+
+  connection = g_dbus_connection_new_for_address_sync (bus_address,
+                                                       G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                       G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                       NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  info = g_dbus_node_info_new_for_xml (introspection_xml, &error);
+  g_assert_no_error (error);
+
+  g_dbus_connection_register_object (connection, BENCH_PATH, info->interfaces[0],
+                                     &service_vtable, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  reply = g_dbus_connection_call_sync (connection, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                                       "org.freedesktop.DBus", "RequestName",
+                                       g_variant_new ("(su)", BENCH_NAME, 0),
+                                       G_VARIANT_TYPE ("(u)"), G_DBUS_CALL_FLAGS_NONE,
+                                       -1, NULL, &error);
+  g_assert_no_error (error);
+
+  g_mutex_lock (&service_lock);
+  service_ready = TRUE;
+  g_cond_signal (&service_cond);
+  g_mutex_unlock (&service_lock);
+
+  loop = g_main_loop_new (context, FALSE);
+  g_main_loop_run (loop);
+
+  return NULL;
+}
+
+static int
+compare_gint64 (gconstpointer a,
+                gconstpointer b)
+{
+  gint64 aa = *(const gint64 *)a;
+  gint64 bb = *(const gint64 *)b;
+
+  return aa < bb ? -1 : (aa > bb ? 1 : 0);
+}
+
+static void
+fill_result (BenchResult *result,
+             gint64      *samples,
+             int          n_samples,
+             gint64       elapsed)
+{
+  qsort (samples, n_samples, sizeof (gint64), compare_gint64);
+
+  result->valid = TRUE;
+  result->rate = (double)n_samples * G_USEC_PER_SEC / MAX (elapsed, 1);
+  result->p50 = samples[(n_samples - 1) * 50 / 100];
+  result->p99 = samples[(n_samples - 1) * 99 / 100];
+}
+
+static void
+bench_calls (GDBusConnection *connection,
+             BenchResult     *result)
+{
+  g_autofree gint64 *samples = g_new (gint64, opt_iterations);
+  g_autofree guchar *data = g_malloc0 (opt_payload);
+  gint64 start, before;
+  int i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_iterations; i++)
+    {
+      g_autoptr(GVariant) reply = NULL;
+      g_autoptr(GError) error = NULL;
+
+      before = g_get_monotonic_time ();
+      reply = g_dbus_connection_call_sync (connection, BENCH_NAME, BENCH_PATH, BENCH_IFACE, "Echo",
+                                           g_variant_new ("(@ay)",
+                                                          g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+                                                                                     data, opt_payload, 1)),
+                                           G_VARIANT_TYPE ("(ay)"), G_DBUS_CALL_FLAGS_NONE,
+                                           -1, NULL, &error);
+      g_assert_no_error (error);
+      samples[i] = g_get_monotonic_time () - before;
+    }
+
+  fill_result (result, samples, opt_iterations, g_get_monotonic_time () - start);
+}
+
+static void
+bench_fds (GDBusConnection *connection,
+           BenchResult     *result)
+{
+  g_autofree gint64 *samples = g_new (gint64, opt_iterations);
+  gint64 start, before;
+  int pipe_fds[2];
+  int i;
+
+  g_assert (pipe (pipe_fds) == 0);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_iterations; i++)
+    {
+      g_autoptr(GUnixFDList) fd_list = g_unix_fd_list_new ();
+      g_autoptr(GUnixFDList) out_fd_list = NULL;
+      g_autoptr(GVariant) reply = NULL;
+      g_autoptr(GError) error = NULL;
+      int handle;
+
+      handle = g_unix_fd_list_append (fd_list, pipe_fds[0], &error);
+      g_assert_no_error (error);
+
+      before = g_get_monotonic_time ();
+      reply = g_dbus_connection_call_with_unix_fd_list_sync (connection, BENCH_NAME, BENCH_PATH,
+                                                             BENCH_IFACE, "EchoFd",
+                                                             g_variant_new ("(h)", handle),
+                                                             G_VARIANT_TYPE ("(h)"),
+                                                             G_DBUS_CALL_FLAGS_NONE,
+                                                             -1, fd_list, &out_fd_list,
+                                                             NULL, &error);
+      g_assert_no_error (error);
+      samples[i] = g_get_monotonic_time () - before;
+    }
+
+  close (pipe_fds[0]);
+  close (pipe_fds[1]);
+
+  fill_result (result, samples, opt_iterations, g_get_monotonic_time () - start);
+}
+
+typedef struct {
+  gint64 *samples;
+  int n_received;
+  gint64 last;
+  gboolean flood_done;
+} FloodData;
+
+static void
+ping_cb (GDBusConnection *connection,
+         const gchar     *sender_name,
+         const gchar     *object_path,
+         const gchar     *interface_name,
+         const gchar     *signal_name,
+         GVariant        *parameters,
+         gpointer         user_data)
+{
+  FloodData *flood = user_data;
+  gint64 now = g_get_monotonic_time ();
+
+  if (flood->n_received < opt_signals)
+    flood->samples[flood->n_received++] = now - flood->last;
+  flood->last = now;
+}
+
+static void
+flood_done_cb (GObject      *source_object,
+               GAsyncResult *res,
+               gpointer      user_data)
+{
+  FloodData *flood = user_data;
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GError) error = NULL;
+
+  reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &error);
+  g_assert_no_error (error);
+  flood->flood_done = TRUE;
+}
+
+/* The samples for the signal flood are the time between two
+   consecutive signals arriving at the client, not latency */
+static void
+bench_signals (GDBusConnection *connection,
+               BenchResult     *result)
+{
+  GMainContext *context = g_main_context_get_thread_default ();
+  FloodData flood = { 0 };
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GError) error = NULL;
+  gint64 start;
+  guint id;
+
+  flood.samples = g_new (gint64, opt_signals);
+
+  id = g_dbus_connection_signal_subscribe (connection, BENCH_NAME, BENCH_IFACE, "Ping", BENCH_PATH,
+                                           NULL, G_DBUS_SIGNAL_FLAGS_NONE, ping_cb, &flood, NULL);
+
+  /* Round trip to make sure the match rule is in place */
+  reply = g_dbus_connection_call_sync (connection, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                                       "org.freedesktop.DBus", "GetId", NULL,
+                                       G_VARIANT_TYPE ("(s)"), G_DBUS_CALL_FLAGS_NONE,
+                                       -1, NULL, &error);
+  g_assert_no_error (error);
+
+  start = flood.last = g_get_monotonic_time ();
+  g_dbus_connection_call (connection, BENCH_NAME, BENCH_PATH, BENCH_IFACE, "Flood",
+                          g_variant_new ("(uu)", opt_signals, opt_payload),
+                          NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+                          flood_done_cb, &flood);
+
+  while (!flood.flood_done || flood.n_received < opt_signals)
+    g_main_context_iteration (context, TRUE);
+
+  g_dbus_connection_signal_unsubscribe (connection, id);
+
+  fill_result (result, flood.samples, opt_signals, g_get_monotonic_time () - start);
+  g_free (flood.samples);
+}
+
+static gpointer
+client_thread (gpointer data)
+{
+  g_autoptr(GMainContext) context = g_main_context_new ();
+  int mode;
+
+  g_main_context_push_thread_default (context);
+
+  for (mode = 0; mode < N_BENCH_MODES; mode++)
+    {
+      g_autoptr(GDBusConnection) connection = NULL;
+      g_autoptr(GError) error = NULL;
+
+      connection = g_dbus_connection_new_for_address_sync (proxy_addresses[mode],
+                                                           G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                           G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                           NULL, NULL, &error);
+      g_assert_no_error (error);
+
+      bench_calls (connection, &results[mode][BENCH_TEST_CALL]);
+      bench_signals (connection, &results[mode][BENCH_TEST_SIGNALS]);
+      bench_fds (connection, &results[mode][BENCH_TEST_FD]);
+
+      g_dbus_connection_close_sync (connection, NULL, NULL);
+    }
+
+  g_main_context_pop_thread_default (context);
+  g_main_loop_quit (main_loop);
+
+  return NULL;
+}
+
+static XdgAppProxy *
+start_proxy (const char *dir,
+             BenchMode   mode)
+{
+  g_autofree char *socket_path = g_build_filename (dir, mode_names[mode], NULL);
+  g_autoptr(XdgAppProxy) proxy = NULL;
+  g_autoptr(GError) error = NULL;
+
+  proxy = xdg_app_proxy_new (bus_address, socket_path);
+  if (mode == BENCH_MODE_FILTER)
+    {
+      xdg_app_proxy_set_filter (proxy, TRUE);
+      xdg_app_proxy_add_policy (proxy, BENCH_NAME, XDG_APP_POLICY_TALK);
+    }
+
+  if (!xdg_app_proxy_start (proxy, &error))
+    g_error ("Failed to start proxy: %s", error->message);
+
+  proxy_addresses[mode] = g_strdup_printf ("unix:path=%s", socket_path);
+
+  return g_steal_pointer (&proxy);
+}
+
+/* Remove the socket of a proxy, so that the directory can be removed
+   without relying on how the proxy was stopped */
+static void
+cleanup_socket (const char *dir,
+                BenchMode   mode)
+{
+  g_autofree char *socket_path = g_build_filename (dir, mode_names[mode], NULL);
+
+  unlink (socket_path);
+}
+
+static void
+print_results (void)
+{
+  int mode, test;
+
+  g_print ("%-12s %-13s %12s %9s %9s %11s %11s\n",
+           "mode", "test", "msgs/sec", "p50(us)", "p99(us)", "+p50(us)", "+p99(us)");
+
+  for (test = 0; test < N_BENCH_TESTS; test++)
+    {
+      BenchResult *direct = &results[BENCH_MODE_DIRECT][test];
+
+      for (mode = 0; mode < N_BENCH_MODES; mode++)
+        {
+          BenchResult *result = &results[mode][test];
+
+          if (!result->valid)
+            continue;
+
+          g_print ("%-12s %-13s %12.0f %9" G_GINT64_FORMAT " %9" G_GINT64_FORMAT
+                   " %11" G_GINT64_FORMAT " %11" G_GINT64_FORMAT "\n",
+                   mode_names[mode], test_names[test], result->rate,
+                   result->p50, result->p99,
+                   result->p50 - direct->p50, result->p99 - direct->p99);
+        }
+    }
+
+  g_print ("\nFor %s the percentiles are the gaps between signal arrivals,\n"
+           "not the latency added by the proxy.\n", test_names[BENCH_TEST_SIGNALS]);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(XdgAppProxy) passthrough_proxy = NULL;
+  g_autoptr(XdgAppProxy) filter_proxy = NULL;
+  g_autofree char *dir = NULL;
+  GTestDBus *dbus;
+  GThread *service, *client;
+
+  context = g_option_context_new ("- benchmark the xdg-app dbus proxy");
+  g_option_context_add_main_entries (context, options, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  if (opt_iterations <= 0 || opt_signals <= 0 || opt_payload < 0)
+    {
+      g_printerr ("Invalid arguments\n");
+      return 1;
+    }
+
+  dir = g_dir_make_tmp ("bench-dbus-proxy-XXXXXX", &error);
+  if (dir == NULL)
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  dbus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_up (dbus);
+  bus_address = g_strdup (g_test_dbus_get_bus_address (dbus));
+
+  service = g_thread_new ("service", service_thread, NULL);
+  g_mutex_lock (&service_lock);
+  while (!service_ready)
+    g_cond_wait (&service_cond, &service_lock);
+  g_mutex_unlock (&service_lock);
+
+  /* The proxies run on the main context, in this thread */
+  proxy_addresses[BENCH_MODE_DIRECT] = g_strdup (bus_address);
+  passthrough_proxy = start_proxy (dir, BENCH_MODE_PASSTHROUGH);
+  filter_proxy = start_proxy (dir, BENCH_MODE_FILTER);
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+  client = g_thread_new ("client", client_thread, NULL);
+  g_main_loop_run (main_loop);
+  g_thread_join (client);
+
+  print_results ();
+
+  xdg_app_proxy_stop (passthrough_proxy);
+  xdg_app_proxy_stop (filter_proxy);
+  cleanup_socket (dir, BENCH_MODE_PASSTHROUGH);
+  cleanup_socket (dir, BENCH_MODE_FILTER);
+  rmdir (dir);
+
+  /* The service thread is still blocked in its main loop, so just
+     tear down the bus under it */
+  g_thread_unref (service);
+  g_test_dbus_down (dbus);
+
+  return 0;
+}
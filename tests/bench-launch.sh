@@ -0,0 +1,138 @@
+#!/bin/sh
+# Benchmarks end-to-end "xdg-app run" latency.
+#
+# Builds a minimal runtime and app into a temporary user installation
+# and then launches a trivial command over and over. It reports p50
+# and p95 times for cold launches (no cached launch plan, and the page
+# cache dropped when running as root) and for warm launches. The times
+# are broken down into the xdg-app front end, the dbus proxy startup
+# and the xdg-app-helper sandbox setup, using XDG_APP_TRACE_FD.
+#
+# Not run as part of make check. Usage:
+#
+#   tests/bench-launch.sh [ITERATIONS]
+#
+# Set XDG_APP to benchmark some other xdg-app than the one in $PATH.
+# The helper and dbus proxy are always the installed ones, so run this
+# after make install.
+
+set -e
+
+XDG_APP=${XDG_APP:-xdg-app}
+ITERATIONS=${1:-20}
+APP=org.test.LaunchBench
+RUNTIME=org.test.LaunchBenchPlatform
+
+# Without a session bus there is no dbus proxy to measure
+if [ -z "$DBUS_SESSION_BUS_ADDRESS" ] && [ -z "$BENCH_LAUNCH_SESSION" ] &&
+   command -v dbus-run-session > /dev/null; then
+    BENCH_LAUNCH_SESSION=1 exec dbus-run-session -- "$0" "$@"
+fi
+
+case $(uname -m) in
+    i?86) ARCH=i386 ;;
+    arm*) ARCH=arm ;;
+    *) ARCH=$(uname -m) ;;
+esac
+
+for TRUE in /usr/bin/true /bin/true; do
+    [ -x $TRUE ] && break
+done
+
+WORK=$(mktemp -d /tmp/bench-launch-XXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+
+export HOME=$WORK/home
+export XDG_DATA_HOME=$WORK/home/.local/share
+export XDG_CACHE_HOME=$WORK/home/.cache
+mkdir -p $XDG_DATA_HOME
+
+echo "Building test runtime and app in $WORK"
+
+# The runtime is mounted on /usr, so it gets a copy of the host's
+# true and the libraries it needs, with any /usr prefix removed
+mkdir -p $WORK/runtime/files/bin
+cp $TRUE $WORK/runtime/files/bin/true
+for lib in $(ldd $TRUE | awk '{ for (i = 1; i <= NF; i++) if ($i ~ /^\//) print $i }'); do
+    dest=$WORK/runtime/files$(echo $lib | sed 's|^/usr||')
+    mkdir -p $(dirname $dest)
+    cp -L $lib $dest
+done
+cat > $WORK/runtime/metadata <<EOF
+[Runtime]
+name=$RUNTIME
+EOF
+
+ostree --repo=$WORK/repo init --mode=archive-z2
+ostree --repo=$WORK/repo commit -s "Launch benchmark runtime" \
+       --branch=runtime/$RUNTIME/$ARCH/master $WORK/runtime > /dev/null
+$XDG_APP repo-update $WORK/repo
+
+$XDG_APP add-remote --user --no-gpg-verify bench file://$WORK/repo
+$XDG_APP install-runtime --user bench $RUNTIME
+
+$XDG_APP build-init $WORK/app $APP $RUNTIME $RUNTIME
+$XDG_APP build-finish --command=true $WORK/app
+$XDG_APP build-export $WORK/repo $WORK/app
+$XDG_APP repo-update $WORK/repo
+$XDG_APP install-app --user bench $APP
+
+# Prints the total, front end, dbus proxy and helper times of one
+# launch, in milliseconds
+run_once () {
+    start=$(date +%s%N)
+    XDG_APP_TRACE_FD=3 $XDG_APP run $APP 3> $WORK/trace > /dev/null
+    end=$(date +%s%N)
+
+    awk -v total=$((end - start)) '
+        $3 == "run:total" { front = $2 - $1 }
+        $3 == "run:dbus-proxy" { proxy = $2 - $1 }
+        $3 == "startup" { helper_start = $1 }
+        $1 ~ /^[0-9]+$/ && $3 !~ /^run:/ && $2 > helper_end { helper_end = $2 }
+        END {
+            printf "%.3f %.3f %.3f %.3f\n", total / 1000000, front / 1000,
+                   proxy / 1000, (helper_end - helper_start) / 1000
+        }' $WORK/trace
+}
+
+percentile () {
+    cut -d' ' -f$2 $1 | sort -n | awk -v p=$3 '
+        { v[NR] = $1 }
+        END { i = int ((NR * p + 99) / 100); if (i < 1) i = 1; printf "%9.2f", v[i] }'
+}
+
+report () {
+    col=1
+    for what in total front-end dbus-proxy helper; do
+        echo "$1 $what $(percentile $2 $col 50) $(percentile $2 $col 95)" |
+            awk '{ printf "%-5s %-11s %9s %9s\n", $1, $2, $3, $4 }'
+        col=$((col + 1))
+    done
+}
+
+echo "Running $ITERATIONS cold launches"
+: > $WORK/cold
+i=0
+while [ $i -lt $ITERATIONS ]; do
+    rm -f $XDG_CACHE_HOME/xdg-app/launch-plans/$APP
+    if [ -w /proc/sys/vm/drop_caches ]; then
+        sync
+        echo 3 > /proc/sys/vm/drop_caches
+    fi
+    run_once >> $WORK/cold
+    i=$((i + 1))
+done
+
+echo "Running $ITERATIONS warm launches"
+run_once > /dev/null
+: > $WORK/warm
+i=0
+while [ $i -lt $ITERATIONS ]; do
+    run_once >> $WORK/warm
+    i=$((i + 1))
+done
+
+echo
+printf "%-17s %9s %9s\n" "(ms)" p50 p95
+report cold $WORK/cold
+report warm $WORK/warm